@@ -0,0 +1,74 @@
+#include "Arena.h"
+#include <cstdint>
+
+void * re::Arena::Allocate(size_t size, size_t alignment)
+{
+	auto align = [alignment](char * data, size_t offset) {
+		auto address = reinterpret_cast<uintptr_t>(data) + offset;
+		return offset + (alignment - address % alignment) % alignment;
+	};
+
+	while (m_Current < m_Blocks.size())
+	{
+		auto& block = m_Blocks[m_Current];
+		size_t offset = align(block.Data.get(), m_Offset);
+
+		if (offset + size <= block.Size)
+		{
+			m_Offset = offset + size;
+			block.Used = m_Offset;
+			return block.Data.get() + offset;
+		}
+
+		// Move to the next block. If it's too small it's replaced, so that the
+		// number of blocks doesn't grow when the same data is built again
+		m_Current++;
+		m_Offset = 0;
+
+		if (m_Current < m_Blocks.size() && m_Blocks[m_Current].Size < size + alignment)
+			m_Blocks.erase(m_Blocks.begin() + m_Current);
+		else if (m_Current < m_Blocks.size())
+			continue;
+
+		break;
+	}
+
+	Block block;
+	block.Size = std::max(m_BlockSize, size + alignment);
+	block.Data.reset(new char[block.Size]);
+
+	m_Current = std::min(m_Current, m_Blocks.size());
+	m_Blocks.insert(m_Blocks.begin() + m_Current, std::move(block));
+	m_Offset = 0;
+
+	return Allocate(size, alignment);
+}
+
+void re::Arena::Rewind(const Marker & marker)
+{
+	m_Current = marker.Block;
+	m_Offset = marker.Offset;
+
+	if (m_Current < m_Blocks.size())
+		m_Blocks[m_Current].Used = m_Offset;
+}
+
+size_t re::Arena::GetCapacity() const
+{
+	size_t result = 0;
+
+	for (auto& block : m_Blocks)
+		result += block.Size;
+
+	return result;
+}
+
+size_t re::Arena::GetUsed() const
+{
+	size_t result = 0;
+
+	for (size_t i = 0; i < m_Blocks.size() && i <= m_Current; i++)
+		result += i < m_Current ? m_Blocks[i].Used : m_Offset;
+
+	return result;
+}
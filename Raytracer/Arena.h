@@ -0,0 +1,85 @@
+#pragma once
+#include "Common.h"
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace re
+{
+	/// Monotonic allocator for data that is built and released all together, like compiled
+	/// scenes and acceleration structures. Memory is taken from large blocks which are kept
+	/// when the arena is reset, so building the same data again doesn't allocate anything.
+	/// Destructors are never called: only trivially destructible types can be allocated
+	class Arena
+	{
+	public:
+
+		static constexpr size_t DefaultBlockSize = 1024 * 1024;
+
+		/// Position in the arena. Allocations made after a marker are released by Rewind
+		struct Marker
+		{
+			size_t Block = 0;
+			size_t Offset = 0;
+		};
+
+		explicit Arena(size_t blockSize = DefaultBlockSize) : m_BlockSize(blockSize) {}
+
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		void * Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+		/// Allocates and default constructs an array
+		template<typename T>
+		T * Allocate(size_t count)
+		{
+			static_assert(std::is_trivially_destructible<T>::value, "Arena objects are never destroyed");
+
+			T * result = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+
+			for (size_t i = 0; i < count; i++)
+				new (result + i) T();
+
+			return result;
+		}
+
+		/// Allocates a copy of the given array
+		template<typename T>
+		Span<T> Copy(const T * data, size_t count)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "Arena copies are bitwise");
+
+			T * result = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+			std::copy(data, data + count, result);
+			return { result, count };
+		}
+
+		Marker GetMarker() const { return { m_Current, m_Offset }; }
+		void Rewind(const Marker& marker);
+
+		/// Releases every allocation in O(1). The blocks are kept for the next allocations
+		void Reset() { Rewind({}); }
+
+		/// Returns the size of all the blocks
+		size_t GetCapacity() const;
+
+		/// Returns the number of bytes currently allocated, padding included
+		size_t GetUsed() const;
+
+	private:
+
+		struct Block
+		{
+			std::unique_ptr<char[]> Data;
+			size_t Size = 0;
+			size_t Used = 0;
+		};
+
+		size_t m_BlockSize;
+		std::vector<Block> m_Blocks;
+		size_t m_Current = 0, m_Offset = 0;
+	};
+}
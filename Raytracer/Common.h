@@ -1,6 +1,8 @@
 #pragma once
 #include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <limits>
 #include <vector>
 namespace re
 {
@@ -14,11 +16,6 @@ namespace re
 		return da + (value - sa) / (sb - sa)*(db - da);
 	}
 
-	template<typename T> inline T Random(T min = 0, T max = 1)
-	{
-		return (T)(min + (max - min) * ((double)rand() / RAND_MAX));
-	}
-
 	template<typename T> inline T Clamp(T value, T min, T max)
 	{
 		return std::max(min, std::min(max, value));
@@ -140,6 +137,71 @@ namespace re
 		static Matrix4 GetScale(const Vector3& translation);
 	};
 
+	/// 3x4 affine transform (the last row of a Matrix4 is implicitly 0, 0, 0, 1)
+	struct AffineTransform
+	{
+	public:
+		real Elements[12];
+
+		AffineTransform() : AffineTransform(Matrix4::Identity) {}
+		AffineTransform(const Matrix4& m)
+		{
+			for (int i = 0; i < 12; i++)
+				Elements[i] = m[i];
+		}
+
+		Vector3 TransformPoint(const Vector3& p) const
+		{
+			return {
+				Elements[0] * p.X + Elements[1] * p.Y + Elements[2] * p.Z + Elements[3],
+				Elements[4] * p.X + Elements[5] * p.Y + Elements[6] * p.Z + Elements[7],
+				Elements[8] * p.X + Elements[9] * p.Y + Elements[10] * p.Z + Elements[11]
+			};
+		}
+
+		Vector3 TransformVector(const Vector3& v) const
+		{
+			return {
+				Elements[0] * v.X + Elements[1] * v.Y + Elements[2] * v.Z,
+				Elements[4] * v.X + Elements[5] * v.Y + Elements[6] * v.Z,
+				Elements[8] * v.X + Elements[9] * v.Y + Elements[10] * v.Z
+			};
+		}
+
+		/// Multiplies the vector by the transposed linear part. Called on the inverse
+		/// transform, it transforms normals
+		Vector3 TransformNormal(const Vector3& n) const
+		{
+			return {
+				Elements[0] * n.X + Elements[4] * n.Y + Elements[8] * n.Z,
+				Elements[1] * n.X + Elements[5] * n.Y + Elements[9] * n.Z,
+				Elements[2] * n.X + Elements[6] * n.Y + Elements[10] * n.Z
+			};
+		}
+	};
+
+	/// Non-owning view on a contiguous array
+	template<typename T>
+	class Span
+	{
+	public:
+		Span() {}
+		Span(T * data, size_t size) : m_Data(data), m_Size(size) {}
+
+		T * GetData() const { return m_Data; }
+		size_t GetSize() const { return m_Size; }
+		bool IsEmpty() const { return m_Size == 0; }
+
+		T& operator[](size_t index) const { return m_Data[index]; }
+
+		T * begin() const { return m_Data; }
+		T * end() const { return m_Data + m_Size; }
+
+	private:
+		T * m_Data = nullptr;
+		size_t m_Size = 0;
+	};
+
 
 
 	std::ostream& operator<<(std::ostream& os, const Vector3& v);
@@ -194,6 +256,33 @@ namespace re
 	struct Ray
 	{
 		Vector3 Origin = Vector3::Zero, Direction = Vector3::Forward;
+
+		/// Range of the ray, in units of Direction. Used by the hit queries (Scene::Intersect,
+		/// Scene::Occluded and Scene::CastRay)
+		real TMin = 0, TMax = std::numeric_limits<real>::max();
+	};
+
+	/// Change of the origin and of the direction of a ray from one pixel to the next, along the
+	/// X and the Y axis of the screen (see Igehy, "Tracing Ray Differentials"). Used to find the
+	/// size of the footprint of a pixel on the surfaces
+	struct RayDifferential
+	{
+		Vector3 OriginX = Vector3::Zero, OriginY = Vector3::Zero;
+		Vector3 DirectionX = Vector3::Zero, DirectionY = Vector3::Zero;
+	};
+
+	/// Compact result of a hit query. T is the distance along the ray in units of its direction.
+	/// On triangles U and V are the baricentric coordinates of the second and third vertex
+	struct Hit
+	{
+		static constexpr uint32_t InvalidID = 0xffffffffu;
+
+		real T = std::numeric_limits<real>::max();
+		uint32_t PrimitiveID = InvalidID;
+		uint32_t InstanceID = InvalidID;
+		real U = 0, V = 0;
+
+		bool IsHit() const { return InstanceID != InvalidID; }
 	};
 
 	struct RayHitResult
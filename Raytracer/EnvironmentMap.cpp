@@ -0,0 +1,113 @@
+#include "EnvironmentMap.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+#include <cmath>
+
+namespace re
+{
+	namespace
+	{
+		inline real SignNotZero(real value)
+		{
+			return value < 0 ? (real)-1 : (real)1;
+		}
+	}
+}
+
+void re::EnvironmentMap::Bake(const std::shared_ptr<Background>& background, unsigned int resolution)
+{
+	resolution = std::max(resolution, 1u);
+
+	if (IsBakedFrom(background.get()) && m_Resolution == resolution)
+		return;
+
+	std::vector<float> texels(size_t(resolution) * resolution * 3);
+
+	ThreadPool::GetDefault().ParallelFor(resolution, 1, [&](size_t begin, size_t end) {
+
+		for (size_t y = begin; y < end; y++)
+		{
+			for (size_t x = 0; x < resolution; x++)
+			{
+				Vector2 position((x + 0.5) / resolution * 2 - 1, (y + 0.5) / resolution * 2 - 1);
+				Color color = background->GetBakedColor(Decode(position));
+
+				float * texel = &texels[(y * resolution + x) * 3];
+				texel[0] = static_cast<float>(color.R);
+				texel[1] = static_cast<float>(color.G);
+				texel[2] = static_cast<float>(color.B);
+			}
+		}
+	});
+
+	m_Background = background;
+	m_Resolution = resolution;
+	m_Texels = std::move(texels);
+}
+
+void re::EnvironmentMap::Clear()
+{
+	m_Background = nullptr;
+	m_Resolution = 0;
+	m_Texels = std::vector<float>();
+}
+
+re::Color re::EnvironmentMap::Sample(const Vector3 & direction) const
+{
+	const int size = static_cast<int>(m_Resolution);
+
+	Vector2 position = Encode(direction);
+
+	real x = (position.X + 1) / 2 * size - 0.5;
+	real y = (position.Y + 1) / 2 * size - 0.5;
+	real cellX = std::floor(x), cellY = std::floor(y);
+	real tx = x - cellX, ty = y - cellY;
+
+	// Texels past an edge are the mirrored ones on the same edge, this is how the octahedron unfolds
+	auto fetch = [&](int ix, int iy) -> const float * {
+		if (iy < 0) { iy = 0; ix = size - 1 - ix; }
+		else if (iy >= size) { iy = size - 1; ix = size - 1 - ix; }
+
+		if (ix < 0) { ix = 0; iy = size - 1 - iy; }
+		else if (ix >= size) { ix = size - 1; iy = size - 1 - iy; }
+
+		return &m_Texels[(size_t(iy) * size + ix) * 3];
+	};
+
+	int x0 = static_cast<int>(cellX), y0 = static_cast<int>(cellY);
+
+	const float * a = fetch(x0, y0);
+	const float * b = fetch(x0 + 1, y0);
+	const float * c = fetch(x0, y0 + 1);
+	const float * d = fetch(x0 + 1, y0 + 1);
+
+	real rgb[3];
+
+	for (int i = 0; i < 3; i++)
+		rgb[i] = Lerp(Lerp<real>(a[i], b[i], tx), Lerp<real>(c[i], d[i], tx), ty);
+
+	return Color(rgb[0], rgb[1], rgb[2]);
+}
+
+re::Vector2 re::EnvironmentMap::Encode(const Vector3 & direction)
+{
+	// The upper hemisphere (Y > 0) is the inner diamond, the lower one is folded on the corners
+	real length = std::abs(direction.X) + std::abs(direction.Y) + std::abs(direction.Z);
+	real u = direction.X / length, v = direction.Z / length;
+
+	if (direction.Y < 0)
+		return Vector2((1 - std::abs(v)) * SignNotZero(u), (1 - std::abs(u)) * SignNotZero(v));
+
+	return Vector2(u, v);
+}
+
+re::Vector3 re::EnvironmentMap::Decode(const Vector2 & position)
+{
+	real u = position.X, v = position.Y;
+	real y = 1 - std::abs(u) - std::abs(v);
+
+	if (y < 0)
+		return Vector3((1 - std::abs(v)) * SignNotZero(u), y, (1 - std::abs(u)) * SignNotZero(v)).Normalized();
+
+	return Vector3(u, y, v).Normalized();
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "Common.h"
+#include <memory>
+#include <vector>
+
+namespace re
+{
+	class Background;
+
+	/// Colors of a background baked on an octahedral map: the sphere of directions is folded on
+	/// an octahedron and unfolded on a square, so every texel covers about the same solid angle and
+	/// there are no poles. Lookups interpolate the 4 closest texels
+	class EnvironmentMap
+	{
+	public:
+		/// Samples Background::GetBakedColor at the center of resolution^2 texels. The bake is kept
+		/// if it was made from the same background at the same resolution
+		void Bake(const std::shared_ptr<Background>& background, unsigned int resolution);
+		void Clear();
+
+		bool IsBaked() const { return !m_Texels.empty(); }
+		bool IsBakedFrom(const Background * background) const { return IsBaked() && m_Background.get() == background; }
+
+		unsigned int GetResolution() const { return m_Resolution; }
+		size_t GetMemoryUsage() const { return m_Texels.size() * sizeof(float); }
+
+		/// Bilinear lookup, the direction doesn't need to be normalized
+		Color Sample(const Vector3& direction) const;
+
+		/// Position in [-1, 1]^2 of a direction on the map, and the opposite
+		static Vector2 Encode(const Vector3& direction);
+		static Vector3 Decode(const Vector2& position);
+
+	private:
+		std::shared_ptr<Background> m_Background;
+		unsigned int m_Resolution = 0;
+
+		// RGB of every texel, row by row
+		std::vector<float> m_Texels;
+	};
+}
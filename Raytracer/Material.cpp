@@ -6,11 +6,246 @@ const re::UniformMaterial re::UniformMaterial::OpaqueWhite =
 const re::UniformMaterial re::UniformMaterial::OpaqueBlack =
 	re::UniformMaterial(re::Color::Black, 1.0);
 
+re::real re::NoiseSampleCache::Sample(Noise & noise, const Vector3 & point)
+{
+	for (size_t i = 0; i < m_Count; i++)
+		if (m_Noises[i] == &noise)
+			return m_Values[i];
+
+	real value = noise.SampleFiltered(point, m_Footprint);
+
+	if (m_Count < Capacity)
+	{
+		m_Noises[m_Count] = &noise;
+		m_Values[m_Count] = value;
+		m_Count++;
+	}
+
+	return value;
+}
+
+re::SurfaceSample re::CompiledMaterial::Evaluate(const Vector3 & point, real footprint, const TexCoordSample & texCoord) const
+{
+	real samples[MaxNoises];
+
+	for (size_t i = 0; i < m_Noises.GetSize(); i++)
+		samples[i] = m_Noises[i]->SampleFiltered(point, footprint);
+
+	Sample registers[MaxRegisters];
+
+	auto get = [&](Value value) -> const Sample& {
+		return (value & ConstantFlag) ? m_Constants[value & ~ConstantFlag] : registers[value];
+	};
+
+	for (const auto& instruction : m_Instructions)
+	{
+		Sample result;
+
+		switch (instruction.OpCode)
+		{
+		case OpCodes::Interpolate:
+		{
+			const Sample& a = get(instruction.A);
+			const Sample& b = get(instruction.B);
+			real t = samples[instruction.Noise];
+
+			// Same clamps as Lerp on colors
+			for (int i = 0; i < 3; i++)
+				result.Color[i] = Clamp(Clamp(a.Color[i] * (1 - t), (real)0, (real)1) + Clamp(b.Color[i] * t, (real)0, (real)1), (real)0, (real)1);
+
+			result.Absorptance = Lerp(a.Absorptance, b.Absorptance, t);
+			result.Reflectance = Lerp(a.Reflectance, b.Reflectance, t);
+			break;
+		}
+		case OpCodes::Evaluate:
+		{
+			NoiseSampleCache cache(footprint, texCoord);
+			result = ToSample(instruction.Material->Evaluate(point, cache));
+			break;
+		}
+		}
+
+		registers[instruction.Register] = result;
+	}
+
+	const Sample& result = get(m_Result);
+	return { Color(result.Color[0], result.Color[1], result.Color[2]), result.Absorptance, result.Reflectance };
+}
+
+re::CompiledMaterial::Sample re::CompiledMaterial::ToSample(const SurfaceSample & sample)
+{
+	return { { sample.AbsorbedColor.R, sample.AbsorbedColor.G, sample.AbsorbedColor.B }, sample.Absorptance, sample.Reflectance };
+}
+
+size_t re::CompiledMaterial::GetMemoryUsage() const
+{
+	return sizeof(CompiledMaterial) + m_Instructions.GetSize() * sizeof(Instruction) +
+		m_Constants.GetSize() * sizeof(Sample) + m_Noises.GetSize() * sizeof(Noise*);
+}
+
+re::CompiledMaterial::Value re::MaterialCompiler::AddConstant(const SurfaceSample & sample)
+{
+	m_Constants.push_back(CompiledMaterial::ToSample(sample));
+	return static_cast<Value>(m_Constants.size() - 1) | CompiledMaterial::ConstantFlag;
+}
+
+re::CompiledMaterial::Value re::MaterialCompiler::AddInterpolation(Noise & noise, Value value0, Value value1)
+{
+	constexpr Value ConstantFlag = CompiledMaterial::ConstantFlag;
+
+	if (value0 == value1)
+		return value0;
+
+	if ((value0 & ConstantFlag) && (value1 & ConstantFlag))
+	{
+		const auto& a = m_Constants[value0 & ~ConstantFlag];
+		const auto& b = m_Constants[value1 & ~ConstantFlag];
+
+		if (a.Color[0] == b.Color[0] && a.Color[1] == b.Color[1] && a.Color[2] == b.Color[2] &&
+			a.Absorptance == b.Absorptance && a.Reflectance == b.Reflectance)
+			return value0;
+	}
+
+	size_t noiseIndex = static_cast<size_t>(std::find(m_Noises.begin(), m_Noises.end(), &noise) - m_Noises.begin());
+
+	if (noiseIndex == m_Noises.size())
+		m_Noises.push_back(&noise);
+
+	CompiledMaterial::Instruction instruction;
+	instruction.OpCode = CompiledMaterial::OpCodes::Interpolate;
+	instruction.Noise = static_cast<uint16_t>(noiseIndex);
+	instruction.A = value0;
+	instruction.B = value1;
+	m_Instructions.push_back(instruction);
+
+	return static_cast<Value>(m_Instructions.size() - 1);
+}
+
+re::CompiledMaterial::Value re::MaterialCompiler::AddEvaluation(Material & material)
+{
+	CompiledMaterial::Instruction instruction;
+	instruction.OpCode = CompiledMaterial::OpCodes::Evaluate;
+	instruction.Material = &material;
+	m_Instructions.push_back(instruction);
+
+	return static_cast<Value>(m_Instructions.size() - 1);
+}
+
+bool re::MaterialCompiler::Compile(Material & material, Arena & arena, CompiledMaterial & result)
+{
+	m_Instructions.clear();
+	m_Constants.clear();
+	m_Noises.clear();
+
+	Value value = material.Compile(*this);
+
+	if (m_Noises.size() > CompiledMaterial::MaxNoises)
+		return false;
+
+	if (!(value & CompiledMaterial::ConstantFlag))
+	{
+		if (!AllocateRegisters(value))
+			return false;
+
+		value = m_Instructions[value].Register;
+	}
+
+	result.m_Instructions = arena.Copy(m_Instructions.data(), m_Instructions.size());
+	result.m_Constants = arena.Copy(m_Constants.data(), m_Constants.size());
+	result.m_Noises = arena.Copy(m_Noises.data(), m_Noises.size());
+	result.m_Result = value;
+
+	return true;
+}
+
+bool re::MaterialCompiler::AllocateRegisters(Value result)
+{
+	constexpr Value ConstantFlag = CompiledMaterial::ConstantFlag;
+	const size_t count = m_Instructions.size();
+
+	// Last instruction reading each result, the result of the tree is read at the end
+	std::vector<size_t> lastUse(count, 0);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const auto& instruction = m_Instructions[i];
+
+		if (instruction.OpCode != CompiledMaterial::OpCodes::Interpolate)
+			continue;
+
+		if (!(instruction.A & ConstantFlag)) lastUse[instruction.A] = i;
+		if (!(instruction.B & ConstantFlag)) lastUse[instruction.B] = i;
+	}
+
+	lastUse[result] = count;
+
+	// Registers are released after their last read, so a tree needs about as many registers as its depth
+	std::vector<uint8_t> freeRegisters;
+
+	for (size_t i = 0; i < CompiledMaterial::MaxRegisters; i++)
+		freeRegisters.push_back(static_cast<uint8_t>(CompiledMaterial::MaxRegisters - 1 - i));
+
+	for (size_t i = 0; i < count; i++)
+	{
+		auto& instruction = m_Instructions[i];
+
+		if (instruction.OpCode == CompiledMaterial::OpCodes::Interpolate)
+		{
+			for (Value* operand : { &instruction.A, &instruction.B })
+			{
+				if (*operand & ConstantFlag)
+					continue;
+
+				Value source = *operand;
+				*operand = m_Instructions[source].Register;
+
+				// The operands are different values, AddInterpolation folds the others
+				if (lastUse[source] == i)
+					freeRegisters.push_back(m_Instructions[source].Register);
+			}
+		}
+
+		if (freeRegisters.empty())
+			return false;
+
+		instruction.Register = freeRegisters.back();
+		freeRegisters.pop_back();
+	}
+
+	return true;
+}
+
 re::real re::Material::GetReflectance(const Vector3 & point)
 {
 	return (real)(1.0 - GetAbsorptance(point));
 }
 
+re::SurfaceSample re::Material::Evaluate(const Vector3 & point, real footprint, const TexCoordSample & texCoord)
+{
+	NoiseSampleCache cache(footprint, texCoord);
+	return Evaluate(point, cache);
+}
+
+re::SurfaceSample re::Material::Evaluate(const Vector3 & point, NoiseSampleCache & cache)
+{
+	return { GetAbsorbedColor(point), GetAbsorptance(point), GetReflectance(point) };
+}
+
+re::CompiledMaterial::Value re::Material::Compile(MaterialCompiler & compiler)
+{
+	return compiler.AddEvaluation(*this);
+}
+
+re::SurfaceSample re::UniformMaterial::Evaluate(const Vector3 & point, NoiseSampleCache & cache)
+{
+	return { m_AbsorbedColor, m_Absorptance, (real)(1.0 - m_Absorptance) };
+}
+
+re::CompiledMaterial::Value re::UniformMaterial::Compile(MaterialCompiler & compiler)
+{
+	return compiler.AddConstant(Evaluate(Vector3::Zero));
+}
+
 re::InterpolatedMaterial::InterpolatedMaterial(std::shared_ptr<Noise> noise, std::shared_ptr<Material> material0, std::shared_ptr<Material> material1) :
 	m_Noise(noise),
 	m_Material0(material0),
@@ -27,3 +262,51 @@ re::real re::InterpolatedMaterial::GetAbsorptance(const Vector3 & point)
 {
 	return Lerp(m_Material0->GetAbsorptance(point), m_Material1->GetAbsorptance(point), m_Noise->Sample(point));
 }
+
+re::real re::InterpolatedMaterial::GetReflectance(const Vector3 & point)
+{
+	return Lerp(m_Material0->GetReflectance(point), m_Material1->GetReflectance(point), m_Noise->Sample(point));
+}
+
+re::SurfaceSample re::InterpolatedMaterial::Evaluate(const Vector3 & point, NoiseSampleCache & cache)
+{
+	real t = cache.Sample(*m_Noise, point);
+
+	SurfaceSample sample0 = m_Material0->Evaluate(point, cache);
+	SurfaceSample sample1 = m_Material1->Evaluate(point, cache);
+
+	return {
+		Lerp(sample0.AbsorbedColor, sample1.AbsorbedColor, t),
+		Lerp(sample0.Absorptance, sample1.Absorptance, t),
+		Lerp(sample0.Reflectance, sample1.Reflectance, t)
+	};
+}
+
+re::CompiledMaterial::Value re::InterpolatedMaterial::Compile(MaterialCompiler & compiler)
+{
+	auto value0 = m_Material0->Compile(compiler);
+	auto value1 = m_Material1->Compile(compiler);
+
+	return compiler.AddInterpolation(*m_Noise, value0, value1);
+}
+
+void re::InterpolatedMaterial::GetNoises(std::vector<Noise*>& noises)
+{
+	noises.push_back(m_Noise.get());
+	m_Material0->GetNoises(noises);
+	m_Material1->GetNoises(noises);
+}
+
+re::TextureMaterial::TextureMaterial(std::shared_ptr<Texture> texture, real absorptance) :
+	m_Texture(texture),
+	m_Absorptance(absorptance)
+{
+}
+
+re::SurfaceSample re::TextureMaterial::Evaluate(const Vector3 & point, NoiseSampleCache & cache)
+{
+	const TexCoordSample& texCoord = cache.GetTexCoord();
+	Color color = texCoord.Valid ? m_Texture->Sample(texCoord.TexCoord, texCoord.Footprint) : m_Texture->GetMeanColor();
+
+	return { color, m_Absorptance, (real)(1.0 - m_Absorptance) };
+}
@@ -1,18 +1,162 @@
 #pragma once
 #include "Common.h"
+#include "Arena.h"
+#include "Texture.h"
 #include "noise/CheckerBoard.h"
 #include <memory>
+#include <vector>
 
 
 namespace re
 {
 
+	/// Properties of a material at a point
+	struct SurfaceSample
+	{
+		Color AbsorbedColor;
+		real Absorptance;
+		real Reflectance;
+	};
+
+	/// Texture coordinates of a hit, see Shape::GetTexCoord
+	struct TexCoordSample
+	{
+		bool Valid = false; /// False if the shape has no texture coordinates
+		Vector2 TexCoord = Vector2::Zero;
+		real Footprint = 0; /// Width of the sample in texture coordinates, see Texture::Sample
+	};
+
+	/// Noise values sampled at the point of a hit, so that a noise used by several materials of
+	/// the same tree is sampled once. Noises past the capacity are sampled every time. The noises
+	/// are filtered with the footprint of the hit, see Noise::SampleFiltered. The cache also holds
+	/// the texture coordinates of the hit, for the materials that use them
+	class NoiseSampleCache
+	{
+	public:
+		explicit NoiseSampleCache(real footprint = 0, const TexCoordSample& texCoord = {}) :
+			m_Footprint(footprint), m_TexCoord(texCoord) {}
+
+		real Sample(Noise& noise, const Vector3& point);
+
+		const TexCoordSample& GetTexCoord() const { return m_TexCoord; }
+
+	private:
+		static constexpr size_t Capacity = 8;
+
+		real m_Footprint;
+		TexCoordSample m_TexCoord;
+
+		Noise * m_Noises[Capacity];
+		real m_Values[Capacity];
+		size_t m_Count = 0;
+	};
+
+	class Material;
+
+	/// Material tree flattened into a list of instructions by MaterialCompiler. The noises of the
+	/// tree are sampled once, then the instructions interpolate the samples without virtual calls.
+	/// UniformMaterial subtrees are folded into constants. The compiled material points to the
+	/// materials and the noises of the tree, which must outlive it
+	class CompiledMaterial
+	{
+	public:
+		/// Operand of an instruction: a constant when ConstantFlag is set, otherwise a register (the
+		/// index of an instruction while the material is compiled)
+		using Value = uint32_t;
+		static constexpr Value ConstantFlag = 0x80000000u;
+
+		/// Largest trees that can be compiled, see MaterialCompiler::Compile
+		static constexpr size_t MaxNoises = 16;
+		static constexpr size_t MaxRegisters = 8;
+
+		enum class OpCodes : uint8_t
+		{
+			Interpolate, /// Lerp of A and B by the sample of Noise
+			Evaluate /// Virtual call to Material::Evaluate, for the materials that can't be compiled
+		};
+
+		struct Instruction
+		{
+			OpCodes OpCode = OpCodes::Interpolate;
+			uint8_t Register = 0;
+			uint16_t Noise = 0;
+			Value A = 0, B = 0;
+			re::Material * Material = nullptr;
+		};
+
+		/// The footprint of the hit filters the noises, see Noise::SampleFiltered
+		SurfaceSample Evaluate(const Vector3& point, real footprint = 0, const TexCoordSample& texCoord = {}) const;
+
+		size_t GetInstructionCount() const { return m_Instructions.GetSize(); }
+		size_t GetNoiseCount() const { return m_Noises.GetSize(); }
+
+		/// Bytes of the instructions, the constants and the noise list
+		size_t GetMemoryUsage() const;
+
+	private:
+		friend class MaterialCompiler;
+
+		/// SurfaceSample as plain reals, so that the interpreter doesn't go through the Color operators
+		struct Sample
+		{
+			real Color[3];
+			real Absorptance, Reflectance;
+		};
+
+		static Sample ToSample(const SurfaceSample& sample);
+
+		Span<Instruction> m_Instructions;
+		Span<Sample> m_Constants;
+		Span<Noise*> m_Noises;
+		Value m_Result = 0;
+	};
+
+	/// Builds a CompiledMaterial. Materials add their instructions in Material::Compile, every
+	/// Add function returns the value of the instruction to use as an operand of the next ones
+	class MaterialCompiler
+	{
+	public:
+		using Value = CompiledMaterial::Value;
+
+		Value AddConstant(const SurfaceSample& sample);
+
+		/// Equal operands are folded
+		Value AddInterpolation(Noise& noise, Value value0, Value value1);
+		Value AddEvaluation(Material& material);
+
+		/// Compiles the tree of the material into the arena. Returns false if the tree uses more
+		/// noises or registers than CompiledMaterial allows
+		bool Compile(Material& material, Arena& arena, CompiledMaterial& result);
+
+	private:
+		bool AllocateRegisters(Value result);
+
+		std::vector<CompiledMaterial::Instruction> m_Instructions;
+		std::vector<CompiledMaterial::Sample> m_Constants;
+		std::vector<Noise*> m_Noises;
+	};
+
 	class Material
 	{
 	public:
 		virtual Color GetAbsorbedColor(const Vector3& point) = 0;
 		virtual real GetAbsorptance(const Vector3& point) = 0;
 		virtual real GetReflectance(const Vector3& point);
+
+		/// Every property at once, this is what the renderer calls on a hit. The footprint of the hit
+		/// filters the noises, see Noise::SampleFiltered
+		SurfaceSample Evaluate(const Vector3& point, real footprint = 0, const TexCoordSample& texCoord = {});
+
+		/// The default implementation calls the getters above. Materials override it to share the work
+		/// between the properties, and must sample their noises through the cache
+		virtual SurfaceSample Evaluate(const Vector3& point, NoiseSampleCache& cache);
+
+		/// Adds the instructions of the material, see Scene::Compile. The default implementation
+		/// adds a call to Evaluate
+		virtual CompiledMaterial::Value Compile(MaterialCompiler& compiler);
+
+		/// Adds the noises sampled by the material, see Scene::NoiseBake
+		virtual void GetNoises(std::vector<Noise*>& noises) {}
 	};
 
 	class UniformMaterial : public Material
@@ -26,6 +170,10 @@ namespace re
 
 		virtual Color GetAbsorbedColor(const Vector3& point) override { return m_AbsorbedColor; }
 		virtual real GetAbsorptance(const Vector3& point) override { return m_Absorptance; }
+
+		using Material::Evaluate;
+		virtual SurfaceSample Evaluate(const Vector3& point, NoiseSampleCache& cache) override;
+		virtual CompiledMaterial::Value Compile(MaterialCompiler& compiler) override;
 	private:
 		Color m_AbsorbedColor;
 		real m_Absorptance;
@@ -39,6 +187,14 @@ namespace re
 
 		virtual Color GetAbsorbedColor(const Vector3& point) override;
 		virtual real GetAbsorptance(const Vector3& point) override;
+		virtual real GetReflectance(const Vector3& point) override;
+
+		/// The noise is sampled once for the three properties
+		using Material::Evaluate;
+		virtual SurfaceSample Evaluate(const Vector3& point, NoiseSampleCache& cache) override;
+		virtual CompiledMaterial::Value Compile(MaterialCompiler& compiler) override;
+
+		virtual void GetNoises(std::vector<Noise*>& noises) override;
 
 	private:
 		std::shared_ptr<Material> m_Material0, m_Material1;
@@ -46,4 +202,23 @@ namespace re
 
 	};
 
+	/// Color read from a texture at the texture coordinates of the hit, with a uniform absorptance.
+	/// Shapes without texture coordinates get the mean color of the texture, and so do the getters,
+	/// which don't know the texture coordinates
+	class TextureMaterial : public Material
+	{
+	public:
+		TextureMaterial(std::shared_ptr<Texture> texture, real absorptance);
+
+		virtual Color GetAbsorbedColor(const Vector3& point) override { return m_Texture->GetMeanColor(); }
+		virtual real GetAbsorptance(const Vector3& point) override { return m_Absorptance; }
+
+		using Material::Evaluate;
+		virtual SurfaceSample Evaluate(const Vector3& point, NoiseSampleCache& cache) override;
+
+	private:
+		std::shared_ptr<Texture> m_Texture;
+		real m_Absorptance;
+	};
+
 }
\ No newline at end of file
@@ -0,0 +1,1114 @@
+#include "Mesh.h"
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+namespace re {
+
+	namespace
+	{
+		constexpr unsigned int KDTreeMaxDepth = 100;
+		constexpr size_t FileAlignment = 64;
+
+		static_assert(std::is_trivially_copyable<TriangleData>::value, "TriangleData must be trivially copyable to be serialized");
+		static_assert(std::is_trivially_copyable<MeshAsset::KDNode>::value, "KDNode must be trivially copyable to be serialized");
+		static_assert(sizeof(MeshAsset::QuantizedKDNode<uint16_t>) == 20, "Unexpected QuantizedKDNode size");
+		static_assert(sizeof(MeshAsset::QuantizedKDNode<uint8_t>) == 16, "Unexpected QuantizedKDNode size");
+
+		enum MeshFileSection { Positions, Normals, TexCoords, Indices, Triangles, Nodes, TriangleIndices, SectionCount };
+
+		/// Header of a serialized MeshAsset. Sections start at the given offsets, aligned to FileAlignment
+		struct MeshFileHeader
+		{
+			char Magic[4];
+			uint32_t Version;
+			uint64_t Key;
+			uint32_t RealSize, TriangleSize, NodeSize, NodeFormat;
+			struct { uint64_t Offset, Count; } Sections[SectionCount];
+			Vector3 Min, Max;
+		};
+
+		size_t GetNodeSize(NodeFormats format)
+		{
+			switch (format)
+			{
+			case NodeFormats::Quantized16: return sizeof(MeshAsset::QuantizedKDNode<uint16_t>);
+			case NodeFormats::Quantized8: return sizeof(MeshAsset::QuantizedKDNode<uint8_t>);
+			default: return sizeof(MeshAsset::KDNode);
+			}
+		}
+
+		constexpr char MeshFileMagic[4] = { 'R', 'E', 'M', 'C' };
+
+		size_t AlignOffset(size_t offset)
+		{
+			return (offset + FileAlignment - 1) / FileAlignment * FileAlignment;
+		}
+
+		/// Builds the KD-tree nodes in depth-first order. Triangles are referenced by index. The
+		/// triangle lists of the nodes are temporary, and are allocated from a scratch arena
+		class KDTreeBuilder
+		{
+		public:
+
+			KDTreeBuilder(const Vector3 * positions, const uint32_t * indices, Arena& scratch,
+				std::vector<MeshAsset::KDNode>& nodes, std::vector<uint32_t>& triangles) :
+				m_Positions(positions),
+				m_Indices(indices),
+				m_Scratch(scratch),
+				m_Nodes(nodes),
+				m_Triangles(triangles)
+			{
+			}
+
+			uint32_t Build(Span<const uint32_t> triangles, const BoundingBox& bounds, unsigned int depth)
+			{
+				uint32_t nodeIndex = static_cast<uint32_t>(m_Nodes.size());
+
+				m_Nodes.emplace_back();
+				m_Nodes[nodeIndex].Min = bounds.Min;
+				m_Nodes[nodeIndex].Max = bounds.Max;
+
+				// Stop condition
+				if (triangles.GetSize() <= 1 || depth == KDTreeMaxDepth)
+				{
+					MakeLeaf(nodeIndex, triangles);
+					return nodeIndex;
+				}
+
+				// Select the split axis (round-robin)
+				unsigned int uAxis = depth % 3;
+
+				BoundingBox leftBounds, rightBounds;
+
+				// Take the median of all points as split point
+				real median = 0;
+
+				for (auto i : triangles)
+				{
+					median += Vertex(i, 0).Elements[uAxis];
+					median += Vertex(i, 1).Elements[uAxis];
+					median += Vertex(i, 2).Elements[uAxis];
+				}
+
+				median /= 3 * triangles.GetSize();
+
+				bounds.Split(static_cast<Axis>(uAxis), median, leftBounds, rightBounds);
+
+				// Test every triangle in both left and right bounding boxes. The lists are counted
+				// first, so that they can be allocated with their exact size
+				auto isLeft = [&](uint32_t i) {
+					return Vertex(i, 0).Elements[uAxis] <= median || Vertex(i, 1).Elements[uAxis] <= median || Vertex(i, 2).Elements[uAxis] <= median;
+				};
+
+				auto isRight = [&](uint32_t i) {
+					return Vertex(i, 0).Elements[uAxis] >= median || Vertex(i, 1).Elements[uAxis] >= median || Vertex(i, 2).Elements[uAxis] >= median;
+				};
+
+				size_t leftCount = 0, rightCount = 0;
+
+				for (auto i : triangles)
+				{
+					leftCount += isLeft(i);
+					rightCount += isRight(i);
+				}
+
+				// Check that not too many triangles are in common (> 50%)
+				// between the subdivisions. If so, subdiving is not efficent anymore
+				if (leftCount + rightCount > 1.5 * triangles.GetSize())
+				{
+					MakeLeaf(nodeIndex, triangles);
+					return nodeIndex;
+				}
+
+				auto marker = m_Scratch.GetMarker();
+
+				uint32_t * leftTris = m_Scratch.Allocate<uint32_t>(leftCount);
+				uint32_t * rightTris = m_Scratch.Allocate<uint32_t>(rightCount);
+				size_t l = 0, r = 0;
+
+				for (auto i : triangles)
+				{
+					if (isLeft(i))
+						leftTris[l++] = i;
+
+					if (isRight(i))
+						rightTris[r++] = i;
+				}
+
+				// Subidivide. The vector may grow, so the node is accessed by index
+				if (leftCount > 0)
+				{
+					uint32_t left = Build({ leftTris, leftCount }, leftBounds, depth + 1);
+					m_Nodes[nodeIndex].Left = left;
+				}
+
+				if (rightCount > 0)
+				{
+					uint32_t right = Build({ rightTris, rightCount }, rightBounds, depth + 1);
+					m_Nodes[nodeIndex].Right = right;
+				}
+
+				m_Scratch.Rewind(marker);
+
+				return nodeIndex;
+			}
+
+		private:
+
+			const Vector3& Vertex(uint32_t triangle, unsigned int vertex) const
+			{
+				return m_Positions[m_Indices[triangle * 3 + vertex]];
+			}
+
+			void MakeLeaf(uint32_t nodeIndex, Span<const uint32_t> triangles)
+			{
+				m_Nodes[nodeIndex].FirstTriangle = static_cast<uint32_t>(m_Triangles.size());
+				m_Nodes[nodeIndex].TriangleCount = static_cast<uint32_t>(triangles.GetSize());
+				m_Triangles.insert(m_Triangles.end(), triangles.begin(), triangles.end());
+			}
+
+			const Vector3 * m_Positions;
+			const uint32_t * m_Indices;
+			Arena& m_Scratch;
+			std::vector<MeshAsset::KDNode>& m_Nodes;
+			std::vector<uint32_t>& m_Triangles;
+		};
+
+		template<typename Q>
+		real DecodeCoordinate(Q q, real parentMin, real parentMax)
+		{
+			constexpr Q QMax = std::numeric_limits<Q>::max();
+
+			// The end points are exact, so that decoded bounds never shrink
+			if (q == QMax)
+				return parentMax;
+
+			return parentMin + (parentMax - parentMin) * (q * (real(1) / QMax));
+		}
+
+		template<typename Q>
+		void DecodeBounds(const MeshAsset::QuantizedKDNode<Q>& node, const Vector3& parentMin, const Vector3& parentMax, Vector3& min, Vector3& max)
+		{
+			for (unsigned int axis = 0; axis < 3; axis++)
+			{
+				min.Elements[axis] = DecodeCoordinate(node.Min[axis], parentMin.Elements[axis], parentMax.Elements[axis]);
+				max.Elements[axis] = DecodeCoordinate(node.Max[axis], parentMin.Elements[axis], parentMax.Elements[axis]);
+			}
+		}
+
+		/// Quantizes the full precision nodes. Every child is encoded relative to the decoded
+		/// bounds of its parent, rounding outwards, so the decoded bounds always contain the original ones
+		template<typename Q>
+		void QuantizeNodes(const std::vector<MeshAsset::KDNode>& nodes, uint32_t index, const Vector3& parentMin, const Vector3& parentMax,
+			MeshAsset::QuantizedKDNode<Q> * result)
+		{
+			using Node = MeshAsset::QuantizedKDNode<Q>;
+			constexpr Q QMax = std::numeric_limits<Q>::max();
+
+			auto& source = nodes[index];
+			auto& node = result[index];
+
+			for (unsigned int axis = 0; axis < 3; axis++)
+			{
+				real pmin = parentMin.Elements[axis], pmax = parentMax.Elements[axis];
+				real extent = pmax - pmin;
+
+				Q qmin = 0, qmax = QMax;
+
+				if (extent > 0 && std::isfinite(extent))
+				{
+					real scale = QMax / extent;
+					real lo = std::floor((source.Min.Elements[axis] - pmin) * scale);
+					real hi = std::ceil((source.Max.Elements[axis] - pmin) * scale);
+
+					qmin = static_cast<Q>(std::max<real>(0, std::min<real>(QMax, lo)));
+					qmax = static_cast<Q>(std::max<real>(0, std::min<real>(QMax, hi)));
+
+					while (qmin > 0 && DecodeCoordinate(qmin, pmin, pmax) > source.Min.Elements[axis])
+						qmin--;
+
+					while (qmax < QMax && DecodeCoordinate(qmax, pmin, pmax) < source.Max.Elements[axis])
+						qmax++;
+				}
+
+				node.Min[axis] = qmin;
+				node.Max[axis] = qmax;
+			}
+
+			if (source.Left == 0 && source.Right == 0)
+			{
+				node.Index = source.FirstTriangle;
+				node.Info = source.TriangleCount | Node::LeafFlag;
+				return;
+			}
+
+			// Nodes are in depth-first order, the left child is the next one
+			assert(source.Left == 0 || source.Left == index + 1);
+
+			node.Index = source.Right;
+			node.Info = source.Left ? Node::LeftFlag : 0;
+
+			Vector3 min, max;
+			DecodeBounds(node, parentMin, parentMax, min, max);
+
+			if (source.Left)
+				QuantizeNodes(nodes, source.Left, min, max, result);
+
+			if (source.Right)
+				QuantizeNodes(nodes, source.Right, min, max, result);
+		}
+
+		/// Depth-first traversal, the child on the side the ray comes from first: the tree splits
+		/// on the axes in turn (see KDTreeBuilder), the left child below the split. Calls
+		/// leaf(first, count) for every leaf whose bounds pass bounds(min, max). The traversal stops
+		/// when leaf returns true. The stack can't be deeper than the tree
+		template<typename BoundsTest, typename LeafVisitor>
+		void Traverse(const MeshAsset::KDNode * nodes, const Vector3& direction, BoundsTest&& bounds, LeafVisitor&& leaf)
+		{
+			struct Entry
+			{
+				uint32_t Index, Axis;
+			};
+
+			std::array<Entry, KDTreeMaxDepth + 2> stack;
+			size_t stackSize = 0;
+
+			stack[stackSize++] = { 0, 0 };
+
+			while (stackSize > 0)
+			{
+				const Entry entry = stack[--stackSize];
+				const auto& node = nodes[entry.Index];
+
+				if (!bounds(node.Min, node.Max))
+					continue;
+
+				if (leaf(node.FirstTriangle, node.TriangleCount))
+					return;
+
+				uint32_t childAxis = (entry.Axis + 1) % 3;
+				uint32_t nearChild = node.Left, farChild = node.Right;
+
+				if (direction.Elements[entry.Axis] < 0)
+					std::swap(nearChild, farChild);
+
+				// The near child is popped first
+				if (farChild)
+					stack[stackSize++] = { farChild, childAxis };
+
+				if (nearChild)
+					stack[stackSize++] = { nearChild, childAxis };
+			}
+		}
+
+		/// Same as above, the bounds are decoded from the bounds of the parent when a node is pushed
+		template<typename Q, typename BoundsTest, typename LeafVisitor>
+		void Traverse(const MeshAsset::QuantizedKDNode<Q> * nodes, const BoundingBox& rootBounds, const Vector3& direction, BoundsTest&& bounds, LeafVisitor&& leaf)
+		{
+			using Node = MeshAsset::QuantizedKDNode<Q>;
+
+			struct Entry
+			{
+				uint32_t Index, Axis;
+				Vector3 Min, Max;
+			};
+
+			std::array<Entry, KDTreeMaxDepth + 2> stack;
+			size_t stackSize = 0;
+
+			stack[stackSize].Index = 0;
+			stack[stackSize].Axis = 0;
+			DecodeBounds(nodes[0], rootBounds.Min, rootBounds.Max, stack[stackSize].Min, stack[stackSize].Max);
+			stackSize++;
+
+			while (stackSize > 0)
+			{
+				const Entry entry = stack[--stackSize];
+				const Node& node = nodes[entry.Index];
+
+				if (!bounds(entry.Min, entry.Max))
+					continue;
+
+				if (node.Info & Node::LeafFlag)
+				{
+					if (leaf(node.Index, node.Info & ~Node::LeafFlag))
+						return;
+
+					continue;
+				}
+
+				uint32_t nearChild = node.Info & Node::LeftFlag ? entry.Index + 1 : 0, farChild = node.Index;
+
+				if (direction.Elements[entry.Axis] < 0)
+					std::swap(nearChild, farChild);
+
+				for (uint32_t child : { farChild, nearChild })
+				{
+					if (child == 0)
+						continue;
+
+					auto& next = stack[stackSize++];
+					next.Index = child;
+					next.Axis = (entry.Axis + 1) % 3;
+					DecodeBounds(nodes[child], entry.Min, entry.Max, next.Min, next.Max);
+				}
+			}
+		}
+
+		/// Checks that a serialized tree can't be traversed out of bounds. Children always follow
+		/// their parent, which rules out cycles, and have a single parent, so the depth of a node
+		/// is the length of its only path and the traversal stacks can't overflow
+		template<typename Node, typename Children, typename Range>
+		bool ValidateTree(const Node * nodes, size_t nodeCount, size_t triangleIndexCount, Children&& children, Range&& range)
+		{
+			std::vector<uint8_t> depth(nodeCount, 0);
+			std::vector<bool> hasParent(nodeCount, false);
+
+			for (size_t i = 0; i < nodeCount; i++)
+			{
+				uint32_t first, count;
+				range(nodes[i], first, count);
+
+				if (uint64_t(first) + count > triangleIndexCount)
+					return false;
+
+				uint32_t left, right;
+				children(nodes[i], static_cast<uint32_t>(i), left, right);
+
+				for (uint32_t child : { left, right })
+				{
+					if (child == 0)
+						continue;
+
+					if (child <= i || child >= nodeCount || hasParent[child] || depth[i] >= KDTreeMaxDepth)
+						return false;
+
+					hasParent[child] = true;
+					depth[child] = depth[i] + 1;
+				}
+			}
+
+			return true;
+		}
+
+		RayHitResult IntersectTriangle(const Ray & ray, const TriangleData& t, const Vector3& v0, const Vector3& v1, const Vector3& v2)
+		{
+			RayHitResult result;
+
+			Vector3 l = ray.Origin - v0;
+			real distance = l ^ t.FaceNormal;
+
+			if (distance < 0)
+			{
+				// Ray origin "behind" the triangle plane
+				return result;
+			}
+
+			real cosine = ray.Direction ^ t.FaceNormal;
+
+			// Check if the ray is never intersecting the triangle plane
+			if (cosine >= 0)
+			{
+				return result;
+			}
+
+			// Project the ray on the triangle plane 
+			Vector3 projection = ray.Origin + ray.Direction * (distance / -cosine);
+
+			// Use baricentric coordinates to check if the ray projection
+			// is contained in the triangle. Fast baricentric coordinates:
+			// https://gamedev.stackexchange.com/questions/23743/whats-the-most-efficient-way-to-find-barycentric-coordinates
+			Vector3 p = projection - v0;
+			real d20 = p ^ (v1 - v0);
+			real d21 = p ^ (v2 - v0);
+			real v = (t.D11 * d20 - t.D01 * d21) * t.InvDen;
+			real w = (t.D00 * d21 - t.D01 * d20) * t.InvDen;
+			real u = 1.0f - v - w;
+
+			if (u >= 0 && v >= 0 && w >= 0)
+			{
+				result.Hit = true;
+				result.Point = projection;
+
+				// The baricentric coordinates are returned in the normal, see MeshAsset::Intersect
+				result.Normal = { u, v, w };
+			}
+
+			return result;
+		}
+
+		/// Hit query version of the test above: same culling, but the ray direction isn't normalized
+		/// and only hits with t in [tMin, tMax] are accepted. Returns t and the baricentric
+		/// coordinates of the second and third vertex
+		bool IntersectTriangle(const Ray& ray, const TriangleData& t, const Vector3& v0, const Vector3& v1, const Vector3& v2,
+			real tMin, real tMax, real& tHit, real& u, real& w)
+		{
+			Vector3 l = ray.Origin - v0;
+			real distance = l ^ t.FaceNormal;
+
+			if (distance < 0)
+				return false;
+
+			real cosine = ray.Direction ^ t.FaceNormal;
+
+			if (cosine >= 0)
+				return false;
+
+			real tPlane = distance / -cosine;
+
+			if (tPlane < tMin || tPlane > tMax)
+				return false;
+
+			Vector3 p = l + ray.Direction * tPlane;
+			real d20 = p ^ (v1 - v0);
+			real d21 = p ^ (v2 - v0);
+			real v = (t.D11 * d20 - t.D01 * d21) * t.InvDen;
+			real ww = (t.D00 * d21 - t.D01 * d20) * t.InvDen;
+
+			if (v < 0 || ww < 0 || v + ww > 1)
+				return false;
+
+			tHit = tPlane;
+			u = v;
+			w = ww;
+
+			return true;
+		}
+
+		/// Slab test limited to the range [tMin, tMax]
+		bool IntersectBounds(const Vector3& min, const Vector3& max, const Ray& ray, const Vector3& invDirection, real tMin, real tMax)
+		{
+			real t1 = (min.X - ray.Origin.X) * invDirection.X;
+			real t2 = (max.X - ray.Origin.X) * invDirection.X;
+			real t3 = (min.Y - ray.Origin.Y) * invDirection.Y;
+			real t4 = (max.Y - ray.Origin.Y) * invDirection.Y;
+			real t5 = (min.Z - ray.Origin.Z) * invDirection.Z;
+			real t6 = (max.Z - ray.Origin.Z) * invDirection.Z;
+
+			real tNear = std::fmax(std::fmax(std::fmin(t1, t2), std::fmin(t3, t4)), std::fmin(t5, t6));
+			real tFar = std::fmin(std::fmin(std::fmax(t1, t2), std::fmax(t3, t4)), std::fmax(t5, t6));
+
+			return std::fmax(tNear, tMin) <= std::fmin(tFar, tMax);
+		}
+	}
+}
+
+void re::MeshAsset::SetPositions(std::vector<Vector3> positions)
+{
+	m_Positions.Set(std::move(positions));
+	m_Invalidated = true;
+}
+
+void re::MeshAsset::SetNormals(std::vector<Vector3> normals)
+{
+	m_Normals.Set(std::move(normals));
+	m_Invalidated = true;
+}
+
+void re::MeshAsset::SetTexCoords(std::vector<Vector2> texCoords)
+{
+	m_TexCoords.Set(std::move(texCoords));
+	m_Invalidated = true;
+}
+
+void re::MeshAsset::SetIndices(std::vector<uint32_t> indices)
+{
+	m_Indices.Set(std::move(indices));
+	m_Invalidated = true;
+}
+
+uint32_t re::MeshAsset::AddVertex(const Vector3 & position, const Vector3 & normal, const Vector2 & texCoord)
+{
+	auto& positions = m_Positions.Edit();
+	auto& normals = m_Normals.Edit();
+	auto& texCoords = m_TexCoords.Edit();
+
+	// Keep the optional buffers aligned with the positions
+	normals.resize(positions.size(), Vector3::Zero);
+	texCoords.resize(positions.size(), Vector2::Zero);
+
+	positions.push_back(position);
+	normals.push_back(normal);
+	texCoords.push_back(texCoord);
+
+	m_Invalidated = true;
+
+	return static_cast<uint32_t>(positions.size() - 1);
+}
+
+void re::MeshAsset::AddTriangle(uint32_t v0, uint32_t v1, uint32_t v2)
+{
+	auto& indices = m_Indices.Edit();
+	indices.push_back(v0);
+	indices.push_back(v1);
+	indices.push_back(v2);
+
+	m_Invalidated = true;
+}
+
+void re::MeshAsset::Compile()
+{
+	if (m_Invalidated)
+	{
+		const Vector3 * positions = m_Positions.GetData();
+		const uint32_t * indices = m_Indices.GetData();
+		size_t triangleCount = GetTriangleCount();
+
+		assert(m_Indices.GetSize() % 3 == 0);
+		assert(m_Normals.GetSize() == 0 || m_Normals.GetSize() == m_Positions.GetSize());
+		assert(m_TexCoords.GetSize() == 0 || m_TexCoords.GetSize() == m_Positions.GetSize());
+
+		auto& min = m_BoundingBox.Min;
+		auto& max = m_BoundingBox.Max;
+
+		min = Vector3::One * std::numeric_limits<real>::max();
+		max = Vector3::One * std::numeric_limits<real>::lowest();
+
+		// The compiled data of the previous build is released all at once
+		m_Arena.Reset();
+
+		TriangleData * triangles = m_Arena.Allocate<TriangleData>(triangleCount);
+
+		for (size_t i = 0; i < triangleCount; i++)
+		{
+			const Vector3& v0 = positions[indices[i * 3 + 0]];
+			const Vector3& v1 = positions[indices[i * 3 + 1]];
+			const Vector3& v2 = positions[indices[i * 3 + 2]];
+
+			assert(indices[i * 3 + 0] < m_Positions.GetSize() && indices[i * 3 + 1] < m_Positions.GetSize() && indices[i * 3 + 2] < m_Positions.GetSize());
+
+			Vector3 e0 = v1 - v0;
+			Vector3 e1 = v2 - v0;
+
+			auto& t = triangles[i];
+			t.FaceNormal = Cross(v1 - v0, v2 - v1).Normalized();
+			t.D00 = e0 ^ e0;
+			t.D01 = e0 ^ e1;
+			t.D11 = e1 ^ e1;
+			t.InvDen = 1.0 / (t.D00 * t.D11 - t.D01 * t.D01);
+
+			for (auto v : { &v0, &v1, &v2 })
+			{
+				min.X = std::min(min.X, v->X);
+				min.Y = std::min(min.Y, v->Y);
+				min.Z = std::min(min.Z, v->Z);
+
+				max.X = std::max(max.X, v->X);
+				max.Y = std::max(max.Y, v->Y);
+				max.Z = std::max(max.Z, v->Z);
+			}
+		}
+
+		// Nodes and leaf references are built in scratch buffers, and copied to the arena once
+		// their size is known. The scratch memory is released when the build is done
+		Arena scratch;
+		std::vector<KDNode> nodes;
+		std::vector<uint32_t> triangleIndices;
+
+		uint32_t * all = scratch.Allocate<uint32_t>(triangleCount);
+		for (size_t i = 0; i < triangleCount; i++)
+			all[i] = static_cast<uint32_t>(i);
+
+		KDTreeBuilder(positions, indices, scratch, nodes, triangleIndices).Build({ all, triangleCount }, m_BoundingBox, 0);
+
+		auto compiledIndices = m_Arena.Copy(triangleIndices.data(), triangleIndices.size());
+
+		m_Triangles.SetExternal(triangles, triangleCount);
+		m_TriangleIndices.SetExternal(compiledIndices.GetData(), compiledIndices.GetSize());
+		m_Nodes.Set({});
+		m_Nodes16.Set({});
+		m_Nodes8.Set({});
+
+		if (m_NodeFormat == NodeFormats::Quantized16)
+		{
+			auto quantized = m_Arena.Allocate<QuantizedKDNode<uint16_t>>(nodes.size());
+			QuantizeNodes(nodes, 0, m_BoundingBox.Min, m_BoundingBox.Max, quantized);
+			m_Nodes16.SetExternal(quantized, nodes.size());
+		}
+		else if (m_NodeFormat == NodeFormats::Quantized8)
+		{
+			auto quantized = m_Arena.Allocate<QuantizedKDNode<uint8_t>>(nodes.size());
+			QuantizeNodes(nodes, 0, m_BoundingBox.Min, m_BoundingBox.Max, quantized);
+			m_Nodes8.SetExternal(quantized, nodes.size());
+		}
+		else
+		{
+			auto compiledNodes = m_Arena.Copy(nodes.data(), nodes.size());
+			m_Nodes.SetExternal(compiledNodes.GetData(), compiledNodes.GetSize());
+		}
+
+		// Release the loaded data once nothing points to it anymore
+		if (!m_Positions.IsExternal() && !m_Normals.IsExternal() && !m_TexCoords.IsExternal() && !m_Indices.IsExternal())
+			m_Storage = nullptr;
+
+		m_Invalidated = false;
+	}
+}
+
+void re::MeshAsset::Invalidate()
+{
+	m_Invalidated = true;
+}
+
+void re::MeshAsset::SetNodeFormat(NodeFormats format)
+{
+	if (format != m_NodeFormat)
+	{
+		m_NodeFormat = format;
+		m_Invalidated = true;
+	}
+}
+
+re::RayHitResult re::MeshAsset::Intersect(const Ray & ray, NormalModes normalMode) const
+{
+	RayHitResult result;
+	real distance = std::numeric_limits<real>::max();
+	uint32_t hitTriangle = 0;
+
+	if (m_Invalidated || m_TriangleIndices.GetSize() == 0)
+		return result;
+
+	const Vector3 * positions = m_Positions.GetData();
+	const uint32_t * indices = m_Indices.GetData();
+	const TriangleData * triangles = m_Triangles.GetData();
+	const uint32_t * triangleIndices = m_TriangleIndices.GetData();
+
+	auto leaf = [&](uint32_t first, uint32_t count) {
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t triangle = triangleIndices[first + i];
+			const uint32_t * v = indices + triangle * 3;
+
+			auto r = IntersectTriangle(ray, triangles[triangle], positions[v[0]], positions[v[1]], positions[v[2]]);
+			auto d = (ray.Origin - r.Point).SquaredLength();
+
+			if (d < distance && r.Hit)
+			{
+				result = r;
+				distance = d;
+				hitTriangle = triangle;
+			}
+		}
+
+		return false;
+	};
+
+	auto bounds = [&](const Vector3& min, const Vector3& max) {
+		return BoundingBox(min, max).Intersect(ray).Hit;
+	};
+
+	TraverseTree(ray.Direction, bounds, leaf);
+
+	if (result.Hit)
+	{
+		const uint32_t * v = indices + hitTriangle * 3;
+		Vector3 bar = result.Normal;
+
+		if (normalMode == NormalModes::Vertex && m_Normals.GetSize() > 0)
+			result.Normal = (m_Normals[v[0]] * bar.X + m_Normals[v[1]] * bar.Y + m_Normals[v[2]] * bar.Z).Normalized();
+		else
+			result.Normal = triangles[hitTriangle].FaceNormal;
+	}
+
+	return result;
+}
+
+bool re::MeshAsset::Intersect(const Ray & ray, Hit & hit) const
+{
+	if (m_Invalidated || m_TriangleIndices.GetSize() == 0)
+		return false;
+
+	const Vector3 * positions = m_Positions.GetData();
+	const uint32_t * indices = m_Indices.GetData();
+	const TriangleData * triangles = m_Triangles.GetData();
+	const uint32_t * triangleIndices = m_TriangleIndices.GetData();
+
+	Vector3 invDirection = Vector3::One / ray.Direction;
+	real tMax = ray.TMax;
+	bool result = false;
+
+	auto leaf = [&](uint32_t first, uint32_t count) {
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t triangle = triangleIndices[first + i];
+			const uint32_t * v = indices + triangle * 3;
+			real t, u, w;
+
+			if (IntersectTriangle(ray, triangles[triangle], positions[v[0]], positions[v[1]], positions[v[2]], ray.TMin, tMax, t, u, w))
+			{
+				tMax = t;
+				hit.T = t;
+				hit.PrimitiveID = triangle;
+				hit.U = u;
+				hit.V = w;
+				result = true;
+			}
+		}
+
+		return false;
+	};
+
+	// Nodes farther than the closest hit are skipped
+	auto bounds = [&](const Vector3& min, const Vector3& max) {
+		return IntersectBounds(min, max, ray, invDirection, ray.TMin, tMax);
+	};
+
+	TraverseTree(ray.Direction, bounds, leaf);
+
+	return result;
+}
+
+bool re::MeshAsset::Occluded(const Ray & ray) const
+{
+	if (m_Invalidated || m_TriangleIndices.GetSize() == 0)
+		return false;
+
+	const Vector3 * positions = m_Positions.GetData();
+	const uint32_t * indices = m_Indices.GetData();
+	const TriangleData * triangles = m_Triangles.GetData();
+	const uint32_t * triangleIndices = m_TriangleIndices.GetData();
+
+	Vector3 invDirection = Vector3::One / ray.Direction;
+	bool result = false;
+
+	// Any hit is enough, the traversal stops at the first one
+	auto leaf = [&](uint32_t first, uint32_t count) {
+		for (uint32_t i = 0; i < count && !result; i++)
+		{
+			uint32_t triangle = triangleIndices[first + i];
+			const uint32_t * v = indices + triangle * 3;
+			real t, u, w;
+
+			result = IntersectTriangle(ray, triangles[triangle], positions[v[0]], positions[v[1]], positions[v[2]], ray.TMin, ray.TMax, t, u, w);
+		}
+
+		return result;
+	};
+
+	auto bounds = [&](const Vector3& min, const Vector3& max) {
+		return IntersectBounds(min, max, ray, invDirection, ray.TMin, ray.TMax);
+	};
+
+	TraverseTree(ray.Direction, bounds, leaf);
+
+	return result;
+}
+
+re::Vector3 re::MeshAsset::GetNormal(const Hit & hit, NormalModes normalMode) const
+{
+	if (normalMode == NormalModes::Vertex && m_Normals.GetSize() > 0)
+	{
+		const uint32_t * v = m_Indices.GetData() + hit.PrimitiveID * 3;
+		return m_Normals[v[0]] * (1 - hit.U - hit.V) + m_Normals[v[1]] * hit.U + m_Normals[v[2]] * hit.V;
+	}
+
+	return m_Triangles[hit.PrimitiveID].FaceNormal;
+}
+
+bool re::MeshAsset::GetTexCoord(const Hit & hit, Vector2 & texCoord, Vector3 & gradientU, Vector3 & gradientV) const
+{
+	if (m_TexCoords.GetSize() == 0)
+		return false;
+
+	const uint32_t * v = m_Indices.GetData() + hit.PrimitiveID * 3;
+	const Vector2& t0 = m_TexCoords[v[0]];
+	Vector2 dt1 = m_TexCoords[v[1]] - t0, dt2 = m_TexCoords[v[2]] - t0;
+
+	texCoord = t0 + dt1 * hit.U + dt2 * hit.V;
+
+	// Gradients of the baricentric coordinates on the plane of the triangle, same formulas as the intersection
+	const TriangleData& t = m_Triangles[hit.PrimitiveID];
+	const Vector3& p0 = m_Positions[v[0]];
+	Vector3 e0 = m_Positions[v[1]] - p0, e1 = m_Positions[v[2]] - p0;
+
+	Vector3 gradient1 = (e0 * t.D11 - e1 * t.D01) * t.InvDen;
+	Vector3 gradient2 = (e1 * t.D00 - e0 * t.D01) * t.InvDen;
+
+	gradientU = gradient1 * dt1.U + gradient2 * dt2.U;
+	gradientV = gradient1 * dt1.V + gradient2 * dt2.V;
+
+	return true;
+}
+
+template<typename BoundsTest, typename LeafVisitor>
+void re::MeshAsset::TraverseTree(const Vector3 & direction, BoundsTest && bounds, LeafVisitor && leaf) const
+{
+	switch (m_NodeFormat)
+	{
+	case NodeFormats::Full: Traverse(m_Nodes.GetData(), direction, bounds, leaf); break;
+	case NodeFormats::Quantized16: Traverse(m_Nodes16.GetData(), m_BoundingBox, direction, bounds, leaf); break;
+	case NodeFormats::Quantized8: Traverse(m_Nodes8.GetData(), m_BoundingBox, direction, bounds, leaf); break;
+	}
+}
+
+size_t re::MeshAsset::GetMemoryUsage() const
+{
+	return sizeof(MeshAsset) +
+		m_Positions.GetMemoryUsage() +
+		m_Normals.GetMemoryUsage() +
+		m_TexCoords.GetMemoryUsage() +
+		m_Indices.GetMemoryUsage() +
+		m_Triangles.GetMemoryUsage() +
+		GetAccelerationMemoryUsage() +
+		m_Arena.GetCapacity() - m_Arena.GetUsed();
+}
+
+size_t re::MeshAsset::GetAccelerationMemoryUsage() const
+{
+	return m_Nodes.GetMemoryUsage() +
+		m_Nodes16.GetMemoryUsage() +
+		m_Nodes8.GetMemoryUsage() +
+		m_TriangleIndices.GetMemoryUsage();
+}
+
+bool re::MeshAsset::Save(std::ostream & os, uint64_t key) const
+{
+	if (m_Invalidated)
+		return false;
+
+	MeshFileHeader header = {};
+	std::memcpy(header.Magic, MeshFileMagic, sizeof(header.Magic));
+	header.Version = FileVersion;
+	header.Key = key;
+	header.RealSize = sizeof(real);
+	header.TriangleSize = sizeof(TriangleData);
+	header.NodeSize = static_cast<uint32_t>(GetNodeSize(m_NodeFormat));
+	header.NodeFormat = static_cast<uint32_t>(m_NodeFormat);
+	header.Min = m_BoundingBox.Min;
+	header.Max = m_BoundingBox.Max;
+
+	const void * nodeData = m_Nodes.GetData();
+	size_t nodeCount = m_Nodes.GetSize();
+
+	if (m_NodeFormat == NodeFormats::Quantized16)
+	{
+		nodeData = m_Nodes16.GetData();
+		nodeCount = m_Nodes16.GetSize();
+	}
+	else if (m_NodeFormat == NodeFormats::Quantized8)
+	{
+		nodeData = m_Nodes8.GetData();
+		nodeCount = m_Nodes8.GetSize();
+	}
+
+	const std::pair<const void*, size_t> sections[SectionCount] = {
+		{ m_Positions.GetData(), m_Positions.GetSize() * sizeof(Vector3) },
+		{ m_Normals.GetData(), m_Normals.GetSize() * sizeof(Vector3) },
+		{ m_TexCoords.GetData(), m_TexCoords.GetSize() * sizeof(Vector2) },
+		{ m_Indices.GetData(), m_Indices.GetSize() * sizeof(uint32_t) },
+		{ m_Triangles.GetData(), m_Triangles.GetSize() * sizeof(TriangleData) },
+		{ nodeData, nodeCount * header.NodeSize },
+		{ m_TriangleIndices.GetData(), m_TriangleIndices.GetSize() * sizeof(uint32_t) },
+	};
+
+	const size_t counts[SectionCount] = {
+		m_Positions.GetSize(), m_Normals.GetSize(), m_TexCoords.GetSize(), m_Indices.GetSize(),
+		m_Triangles.GetSize(), nodeCount, m_TriangleIndices.GetSize()
+	};
+
+	size_t offset = sizeof(MeshFileHeader);
+
+	for (size_t i = 0; i < SectionCount; i++)
+	{
+		offset = AlignOffset(offset);
+		header.Sections[i].Offset = offset;
+		header.Sections[i].Count = counts[i];
+		offset += sections[i].second;
+	}
+
+	size_t position = 0;
+
+	auto write = [&](size_t offset, const void * data, size_t size) {
+		static const char zeros[FileAlignment] = {};
+		os.write(zeros, offset - position);
+		os.write(static_cast<const char*>(data), size);
+		position = offset + size;
+	};
+
+	write(0, &header, sizeof(header));
+
+	for (size_t i = 0; i < SectionCount; i++)
+		write(header.Sections[i].Offset, sections[i].first, sections[i].second);
+
+	return os.good();
+}
+
+bool re::MeshAsset::Load(const void * data, size_t size, uint64_t key, std::shared_ptr<const void> storage)
+{
+	auto bytes = static_cast<const char*>(data);
+
+	if (size < sizeof(MeshFileHeader) || reinterpret_cast<uintptr_t>(data) % FileAlignment != 0)
+		return false;
+
+	MeshFileHeader header;
+	std::memcpy(&header, bytes, sizeof(header));
+
+	if (std::memcmp(header.Magic, MeshFileMagic, sizeof(header.Magic)) != 0 ||
+		header.Version != FileVersion || header.Key != key ||
+		header.RealSize != sizeof(real) || header.TriangleSize != sizeof(TriangleData) ||
+		header.NodeFormat > static_cast<uint32_t>(NodeFormats::Quantized8))
+		return false;
+
+	auto nodeFormat = static_cast<NodeFormats>(header.NodeFormat);
+
+	if (header.NodeSize != GetNodeSize(nodeFormat))
+		return false;
+
+	const size_t elementSizes[SectionCount] = {
+		sizeof(Vector3), sizeof(Vector3), sizeof(Vector2), sizeof(uint32_t),
+		sizeof(TriangleData), header.NodeSize, sizeof(uint32_t)
+	};
+
+	for (size_t i = 0; i < SectionCount; i++)
+	{
+		auto& section = header.Sections[i];
+
+		if (section.Offset % FileAlignment != 0 || section.Offset > size || section.Count > (size - section.Offset) / elementSizes[i])
+			return false;
+	}
+
+	auto section = [&](MeshFileSection s) { return bytes + header.Sections[s].Offset; };
+	auto count = [&](MeshFileSection s) { return static_cast<size_t>(header.Sections[s].Count); };
+
+	size_t vertexCount = count(Positions);
+	size_t triangleCount = count(Triangles);
+	size_t nodeCount = count(Nodes);
+
+	if ((count(Normals) != 0 && count(Normals) != vertexCount) ||
+		(count(TexCoords) != 0 && count(TexCoords) != vertexCount) ||
+		count(Indices) != triangleCount * 3 ||
+		nodeCount == 0 || nodeCount > std::numeric_limits<uint32_t>::max())
+		return false;
+
+	auto indices = reinterpret_cast<const uint32_t*>(section(Indices));
+	auto triangleIndices = reinterpret_cast<const uint32_t*>(section(TriangleIndices));
+
+	for (size_t i = 0; i < count(Indices); i++)
+		if (indices[i] >= vertexCount)
+			return false;
+
+	auto nodes = reinterpret_cast<const KDNode*>(section(Nodes));
+	auto nodes16 = reinterpret_cast<const QuantizedKDNode<uint16_t>*>(section(Nodes));
+	auto nodes8 = reinterpret_cast<const QuantizedKDNode<uint8_t>*>(section(Nodes));
+
+	auto fullChildren = [](const KDNode& node, uint32_t, uint32_t& left, uint32_t& right) {
+		left = node.Left;
+		right = node.Right;
+	};
+
+	auto fullRange = [](const KDNode& node, uint32_t& first, uint32_t& count) {
+		first = node.FirstTriangle;
+		count = node.TriangleCount;
+	};
+
+	auto quantizedChildren = [](const auto& node, uint32_t index, uint32_t& left, uint32_t& right) {
+		bool leaf = (node.Info & node.LeafFlag) != 0;
+		left = !leaf && (node.Info & node.LeftFlag) ? index + 1 : 0;
+		right = leaf ? 0 : node.Index;
+	};
+
+	auto quantizedRange = [](const auto& node, uint32_t& first, uint32_t& count) {
+		bool leaf = (node.Info & node.LeafFlag) != 0;
+		first = leaf ? node.Index : 0;
+		count = leaf ? node.Info & ~node.LeafFlag : 0;
+	};
+
+	bool validTree = false;
+
+	switch (nodeFormat)
+	{
+	case NodeFormats::Full: validTree = ValidateTree(nodes, nodeCount, count(TriangleIndices), fullChildren, fullRange); break;
+	case NodeFormats::Quantized16: validTree = ValidateTree(nodes16, nodeCount, count(TriangleIndices), quantizedChildren, quantizedRange); break;
+	case NodeFormats::Quantized8: validTree = ValidateTree(nodes8, nodeCount, count(TriangleIndices), quantizedChildren, quantizedRange); break;
+	}
+
+	if (!validTree)
+		return false;
+
+	for (size_t i = 0; i < count(TriangleIndices); i++)
+		if (triangleIndices[i] >= triangleCount)
+			return false;
+
+	m_Storage = storage;
+
+	m_Positions.SetExternal(reinterpret_cast<const Vector3*>(section(Positions)), vertexCount);
+	m_Normals.SetExternal(reinterpret_cast<const Vector3*>(section(Normals)), count(Normals));
+	m_TexCoords.SetExternal(reinterpret_cast<const Vector2*>(section(TexCoords)), count(TexCoords));
+	m_Indices.SetExternal(indices, count(Indices));
+	m_Triangles.SetExternal(reinterpret_cast<const TriangleData*>(section(Triangles)), triangleCount);
+	m_Nodes.Set({});
+	m_Nodes16.Set({});
+	m_Nodes8.Set({});
+
+	switch (nodeFormat)
+	{
+	case NodeFormats::Full: m_Nodes.SetExternal(nodes, nodeCount); break;
+	case NodeFormats::Quantized16: m_Nodes16.SetExternal(nodes16, nodeCount); break;
+	case NodeFormats::Quantized8: m_Nodes8.SetExternal(nodes8, nodeCount); break;
+	}
+
+	m_NodeFormat = nodeFormat;
+	m_TriangleIndices.SetExternal(triangleIndices, count(TriangleIndices));
+
+	m_BoundingBox = BoundingBox(header.Min, header.Max);
+	m_Invalidated = false;
+
+	return true;
+}
+
+re::RayHitResult re::Mesh::Intersect(const Ray & ray)
+{
+	if (m_Asset == nullptr)
+		return RayHitResult();
+
+	return m_Asset->Intersect(ray, NormalMode);
+}
+
+bool re::Mesh::Intersect(const Ray & ray, Hit & hit)
+{
+	return m_Asset != nullptr && m_Asset->Intersect(ray, hit);
+}
+
+bool re::Mesh::Occluded(const Ray & ray)
+{
+	return m_Asset != nullptr && m_Asset->Occluded(ray);
+}
+
+re::Vector3 re::Mesh::GetNormal(const Ray & ray, const Hit & hit)
+{
+	return m_Asset->GetNormal(hit, NormalMode);
+}
+
+bool re::Mesh::GetTexCoord(const Hit & hit, Vector2 & texCoord, Vector3 & gradientU, Vector3 & gradientV)
+{
+	return m_Asset->GetTexCoord(hit, texCoord, gradientU, gradientV);
+}
+
+bool re::Mesh::GetBounds(BoundingBox & bounds)
+{
+	bounds = m_Asset != nullptr ? m_Asset->GetBoundingBox() : BoundingBox();
+	return true;
+}
+
+re::MeshAsset& re::Mesh::GetOrCreateAsset()
+{
+	if (m_Asset == nullptr)
+		m_Asset = std::make_shared<MeshAsset>();
+
+	return *m_Asset;
+}
+
+void re::Mesh::Compile()
+{
+	if (m_Asset != nullptr)
+		m_Asset->Compile();
+}
+
+void re::Mesh::Invalidate()
+{
+	if (m_Asset != nullptr)
+		m_Asset->Invalidate();
+}
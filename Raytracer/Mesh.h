@@ -0,0 +1,250 @@
+#pragma once
+#include "Arena.h"
+#include "Common.h"
+#include "Scene.h"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace re
+{
+	enum class NormalModes { Face, Vertex };
+
+	/// Storage of the acceleration structure nodes. Quantized nodes store their bounds with 16 or 8 bits
+	/// per coordinate relative to the bounds of the parent, and are decompressed during traversal
+	enum class NodeFormats { Full, Quantized16, Quantized8 };
+
+	/// Data of a triangle derived from its vertices when the mesh is compiled
+	struct TriangleData
+	{
+		Vector3 FaceNormal;
+
+		// Dot products of the edges, used to compute baricentric coordinates
+		real D00, D01, D11;
+		real InvDen;
+	};
+
+	/// An array that is either owned or a view on memory owned by someone else: the arena of the
+	/// asset for compiled data, or the storage passed to MeshAsset::Load
+	template<typename T>
+	class MeshBuffer
+	{
+	public:
+
+		const T * GetData() const { return m_External ? m_External : m_Owned.data(); }
+		size_t GetSize() const { return m_External ? m_ExternalSize : m_Owned.size(); }
+		bool IsExternal() const { return m_External != nullptr; }
+
+		const T& operator[](size_t index) const { return GetData()[index]; }
+
+		/// Returns the owned array, copying the external data first
+		std::vector<T>& Edit()
+		{
+			if (m_External)
+			{
+				m_Owned.assign(m_External, m_External + m_ExternalSize);
+				m_External = nullptr;
+				m_ExternalSize = 0;
+			}
+
+			return m_Owned;
+		}
+
+		void Set(std::vector<T> data)
+		{
+			m_Owned = std::move(data);
+			m_External = nullptr;
+			m_ExternalSize = 0;
+		}
+
+		void SetExternal(const T * data, size_t size)
+		{
+			m_Owned = std::vector<T>();
+			m_External = data;
+			m_ExternalSize = size;
+		}
+
+		size_t GetMemoryUsage() const { return (m_External ? m_ExternalSize : m_Owned.capacity()) * sizeof(T); }
+
+	private:
+		std::vector<T> m_Owned;
+		const T * m_External = nullptr;
+		size_t m_ExternalSize = 0;
+	};
+
+	/// Indexed triangle geometry with its acceleration structure. An asset can be shared by
+	/// many Mesh shapes, each one with its own transform and material: the triangles
+	/// are stored and compiled only once.
+	class MeshAsset
+	{
+	public:
+
+		/// Version of the binary format written by Save
+		static constexpr uint32_t FileVersion = 3;
+
+		/// Node of the flattened KD-tree, stored in depth-first order. Leaves reference a range
+		/// of triangle indices, child indices are 0 when missing (the root can't be a child)
+		struct KDNode
+		{
+			Vector3 Min, Max;
+			uint32_t Left = 0, Right = 0;
+			uint32_t FirstTriangle = 0, TriangleCount = 0;
+		};
+
+		/// Compressed KD-tree node. The bounds are quantized conservatively relative to the decoded
+		/// bounds of the parent, and the left child, if any, is always the next node
+		template<typename Q>
+		struct QuantizedKDNode
+		{
+			static constexpr uint32_t LeafFlag = 0x80000000u;
+			static constexpr uint32_t LeftFlag = 0x40000000u;
+
+			Q Min[3], Max[3];
+
+			// Leaves: first triangle index, triangle count | LeafFlag
+			// Interior nodes: right child index (0 if missing), LeftFlag if the left child exists
+			uint32_t Index, Info;
+		};
+
+		MeshAsset() {}
+
+		MeshAsset(const MeshAsset&) = delete;
+		MeshAsset& operator=(const MeshAsset&) = delete;
+
+		/// Replaces the vertex positions. Buffers are moved in, so large meshes can be uploaded
+		/// without copies
+		void SetPositions(std::vector<Vector3> positions);
+
+		/// Replaces the vertex normals. Normals are optional, but if present there must be
+		/// one for each position
+		void SetNormals(std::vector<Vector3> normals);
+
+		/// Replaces the vertex texture coordinates. Same rules as normals
+		void SetTexCoords(std::vector<Vector2> texCoords);
+
+		/// Replaces the triangles, 3 vertex indices per triangle
+		void SetIndices(std::vector<uint32_t> indices);
+
+		/// Adds a vertex with a normal and texture coordinates, and returns its index
+		uint32_t AddVertex(const Vector3& position, const Vector3& normal = Vector3::Zero, const Vector2& texCoord = Vector2::Zero);
+
+		void AddTriangle(uint32_t v0, uint32_t v1, uint32_t v2);
+
+		/// Builds the triangle data and the acceleration structure if the asset has been invalidated
+		void Compile();
+
+		void Invalidate();
+
+		/// Sets the format of the acceleration structure nodes. The asset must be compiled again
+		void SetNodeFormat(NodeFormats format);
+		NodeFormats GetNodeFormat() const { return m_NodeFormat; }
+
+		RayHitResult Intersect(const Ray& ray, NormalModes normalMode) const;
+
+		/// Hit queries, see Shape::Intersect and Shape::Occluded. PrimitiveID is the triangle index
+		bool Intersect(const Ray& ray, Hit& hit) const;
+		bool Occluded(const Ray& ray) const;
+
+		/// Returns the normal at a hit found by Intersect, interpolated from the vertex normals if the
+		/// mode is Vertex and the asset has normals
+		Vector3 GetNormal(const Hit& hit, NormalModes normalMode) const;
+
+		/// Texture coordinates at a hit found by Intersect, see Shape::GetTexCoord. Returns false if
+		/// the asset has no texture coordinates
+		bool GetTexCoord(const Hit& hit, Vector2& texCoord, Vector3& gradientU, Vector3& gradientV) const;
+
+		size_t GetVertexCount() const { return m_Positions.GetSize(); }
+		size_t GetTriangleCount() const { return m_Indices.GetSize() / 3; }
+		const BoundingBox& GetBoundingBox() const { return m_BoundingBox; }
+
+		/// Returns the number of bytes used by the vertices, the triangles and the acceleration structure,
+		/// unused arena memory included
+		size_t GetMemoryUsage() const;
+
+		/// Returns the number of bytes used by the acceleration structure nodes and leaf references
+		size_t GetAccelerationMemoryUsage() const;
+
+		/// Writes the compiled asset, acceleration structure included. The key identifies
+		/// the source data and the build settings, and is checked by Load
+		bool Save(std::ostream& os, uint64_t key) const;
+
+		/// Loads an asset written by Save. The data is used in place, nothing is copied or
+		/// rebuilt: storage must own the data and is kept alive by the asset. Returns false
+		/// if the data is not valid or has been saved with a different key or version
+		bool Load(const void * data, size_t size, uint64_t key, std::shared_ptr<const void> storage);
+
+	private:
+
+		/// Visits the nodes nearest to the origin of a ray with this direction first
+		template<typename BoundsTest, typename LeafVisitor>
+		void TraverseTree(const Vector3& direction, BoundsTest&& bounds, LeafVisitor&& leaf) const;
+
+		bool m_Invalidated = true;
+		NodeFormats m_NodeFormat = NodeFormats::Full;
+
+		MeshBuffer<Vector3> m_Positions, m_Normals;
+		MeshBuffer<Vector2> m_TexCoords;
+		MeshBuffer<uint32_t> m_Indices;
+
+		// Compiled data
+		MeshBuffer<TriangleData> m_Triangles;
+		MeshBuffer<KDNode> m_Nodes;
+		MeshBuffer<QuantizedKDNode<uint16_t>> m_Nodes16;
+		MeshBuffer<QuantizedKDNode<uint8_t>> m_Nodes8;
+		MeshBuffer<uint32_t> m_TriangleIndices;
+
+		std::shared_ptr<const void> m_Storage;
+		Arena m_Arena;
+
+		re::BoundingBox m_BoundingBox;
+	};
+
+	/// A shape that renders a MeshAsset. Meshes sharing the same asset are instances
+	/// of the same geometry
+	class Mesh : public Shape
+	{
+	public:
+
+		NormalModes NormalMode = NormalModes::Face;
+
+		Mesh(SceneNode * owner) : Shape(owner) { }
+		virtual RayHitResult Intersect(const Ray& ray) override;
+		virtual bool Intersect(const Ray& ray, Hit& hit) override;
+		virtual bool Occluded(const Ray& ray) override;
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit) override;
+		virtual bool GetTexCoord(const Hit& hit, Vector2& texCoord, Vector3& gradientU, Vector3& gradientV) override;
+
+		virtual size_t GetMemoryUsage() const override { return sizeof(Mesh); }
+		virtual bool GetBounds(BoundingBox& bounds) override;
+
+		// The following methods forward to the asset of this mesh, creating a new asset if
+		// the mesh doesn't have one yet. If the asset is shared, every instance will see the changes
+
+		void SetPositions(std::vector<Vector3> positions) { GetOrCreateAsset().SetPositions(std::move(positions)); }
+		void SetNormals(std::vector<Vector3> normals) { GetOrCreateAsset().SetNormals(std::move(normals)); }
+		void SetTexCoords(std::vector<Vector2> texCoords) { GetOrCreateAsset().SetTexCoords(std::move(texCoords)); }
+		void SetIndices(std::vector<uint32_t> indices) { GetOrCreateAsset().SetIndices(std::move(indices)); }
+
+		uint32_t AddVertex(const Vector3& position, const Vector3& normal = Vector3::Zero, const Vector2& texCoord = Vector2::Zero)
+		{
+			return GetOrCreateAsset().AddVertex(position, normal, texCoord);
+		}
+
+		void AddTriangle(uint32_t v0, uint32_t v1, uint32_t v2) { GetOrCreateAsset().AddTriangle(v0, v1, v2); }
+
+		void Compile() override;
+
+		void Invalidate();
+
+		void SetAsset(const std::shared_ptr<MeshAsset>& asset) { m_Asset = asset; }
+		const std::shared_ptr<MeshAsset>& GetAsset() const { return m_Asset; }
+
+	private:
+		MeshAsset& GetOrCreateAsset();
+
+		std::shared_ptr<MeshAsset> m_Asset;
+	};
+
+}
@@ -0,0 +1,447 @@
+#include "Primitives.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace re
+{
+	namespace
+	{
+		inline real Dot(const Vector3& lhs, const Vector3& rhs)
+		{
+			return lhs.X * rhs.X + lhs.Y * rhs.Y + lhs.Z * rhs.Z;
+		}
+
+		/// Legacy query on top of the hit query of the shape
+		RayHitResult IntersectShape(Shape& shape, const Ray& ray)
+		{
+			RayHitResult result;
+			Hit hit;
+
+			if (shape.Intersect(ray, hit))
+			{
+				result.Hit = true;
+				result.Point = ray.Origin + ray.Direction * hit.T;
+				result.Normal = shape.GetNormal(ray, hit).Normalized();
+			}
+
+			return result;
+		}
+
+		/// Slab test of the ray with a box, returns the range of t inside the box
+		bool IntersectSlabs(const Vector3& min, const Vector3& max, const Ray& ray, real& tNear, real& tFar,
+			int& nearAxis, int& farAxis)
+		{
+			tNear = std::numeric_limits<real>::lowest();
+			tFar = std::numeric_limits<real>::max();
+			nearAxis = farAxis = 0;
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				real invDirection = 1 / ray.Direction.Elements[axis];
+				real t1 = (min.Elements[axis] - ray.Origin.Elements[axis]) * invDirection;
+				real t2 = (max.Elements[axis] - ray.Origin.Elements[axis]) * invDirection;
+
+				if (t1 > t2)
+					std::swap(t1, t2);
+
+				// Comparisons are false for NaN (ray parallel to the slab and starting on its border),
+				// so the axis is skipped
+				if (t1 > tNear)
+				{
+					tNear = t1;
+					nearAxis = axis;
+				}
+
+				if (t2 < tFar)
+				{
+					tFar = t2;
+					farAxis = axis;
+				}
+			}
+
+			return tNear <= tFar;
+		}
+
+		/// Sets t if the candidate is in range and closer than the current one
+		inline bool Closer(real candidate, real tMin, real& t)
+		{
+			if (candidate >= tMin && candidate <= t)
+			{
+				t = candidate;
+				return true;
+			}
+
+			return false;
+		}
+
+		inline real EvaluatePolynomial(const real * coefficients, int degree, real t)
+		{
+			real result = coefficients[degree];
+
+			for (int i = degree - 1; i >= 0; i--)
+				result = result * t + coefficients[i];
+
+			return result;
+		}
+
+		/// Finds the roots of the polynomial (coefficients[i] multiplies t^i) in [t0, t1], sorted.
+		/// The interval is split at the roots of the derivative, so the polynomial is monotonic in
+		/// each part and has at most one root there, which is found with bisection and Newton steps.
+		/// Roots where the polynomial doesn't change sign are missed
+		int FindRoots(const real * coefficients, int degree, real t0, real t1, real * roots)
+		{
+			constexpr int MaxIterations = 64;
+
+			if (degree == 1)
+			{
+				if (coefficients[1] == 0)
+					return 0;
+
+				real root = -coefficients[0] / coefficients[1];
+
+				if (root < t0 || root > t1)
+					return 0;
+
+				roots[0] = root;
+				return 1;
+			}
+
+			real derivative[4];
+
+			for (int i = 1; i <= degree; i++)
+				derivative[i - 1] = coefficients[i] * i;
+
+			real bounds[5];
+			int boundCount = 0;
+
+			bounds[boundCount++] = t0;
+			boundCount += FindRoots(derivative, degree - 1, t0, t1, bounds + boundCount);
+			bounds[boundCount++] = t1;
+
+			int count = 0;
+
+			for (int i = 0; i + 1 < boundCount; i++)
+			{
+				real a = bounds[i], b = bounds[i + 1];
+				real fa = EvaluatePolynomial(coefficients, degree, a);
+				real fb = EvaluatePolynomial(coefficients, degree, b);
+
+				if (fa == 0)
+				{
+					if (count == 0 || roots[count - 1] != a)
+						roots[count++] = a;
+
+					continue;
+				}
+
+				if ((fa > 0) == (fb > 0))
+					continue;
+
+				// Keep f(a) < 0 < f(b)
+				if (fa > 0)
+					std::swap(a, b);
+
+				real t = (a + b) / 2;
+
+				for (int iteration = 0; iteration < MaxIterations; iteration++)
+				{
+					real f = EvaluatePolynomial(coefficients, degree, t);
+
+					if (f == 0)
+						break;
+
+					if (f < 0)
+						a = t;
+					else
+						b = t;
+
+					// Newton step, or bisection if it leaves the bracket
+					real slope = EvaluatePolynomial(derivative, degree - 1, t);
+					real next = slope != 0 ? t - f / slope : a;
+
+					if ((next - a) * (next - b) >= 0)
+						next = (a + b) / 2;
+
+					if (std::abs(next - t) <= std::numeric_limits<real>::epsilon() * std::abs(t))
+					{
+						t = next;
+						break;
+					}
+
+					t = next;
+				}
+
+				roots[count++] = t;
+			}
+
+			return count;
+		}
+	}
+}
+
+bool re::Box::GetBounds(BoundingBox & bounds)
+{
+	bounds = BoundingBox(-Vector3::One, Vector3::One);
+	return true;
+}
+
+re::RayHitResult re::Box::Intersect(const Ray & ray)
+{
+	return IntersectShape(*this, ray);
+}
+
+bool re::Box::Intersect(const Ray & ray, Hit & hit)
+{
+	real tNear, tFar;
+	int nearAxis, farAxis;
+
+	if (!IntersectSlabs(-Vector3::One, Vector3::One, ray, tNear, tFar, nearAxis, farAxis))
+		return false;
+
+	// If the near intersection is out of range, the ray might start inside the box
+	real t = tNear;
+	int axis = nearAxis;
+
+	if (t < ray.TMin)
+	{
+		t = tFar;
+		axis = farAxis;
+	}
+
+	if (t < ray.TMin || t > ray.TMax)
+		return false;
+
+	hit.T = t;
+	hit.PrimitiveID = static_cast<uint32_t>(axis);
+	hit.U = hit.V = 0;
+
+	return true;
+}
+
+bool re::Box::Occluded(const Ray & ray)
+{
+	Hit hit;
+	return Box::Intersect(ray, hit);
+}
+
+re::Vector3 re::Box::GetNormal(const Ray & ray, const Hit & hit)
+{
+	Vector3 point = ray.Origin + ray.Direction * hit.T;
+	Vector3 normal;
+	normal.Elements[hit.PrimitiveID] = point.Elements[hit.PrimitiveID] > 0 ? 1 : -1;
+	return normal;
+}
+
+bool re::Cylinder::GetBounds(BoundingBox & bounds)
+{
+	bounds = BoundingBox(-Vector3::One, Vector3::One);
+	return true;
+}
+
+re::RayHitResult re::Cylinder::Intersect(const Ray & ray)
+{
+	return IntersectShape(*this, ray);
+}
+
+bool re::Cylinder::Intersect(const Ray & ray, Hit & hit)
+{
+	const Vector3& o = ray.Origin;
+	const Vector3& d = ray.Direction;
+
+	real t = ray.TMax;
+	uint32_t primitive = 0;
+	bool result = false;
+
+	// Side: x^2 + z^2 = 1 with |y| <= 1
+	real a = d.X * d.X + d.Z * d.Z;
+	real b = o.X * d.X + o.Z * d.Z;
+	real c = o.X * o.X + o.Z * o.Z - 1;
+	real discriminant = b * b - a * c;
+
+	if (a > 0 && discriminant >= 0)
+	{
+		real offset = std::sqrt(discriminant);
+		real roots[2] = { (-b - offset) / a, (-b + offset) / a };
+
+		for (real root : roots)
+		{
+			if (std::abs(o.Y + d.Y * root) <= 1 && Closer(root, ray.TMin, t))
+			{
+				primitive = 0;
+				result = true;
+				break;
+			}
+		}
+	}
+
+	// Caps: y = 1 and y = -1 with x^2 + z^2 <= 1
+	if (Capped && d.Y != 0)
+	{
+		for (uint32_t cap = 1; cap <= 2; cap++)
+		{
+			real root = ((cap == 1 ? 1 : -1) - o.Y) / d.Y;
+			real x = o.X + d.X * root, z = o.Z + d.Z * root;
+
+			if (x * x + z * z <= 1 && Closer(root, ray.TMin, t))
+			{
+				primitive = cap;
+				result = true;
+			}
+		}
+	}
+
+	if (!result)
+		return false;
+
+	hit.T = t;
+	hit.PrimitiveID = primitive;
+	hit.U = hit.V = 0;
+
+	return true;
+}
+
+bool re::Cylinder::Occluded(const Ray & ray)
+{
+	Hit hit;
+	return Cylinder::Intersect(ray, hit);
+}
+
+re::Vector3 re::Cylinder::GetNormal(const Ray & ray, const Hit & hit)
+{
+	switch (hit.PrimitiveID)
+	{
+	case 1: return Vector3::Up;
+	case 2: return -Vector3::Up;
+	default:
+		Vector3 point = ray.Origin + ray.Direction * hit.T;
+		return { point.X, 0, point.Z };
+	}
+}
+
+bool re::Disk::GetBounds(BoundingBox & bounds)
+{
+	bounds = BoundingBox({ -1, 0, -1 }, { 1, 0, 1 });
+	return true;
+}
+
+re::RayHitResult re::Disk::Intersect(const Ray & ray)
+{
+	return IntersectShape(*this, ray);
+}
+
+bool re::Disk::Intersect(const Ray & ray, Hit & hit)
+{
+	// Same culling as the Plane
+	real distance = ray.Origin.Y;
+
+	if (distance < 0)
+		return false;
+
+	real cosine = ray.Direction.Y;
+
+	if (cosine >= 0)
+		return false;
+
+	real t = distance / -cosine;
+
+	if (t < ray.TMin || t > ray.TMax)
+		return false;
+
+	real x = ray.Origin.X + ray.Direction.X * t;
+	real z = ray.Origin.Z + ray.Direction.Z * t;
+
+	if (x * x + z * z > 1)
+		return false;
+
+	hit.T = t;
+	hit.PrimitiveID = 0;
+	hit.U = hit.V = 0;
+
+	return true;
+}
+
+bool re::Disk::Occluded(const Ray & ray)
+{
+	Hit hit;
+	return Disk::Intersect(ray, hit);
+}
+
+re::Vector3 re::Disk::GetNormal(const Ray & ray, const Hit & hit)
+{
+	return Vector3::Up;
+}
+
+bool re::Torus::GetBounds(BoundingBox & bounds)
+{
+	real extent = 1 + MinorRadius;
+	bounds = BoundingBox({ -extent, -MinorRadius, -extent }, { extent, MinorRadius, extent });
+	return true;
+}
+
+re::RayHitResult re::Torus::Intersect(const Ray & ray)
+{
+	return IntersectShape(*this, ray);
+}
+
+bool re::Torus::Intersect(const Ray & ray, Hit & hit)
+{
+	// Only the part of the ray inside the bounds is searched
+	BoundingBox bounds;
+	GetBounds(bounds);
+
+	real tNear, tFar;
+	int nearAxis, farAxis;
+
+	if (!IntersectSlabs(bounds.Min, bounds.Max, ray, tNear, tFar, nearAxis, farAxis))
+		return false;
+
+	tNear = std::max(tNear, ray.TMin);
+	tFar = std::min(tFar, ray.TMax);
+
+	if (tNear > tFar)
+		return false;
+
+	// Solve (|p|^2 + 1 - r^2)^2 = 4 (px^2 + pz^2), with p = o + d * s and o at the start of the range.
+	// Moving the origin close to the torus keeps the coefficients well conditioned
+	Vector3 o = ray.Origin + ray.Direction * tNear;
+	const Vector3& d = ray.Direction;
+
+	real a = Dot(d, d);
+	real b = 2 * Dot(o, d);
+	real c = Dot(o, o) + 1 - MinorRadius * MinorRadius;
+
+	real coefficients[5] = {
+		c * c - 4 * (o.X * o.X + o.Z * o.Z),
+		2 * b * c - 8 * (o.X * d.X + o.Z * d.Z),
+		b * b + 2 * a * c - 4 * (d.X * d.X + d.Z * d.Z),
+		2 * a * b,
+		a * a
+	};
+
+	real roots[4];
+
+	if (FindRoots(coefficients, 4, 0, tFar - tNear, roots) == 0)
+		return false;
+
+	hit.T = tNear + roots[0];
+	hit.PrimitiveID = 0;
+	hit.U = hit.V = 0;
+
+	return true;
+}
+
+bool re::Torus::Occluded(const Ray & ray)
+{
+	Hit hit;
+	return Torus::Intersect(ray, hit);
+}
+
+re::Vector3 re::Torus::GetNormal(const Ray & ray, const Hit & hit)
+{
+	// Gradient of the implicit function
+	Vector3 point = ray.Origin + ray.Direction * hit.T;
+	real k = Dot(point, point) + 1 - MinorRadius * MinorRadius;
+
+	return { point.X * (k - 2), point.Y * k, point.Z * (k - 2) };
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include "Common.h"
+#include "Scene.h"
+
+namespace re
+{
+	// Analytic shapes. Like the Sphere, they are defined in a canonical local space, and are
+	// placed and sized with the transform of the node
+
+	/// Box from (-1, -1, -1) to (1, 1, 1). The PrimitiveID of a hit is the axis of the face
+	class Box : public Shape
+	{
+	public:
+		Box(SceneNode * owner) : Shape(owner) {}
+
+		virtual size_t GetMemoryUsage() const override { return sizeof(Box); }
+		virtual bool GetBounds(BoundingBox& bounds) override;
+
+		virtual RayHitResult Intersect(const Ray& ray) override;
+		virtual bool Intersect(const Ray& ray, Hit& hit) override;
+		virtual bool Occluded(const Ray& ray) override;
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit) override;
+	};
+
+	/// Cylinder of radius 1 around the Y axis, from y = -1 to y = 1. The PrimitiveID of a hit
+	/// is 0 for the side, 1 for the top cap and 2 for the bottom cap
+	class Cylinder : public Shape
+	{
+	public:
+		bool Capped = true;
+
+		Cylinder(SceneNode * owner) : Shape(owner) {}
+
+		virtual size_t GetMemoryUsage() const override { return sizeof(Cylinder); }
+		virtual bool GetBounds(BoundingBox& bounds) override;
+
+		virtual RayHitResult Intersect(const Ray& ray) override;
+		virtual bool Intersect(const Ray& ray, Hit& hit) override;
+		virtual bool Occluded(const Ray& ray) override;
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit) override;
+	};
+
+	/// Disk of radius 1 on the XZ plane. Like the Plane, it is only visible from the
+	/// side of its normal (the Y axis)
+	class Disk : public Shape
+	{
+	public:
+		Disk(SceneNode * owner) : Shape(owner) {}
+
+		virtual size_t GetMemoryUsage() const override { return sizeof(Disk); }
+		virtual bool GetBounds(BoundingBox& bounds) override;
+
+		virtual RayHitResult Intersect(const Ray& ray) override;
+		virtual bool Intersect(const Ray& ray, Hit& hit) override;
+		virtual bool Occluded(const Ray& ray) override;
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit) override;
+	};
+
+	/// Torus around the Y axis, with a major radius of 1
+	class Torus : public Shape
+	{
+	public:
+		real MinorRadius = 0.25;
+
+		Torus(SceneNode * owner) : Shape(owner) {}
+
+		virtual size_t GetMemoryUsage() const override { return sizeof(Torus); }
+		virtual bool GetBounds(BoundingBox& bounds) override;
+
+		virtual RayHitResult Intersect(const Ray& ray) override;
+		virtual bool Intersect(const Ray& ray, Hit& hit) override;
+		virtual bool Occluded(const Ray& ray) override;
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit) override;
+	};
+}
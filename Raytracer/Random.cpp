@@ -0,0 +1,7 @@
+#include "Random.h"
+
+re::RandomGenerator & re::GetThreadRandomGenerator()
+{
+	thread_local RandomGenerator generator;
+	return generator;
+}
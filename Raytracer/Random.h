@@ -0,0 +1,87 @@
+#pragma once
+#include "Common.h"
+#include <cstdint>
+
+namespace re
+{
+	/// PCG32 random number generator (see pcg-random.org): 16 bytes of state, a few instructions
+	/// per number and a good statistical quality. Generators are plain values, so every thread or
+	/// every sample can own one and nothing is shared. The sequence only depends on the seed and
+	/// the stream, generators with the same seed and different streams are independent
+	class RandomGenerator
+	{
+	public:
+
+		static constexpr uint64_t DefaultSeed = 0x853c49e6748fea9bull;
+
+		explicit RandomGenerator(uint64_t seed = DefaultSeed, uint64_t stream = 0)
+		{
+			m_State = 0;
+			m_Increment = (stream << 1) | 1;
+			NextUInt();
+			m_State += seed;
+			NextUInt();
+		}
+
+		/// Generator for a sample of a pixel at a given bounce. The numbers only depend on these
+		/// values and on the seed of the render, so the result doesn't depend on the number of
+		/// threads or on the order in which pixels are rendered
+		static RandomGenerator ForSample(uint64_t seed, uint64_t pixel, uint32_t sample, uint32_t bounce)
+		{
+			return RandomGenerator(Mix(seed ^ Mix(pixel)), (static_cast<uint64_t>(sample) << 32) | bounce);
+		}
+
+		/// Uniform in [0, 2^32)
+		uint32_t NextUInt()
+		{
+			uint64_t state = m_State;
+			m_State = state * 6364136223846793005ull + m_Increment;
+
+			uint32_t xorShifted = static_cast<uint32_t>(((state >> 18) ^ state) >> 27);
+			uint32_t rotation = static_cast<uint32_t>(state >> 59);
+
+			return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+		}
+
+		/// Uniform in [0, bound), without modulo bias
+		uint32_t NextUInt(uint32_t bound)
+		{
+			uint32_t threshold = (0u - bound) % bound;
+
+			for (;;)
+			{
+				uint32_t value = NextUInt();
+
+				if (value >= threshold)
+					return value % bound;
+			}
+		}
+
+		/// Uniform in [0, 1)
+		real NextReal() { return NextUInt() * (1.0 / 4294967296.0); }
+
+		/// Uniform in [min, max)
+		real NextReal(real min, real max) { return min + (max - min) * NextReal(); }
+
+		/// 64 bit hash (the SplitMix64 finalizer), to turn counters into seeds
+		static uint64_t Mix(uint64_t value)
+		{
+			value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+			value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+			return value ^ (value >> 31);
+		}
+
+	private:
+		uint64_t m_State, m_Increment;
+	};
+
+	/// Generator of the calling thread. Every thread starts with the default seed, so the numbers
+	/// drawn by a thread don't depend on the other threads
+	RandomGenerator& GetThreadRandomGenerator();
+
+	/// Uniform in [min, max), from the generator of the calling thread
+	template<typename T> inline T Random(T min = 0, T max = 1)
+	{
+		return (T)GetThreadRandomGenerator().NextReal(min, max);
+	}
+}
@@ -33,7 +33,7 @@ re::AbstractRaycaster::~AbstractRaycaster()
 
 void re::AbstractRaycaster::Render(Scene * scene, std::promise<RenderStatus> p)
 {
-	m_Status = { false, false, 0, m_Pixels };
+	m_Status = { false, false, 0, m_Pixels, 0 };
 
 	// We create a main thread that runs the rendering process
 	auto threadFunc = [scene, this](std::promise<RenderStatus> p) {
@@ -47,7 +47,6 @@ void re::AbstractRaycaster::Render(Scene * scene, std::promise<RenderStatus> p)
 		// the available scanlines (see function DoRayTracethread)
 
 		std::vector<std::function<void()>> functions;
-		m_CurrentRenderScanline = 0;
 
 		for (unsigned int i = 0; i < NumThreads; i++) 
 		{
@@ -57,21 +56,31 @@ void re::AbstractRaycaster::Render(Scene * scene, std::promise<RenderStatus> p)
 				scene
 			));
 		}
-		
-		std::vector<std::future<void>> futures;
 
-		for (auto func : functions)
+		// Each pass is averaged in the color buffer, and the pixels are updated when it's done
+		for (m_CurrentPass = 0; m_CurrentPass < std::max(Passes, 1u) && !m_Status.Interruped; m_CurrentPass++)
 		{
-			futures.push_back(std::async(std::launch::async, func));
-		}
+			m_CurrentRenderScanline = 0;
 
-		// Wait for all threads to complete their execution
-		for (auto &f : futures)
-		{
-			f.wait();
-		}
+			std::vector<std::future<void>> futures;
+
+			for (auto func : functions)
+			{
+				futures.push_back(std::async(std::launch::async, func));
+			}
+
+			// Wait for all threads to complete their execution
+			for (auto &f : futures)
+			{
+				f.wait();
+			}
 
-		ColorsToPixels(m_ColorBuffer0, m_Pixels);
+			if (m_Status.Interruped)
+				break;
+
+			ColorsToPixels(m_ColorBuffer0, m_Pixels);
+			m_Status.CompletedPasses = m_CurrentPass + 1;
+		}
 		
 		m_Status.Pixels = m_Pixels;
 		m_Status.Finished = true;
@@ -99,7 +108,7 @@ re::Renderer::RenderStatus re::AbstractRaycaster::GetStatus()
 }
 
 
-re::Ray re::AbstractRaycaster::CreateScreenRay(Scene * scene, real x, real y)
+re::Ray re::AbstractRaycaster::CreateScreenRay(Scene * scene, real x, real y, real spacing, RayDifferential& differential)
 {
 	// GetSeed axis base
 	Vector3 forward = scene->Camera.Direction.Normalized();
@@ -112,10 +121,23 @@ re::Ray re::AbstractRaycaster::CreateScreenRay(Scene * scene, real x, real y)
 	real xFactor = ((real)x / m_ViewWidth) * 2.0f - 1.0f;
 	real yFactor = 1.0f - ((real)y / m_ViewHeight) * 2.0f;
 
+	Vector3 direction = forward + right * xFactor * w2 + up * yFactor * h2;
+
 	Ray result;
 
 	result.Origin = scene->Camera.Position;
-	result.Direction = (forward + right * xFactor * w2 + up * yFactor * h2).Normalized();
+	result.Direction = direction.Normalized();
+
+	// Derivative of the normalized direction, for a change of the unnormalized one
+	auto normalizedDerivative = [&direction](const Vector3& derivative) -> Vector3 {
+		real squaredLength = direction ^ direction;
+		return (derivative * squaredLength - direction * (direction ^ derivative)) / (squaredLength * std::sqrt(squaredLength));
+	};
+
+	differential.OriginX = Vector3::Zero;
+	differential.OriginY = Vector3::Zero;
+	differential.DirectionX = normalizedDerivative(right * (w2 * 2.0f * spacing / m_ViewWidth));
+	differential.DirectionY = normalizedDerivative(up * (-h2 * 2.0f * spacing / m_ViewHeight));
 
 	return result;
 }
@@ -123,31 +145,42 @@ re::Ray re::AbstractRaycaster::CreateScreenRay(Scene * scene, real x, real y)
 void re::AbstractRaycaster::DoRaytraceThread(Scene * m_Scene)
 {
 	unsigned int x;
+	unsigned int passes = std::max(Passes, 1u);
 	// The "NextRenderScanline" function gives us the scanline we have to render in this thread. Uses a mutex since
 	// the threads are racing for scanlines
 	while (NextRenderScanline(x))
 	{
-		for (int y = 0; y < m_ViewHeight; y++)
+		for (size_t y = 0; y < m_ViewHeight; y++)
 		{
+			size_t pixel = y * m_ViewWidth + x;
+			Color result(Color::Black);
+
 			if (Antialiasing == AAMode::SSAA) {
-				Color result(Color::Black);
+				uint32_t sample = m_CurrentPass * 9;
 				for (int dx = -1; dx <= 1; dx++)
 				{
 					for (int dy = -1; dy <= 1; dy++)
 					{
-						Ray ray = CreateScreenRay(m_Scene, x + dx * .5f, y + dy * .5f);
-						result += (Raycast(m_Scene, ray) * (1.0f / 9.0f));
+						RayDifferential differential;
+						Ray ray = CreateScreenRay(m_Scene, x + dx * .5f, y + dy * .5f, .5f, differential);
+						RandomGenerator random = RandomGenerator::ForSample(Seed, pixel, sample++, 0);
+						result += (Raycast(m_Scene, ray, differential, random) * (1.0f / 9.0f));
 					}
 				}
-				m_ColorBuffer0[y * m_ViewWidth + x] = result;
 			}
 			else
 			{
-				Ray ray = CreateScreenRay(m_Scene, x, y);
-				m_ColorBuffer0[y * m_ViewWidth + x] = Raycast(m_Scene, ray);
+				RayDifferential differential;
+				Ray ray = CreateScreenRay(m_Scene, x, y, 1.0f, differential);
+				RandomGenerator random = RandomGenerator::ForSample(Seed, pixel, m_CurrentPass, 0);
+				result = Raycast(m_Scene, ray, differential, random);
 			}
+
+			// Running mean of the passes
+			m_ColorBuffer0[pixel] = m_CurrentPass == 0 ? result : Mix(m_ColorBuffer0[pixel], result, (real)1 / (m_CurrentPass + 1));
+
 			// Update the current status
-			m_Status.Percent += 1.0f / (m_ViewWidth * m_ViewHeight);
+			m_Status.Percent += 1.0f / (m_ViewWidth * m_ViewHeight * passes);
 
 			// If the process has been interrupted, just return and and this thread
 			if (m_Status.Interruped)
@@ -184,7 +217,7 @@ bool re::AbstractRaycaster::NextRenderScanline(unsigned int& sliceX)
 	}
 }
 
-re::Color re::Raytracer::RecursiveRaytrace(Scene * scene, const Ray & ray, int recursion)
+re::Color re::Raytracer::RecursiveRaytrace(Scene * scene, const Ray & ray, const RayDifferential& differential, RandomGenerator& random, int recursion)
 {
 	// Find the closest intersection if any
 	Scene::RaycastResult raycastResult = scene->CastRay(ray);
@@ -197,78 +230,160 @@ re::Color re::Raytracer::RecursiveRaytrace(Scene * scene, const Ray & ray, int r
 
 		Vector3 worldPoint = raycastResult.Point;
 		Vector3 localPoint = raycastResult.LocalPoint;
-		auto shape = raycastResult.Node->GetComponentOfType<Shape>();
 		Vector3 normal = raycastResult.Normal;
-		Material * material = shape->Material;
+		Material * material = raycastResult.Material;
+
+		// Offsets of the hit point for the neighbouring pixels, on the tangent plane of the surface
+		real t = (worldPoint - ray.Origin) ^ ray.Direction;
+		real cosine = ray.Direction ^ normal;
+
+		auto transfer = [&](const Vector3& origin, const Vector3& direction) -> Vector3 {
+			Vector3 offset = origin + direction * t;
+			return cosine != 0 ? offset - ray.Direction * ((offset ^ normal) / cosine) : offset;
+		};
+
+		Vector3 pointX = transfer(differential.OriginX, differential.DirectionX);
+		Vector3 pointY = transfer(differential.OriginY, differential.DirectionY);
+
+		// Width of the footprint in the space of the material, and in texture coordinates
+		real footprint = 0;
+		TexCoordSample texCoord;
+
+		if (raycastResult.ObjectFromWorld != nullptr)
+		{
+			Vector3 localX = raycastResult.ObjectFromWorld->TransformVector(pointX);
+			Vector3 localY = raycastResult.ObjectFromWorld->TransformVector(pointY);
+
+			if (FilterNoises)
+				footprint = std::max(localX.Length(), localY.Length());
+
+			if (raycastResult.HasTexCoord)
+			{
+				auto texCoordOffset = [&](const Vector3& offset) -> real {
+					real u = raycastResult.TexCoordGradientU ^ offset, v = raycastResult.TexCoordGradientV ^ offset;
+					return std::sqrt(u * u + v * v);
+				};
+
+				texCoord.Valid = true;
+				texCoord.TexCoord = raycastResult.TexCoord;
+				texCoord.Footprint = std::max(texCoordOffset(localX), texCoordOffset(localY));
+			}
+		}
+
 		// Handle direct lighting
 
-		real absorptance = material->GetAbsorptance(localPoint);
-		real reflectance = material->GetReflectance(localPoint);
+		// Every property of the material with a single evaluation
+		SurfaceSample surface = raycastResult.CompiledMaterial != nullptr ?
+			raycastResult.CompiledMaterial->Evaluate(localPoint, footprint, texCoord) : material->Evaluate(localPoint, footprint, texCoord);
+		real absorptance = surface.Absorptance;
+		real reflectance = surface.Reflectance;
 
 		if (absorptance > 0) 
 		{
+			// The scene culls the point lights that are too far to light the hit
+			thread_local std::vector<uint32_t> lights;
+			scene->GetLights(worldPoint, lights);
+
+			// Ambient lights are never sampled, only the other lights are worth sampling when they
+			// are more than the samples
+			size_t sampledLights = 0;
 
-			for (auto light : scene->Lights)
+			if (LightSamples > 0)
+				for (uint32_t index : lights)
+					sampledLights += scene->Lights[index]->Type != LightType::Ambient;
+
+			if (sampledLights <= LightSamples)
 			{
-				if (!light->Enabled)
+				for (uint32_t index : lights)
 				{
-					continue;
-				}
+					const Light& light = *scene->Lights[index];
 
-				// Cast shadow ray
-				bool shadowRayHit = false;
-				Ray shadowRay;
+					// The diffuse factor comes first, so that no shadow ray is cast for the lights that
+					// don't light the point
+					Ray shadowRay;
+					real diffuseFactor = GetDiffuseFactor(light, worldPoint, normal, shadowRay);
+
+					// Colors are clamped, so the lights with a negative factor don't contribute either
+					if (diffuseFactor <= 0)
+						continue;
 
-				switch (light->Type)
-				{
-				case LightType::Directional:
-					shadowRay.Origin = worldPoint;
-					shadowRay.Direction = light->Direction;
-					shadowRayHit = CastShadowRay(scene, shadowRay);
-					break;
-				case LightType::Point:
-					shadowRay.Origin = worldPoint;
-					shadowRay.Direction = (light->Position - worldPoint).Normalized();
-					shadowRayHit = CastShadowRay(scene, shadowRay);
-					break;
-				case LightType::Ambient:
 					// Ambient light always passes trough
-					shadowRayHit = false;
-					break;
-				default:
-					break;
+					if (light.Type != LightType::Ambient && CastShadowRay(scene, shadowRay))
+						continue;
+
+					directLighting +=
+						light.Color * surface.AbsorbedColor * diffuseFactor * absorptance;
 				}
+			}
+			else
+			{
+				// Contribution of each light without shadows. The lights are picked in proportion to
+				// their luma, so the shadow rays go to the lights that matter most
+				struct Candidate
+				{
+					Color Contribution;
+					Ray ShadowRay;
+					real Weight;
+				};
+
+				thread_local std::vector<Candidate> candidates;
+				candidates.clear();
 
-				// Handle lighting if hit
+				real totalWeight = 0;
 
-				if (!shadowRayHit) {
-					real diffuseFactor = 0.0f;
-					real distance, attenuation;
-					Vector3 direction, lightVector;
+				for (uint32_t index : lights)
+				{
+					const Light& light = *scene->Lights[index];
+
+					Ray shadowRay;
+					real diffuseFactor = GetDiffuseFactor(light, worldPoint, normal, shadowRay);
+
+					if (diffuseFactor <= 0)
+						continue;
 
-					switch (light->Type)
+					Color contribution = light.Color * surface.AbsorbedColor * diffuseFactor * absorptance;
+
+					if (light.Type == LightType::Ambient)
 					{
-					case LightType::Directional:
-						diffuseFactor = std::fmaxf(0.0f, normal ^ light->Direction);
-						break;
-					case LightType::Point:
-						lightVector = light->Position - worldPoint;
-						direction = lightVector.Normalized();
-						distance = lightVector.Length();
-						attenuation = 1.0f - ((distance * distance) / (light->Attenuation * light->Attenuation));
-						diffuseFactor = std::fmaxf(0.0f, direction ^ normal) * attenuation;
-						break;
-					case LightType::Ambient:
-						// Ambient light lights everything with the same factor
-						diffuseFactor = 1.0f;
-						break;
-					default:
-						break;
+						directLighting += contribution;
+						continue;
 					}
-					
-					directLighting +=
-						light->Color * material->GetAbsorbedColor(localPoint) * diffuseFactor * absorptance;
+
+					real weight = contribution.Luma();
+
+					if (weight <= 0)
+						continue;
+
+					totalWeight += weight;
+					candidates.push_back({ contribution, shadowRay, totalWeight });
+				}
+
+				// The weights are cumulative, each sample is a binary search. A light picked with
+				// probability p adds its contribution divided by p, in real numbers since the sum of
+				// the samples can go over 1 before it's divided
+				real sum[3] = { 0, 0, 0 };
+
+				for (unsigned int i = 0; i < LightSamples && !candidates.empty(); i++)
+				{
+					real u = random.NextReal() * totalWeight;
+					auto it = std::upper_bound(candidates.begin(), candidates.end(), u,
+						[](real value, const Candidate& candidate) { return value < candidate.Weight; });
+
+					if (it == candidates.end())
+						it = candidates.end() - 1;
+
+					if (CastShadowRay(scene, it->ShadowRay))
+						continue;
+
+					real weight = it->Weight - (it == candidates.begin() ? 0 : (it - 1)->Weight);
+					real factor = totalWeight / (weight * LightSamples);
+
+					sum[0] += it->Contribution.R * factor;
+					sum[1] += it->Contribution.G * factor;
+					sum[2] += it->Contribution.B * factor;
 				}
+
+				directLighting += Color(sum[0], sum[1], sum[2]);
 			}
 
 		}
@@ -280,7 +395,14 @@ re::Color re::Raytracer::RecursiveRaytrace(Scene * scene, const Ray & ray, int r
 			reflectedRay.Origin = worldPoint;
 			reflectedRay.Direction = ray.Direction.Reflect(normal);
 
-			indirectLighting = RecursiveRaytrace(scene, reflectedRay, recursion + 1) * reflectance;
+			// The normal is assumed constant around the hit, curved surfaces spread the rays more than this
+			RayDifferential reflectedDifferential;
+			reflectedDifferential.OriginX = pointX;
+			reflectedDifferential.OriginY = pointY;
+			reflectedDifferential.DirectionX = differential.DirectionX - normal * (2 * (differential.DirectionX ^ normal));
+			reflectedDifferential.DirectionY = differential.DirectionY - normal * (2 * (differential.DirectionY ^ normal));
+
+			indirectLighting = RecursiveRaytrace(scene, reflectedRay, reflectedDifferential, random, recursion + 1) * reflectance;
 		}
 
 		return directLighting + indirectLighting;
@@ -289,32 +411,55 @@ re::Color re::Raytracer::RecursiveRaytrace(Scene * scene, const Ray & ray, int r
 	else
 	{
 		// If we dont hit anything, return the background
-		if (scene->Background != nullptr)
-		{
-			return scene->Background->GetColor(ray.Direction);
-		}
-		else
-		{
-			return Color::Black;
-		}
+		return scene->GetBackgroundColor(ray.Direction);
 	}
 
 
 }
 
+re::real re::Raytracer::GetDiffuseFactor(const Light & light, const Vector3 & point, const Vector3 & normal, Ray & shadowRay)
+{
+	shadowRay.Origin = point;
+
+	switch (light.Type)
+	{
+	case LightType::Directional:
+		shadowRay.Direction = light.Direction;
+		return std::fmaxf(0.0f, normal ^ light.Direction);
+	case LightType::Point:
+	{
+		Vector3 lightVector = light.Position - point;
+		Vector3 direction = lightVector.Normalized();
+		real distance = lightVector.Length();
+		real attenuation = 1.0f - ((distance * distance) / (light.Attenuation * light.Attenuation));
+
+		// Occluders behind the light don't cast shadows
+		shadowRay.Direction = direction;
+		shadowRay.TMax = distance;
+		return std::fmaxf(0.0f, direction ^ normal) * attenuation;
+	}
+	case LightType::Ambient:
+		// Ambient light lights everything with the same factor
+		return 1.0f;
+	default:
+		return 0.0f;
+	}
+}
+
 bool re::Raytracer::CastShadowRay(Scene * m_Scene, const Ray & shadowRay)
 {
-	constexpr real epsilon = std::numeric_limits<real>::epsilon();
-	Scene::RaycastResult result = m_Scene->CastRay(shadowRay);
-	return result.Hit;
+	// Any hit in range is enough, the surface isn't needed
+	Ray ray = shadowRay;
+	ray.TMin = std::max(ray.TMin, Scene::MinHitDistance);
+	return m_Scene->Occluded(ray);
 }
 
-re::Color re::Raytracer::Raycast(Scene * scene, const Ray & ray)
+re::Color re::Raytracer::Raycast(Scene * scene, const Ray & ray, const RayDifferential& differential, RandomGenerator& random)
 {
-	return RecursiveRaytrace(scene, ray, 0);
+	return RecursiveRaytrace(scene, ray, differential, random, 0);
 }
 
-re::Color re::DebugRaycaster::Raycast(Scene * scene, const Ray & ray)
+re::Color re::DebugRaycaster::Raycast(Scene * scene, const Ray & ray, const RayDifferential& differential, RandomGenerator& random)
 {
 	Scene::RaycastResult result = scene->CastRay(ray);
 
@@ -334,14 +479,11 @@ re::Color re::DebugRaycaster::Raycast(Scene * scene, const Ray & ray)
 	case Modes::Color:
 		if (result.Hit)
 		{
-			return result.Node->GetComponentOfType<Shape>()->Material->GetAbsorbedColor(result.LocalPoint);
+			return result.Material->GetAbsorbedColor(result.LocalPoint);
 		}
 		else
 		{
-			if (scene->Background != nullptr)
-			{
-				return scene->Background->GetColor(ray.Direction);
-			}
+			return scene->GetBackgroundColor(ray.Direction);
 		}
 
 	}
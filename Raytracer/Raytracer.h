@@ -1,6 +1,7 @@
 #pragma once
 #include "Common.h"
 #include "Scene.h"
+#include "Random.h"
 
 
 #define RE_DEBUG
@@ -23,6 +24,8 @@ namespace re
 			bool Interruped;
 			float Percent;
 			unsigned int * Pixels;
+			/// Number of passes already averaged in the pixels, see AbstractRaycaster::Passes
+			unsigned int CompletedPasses;
 		};
 
 		Renderer(size_t viewWidth, size_t viewHeight, real fovY = PI / 4) :
@@ -73,9 +76,20 @@ namespace re
 
 		unsigned int NumThreads = 4;
 
+		/// Progressive rendering: the image is rendered this many times and the passes are averaged.
+		/// The pixels are updated after each pass, so the status shows the image converging. Only
+		/// useful with stochastic rendering (see Raytracer::LightSamples), otherwise passes are the same
+		unsigned int Passes = 1;
+
+		/// Seed of the random generators given to Raycast. The samples only depend on the seed, the
+		/// pixel and the pass, not on the number of threads
+		uint64_t Seed = RandomGenerator::DefaultSeed;
+
 	protected:
 
-		virtual Color Raycast(Scene * scene, const Ray& ray) = 0;
+		/// The differential is the change of the ray between neighbouring samples. The random
+		/// generator belongs to the sample
+		virtual Color Raycast(Scene * scene, const Ray& ray, const RayDifferential& differential, RandomGenerator& random) = 0;
 
 		Color *m_ColorBuffer0;
 
@@ -84,10 +98,12 @@ namespace re
 	private:
 
 		unsigned int m_CurrentRenderScanline;
+		unsigned int m_CurrentPass;
 		std::mutex m_RenderMutex;
-		RenderStatus m_Status = { true, true, 0, m_Pixels };
+		RenderStatus m_Status = { true, true, 0, m_Pixels, 0 };
 
-		Ray CreateScreenRay(Scene * m_Scene, real x, real y);
+		/// Spacing is the distance in pixels between the samples, for the ray differential
+		Ray CreateScreenRay(Scene * m_Scene, real x, real y, real spacing, RayDifferential& differential);
 		void DoRaytraceThread(Scene * m_Scene);
 
 		void ColorsToPixels(Color *cb, unsigned int *pixels);
@@ -103,16 +119,30 @@ namespace re
 
 		unsigned int MaxRecursion = 3;
 
+		/// Noises skip the details smaller than the footprint of a pixel on the surface, which
+		/// would only add aliasing (see Noise::SampleFiltered)
+		bool FilterNoises = true;
+
+		/// Number of lights sampled at each hit, 0 to shade with every light. The lights that can
+		/// reach the hit are picked at random in proportion to their contribution without shadows, and
+		/// weighted so that the mean of many passes is the same as shading with every light (up to
+		/// the clamp of the colors). A hit then casts at most this many shadow rays, whatever the
+		/// number of lights. Ambient lights are always added
+		unsigned int LightSamples = 0;
+
 		Raytracer(unsigned int viewWidth, unsigned int viewHeight, real fovY = PI / 4.0f) :
 			AbstractRaycaster(viewWidth, viewHeight, fovY) {}
 
 	protected:
-		virtual Color Raycast(Scene * m_Scene, const Ray& ray) override;
+		virtual Color Raycast(Scene * m_Scene, const Ray& ray, const RayDifferential& differential, RandomGenerator& random) override;
 
 	private:
-		Color RecursiveRaytrace(Scene * m_Scene, const Ray& ray, int recursion = 0);
+		Color RecursiveRaytrace(Scene * m_Scene, const Ray& ray, const RayDifferential& differential, RandomGenerator& random, int recursion = 0);
 		bool CastShadowRay(Scene * m_Scene, const Ray& shadowRay);
 
+		/// Diffuse factor of a light at a point, and the shadow ray toward it
+		static real GetDiffuseFactor(const Light& light, const Vector3& point, const Vector3& normal, Ray& shadowRay);
+
 	};
 
 	/// A raycaster for debugging and fast rendering the scene
@@ -130,7 +160,7 @@ namespace re
 		DebugRaycaster(unsigned int viewWidth, unsigned int viewHeight, real fovY = PI / 4.0f) :
 			AbstractRaycaster(viewWidth, viewHeight, fovY) {}
 	protected:
-		virtual Color Raycast(Scene * m_Scene, const Ray& ray) override;
+		virtual Color Raycast(Scene * m_Scene, const Ray& ray, const RayDifferential& differential, RandomGenerator& random) override;
 	
 	};
 }
\ No newline at end of file
@@ -1,271 +1,564 @@
 #include "Scene.h"
+#include "Mesh.h"
+#include "Primitives.h"
+#include "ThreadPool.h"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
 
-namespace re {
-	class KDTreeTriangle
+re::SkyBox::SkyBox(Color color0, Color color1, const std::shared_ptr<Light>& sun)
+	: m_SkyColor0(color0), m_SkyColor1(color1), m_Sun(sun)
+{
+	m_Perlin = std::make_shared<Perlin>(1);
+}
+
+re::Color re::SkyBox::GetColor(const Vector3 & direction) const
+{
+	return AddAnalyticColor(direction, GetBakedColor(direction));
+}
+
+re::Color re::SkyBox::GetBakedColor(const Vector3 & direction) const
+{
+	// Get the current sky color
+	//auto color = Lerp(m_SkyTop, m_SkyBottom, std::fmaxf(0, 1.0 - (direction ^ Vector3::Up)));
+	
+	real sample = m_Perlin->Sample((direction + Vector3::One) / 2);
+	return Mix(m_SkyColor0, m_SkyColor1, sample);
+}
+
+re::Color re::SkyBox::AddAnalyticColor(const Vector3 & direction, const Color & bakedColor) const
+{
+	constexpr float thresold = 0.98f;
+	constexpr float border = (1.0f - thresold) / 2.0f;
+	constexpr float thresoldPlusBorder = thresold + border;
+
+	if (m_Sun != nullptr && m_Sun->Type == LightType::Directional)
 	{
-	public:
+		float f = std::fmaxf(0, direction ^ m_Sun->Direction);
 
-		~KDTreeTriangle()
+		if (f < thresold)
+		{
+			return bakedColor;
+		}
+		else if (f < thresoldPlusBorder)
+		{
+			f = std::powf((f - thresold) / border, 2.0f);
+			return Mix(bakedColor, m_Sun->Color, f);
+		}
+		else
 		{
-			if (Left)
-				delete Left;
+			return m_Sun->Color;
+		}
+
+	}
+	else
+	{
+		return bakedColor;
+	}
+}
+
+re::Scene::Scene()
+{
+	m_Root = std::make_shared<SceneNode>();
+}
+
+namespace re
+{
+	namespace
+	{
+		constexpr size_t TraversalStackSize = 64;
 
-			if (Right)
-				delete Right;
+		// Dot product visible to the compiler, so that the hit tests of the built-in shapes
+		// are inlined in the traversal of the scene
+		inline real Dot(const Vector3& lhs, const Vector3& rhs)
+		{
+			return lhs.X * rhs.X + lhs.Y * rhs.Y + lhs.Z * rhs.Z;
 		}
 
-		KDTreeTriangle(const std::vector<Triangle>& triangles, const BoundingBox& bounds, int depth) :
-			Bounds(bounds),
-			Depth(depth)
+		Scene::ShapeTypes GetShapeType(const Shape * shape)
 		{
+			// Only the exact types, subclasses might override the intersection tests
+			const std::type_info& type = typeid(*shape);
+
+			if (type == typeid(Sphere))
+				return Scene::ShapeTypes::Sphere;
+			else if (type == typeid(Plane))
+				return Scene::ShapeTypes::Plane;
+			else if (type == typeid(Box))
+				return Scene::ShapeTypes::Box;
+			else if (type == typeid(Cylinder))
+				return Scene::ShapeTypes::Cylinder;
+			else if (type == typeid(Disk))
+				return Scene::ShapeTypes::Disk;
+			else if (type == typeid(Torus))
+				return Scene::ShapeTypes::Torus;
+			else if (type == typeid(Mesh))
+				return Scene::ShapeTypes::Mesh;
+			else
+				return Scene::ShapeTypes::Other;
+		}
 
+		/// Bounds of the transformed box
+		void TransformBounds(const AffineTransform& transform, const BoundingBox& bounds, Vector3& min, Vector3& max)
+		{
+			Vector3 center = transform.TransformPoint((bounds.Min + bounds.Max) / 2);
+			Vector3 extent = (bounds.Max - bounds.Min) / 2;
 
-			// Stop condition
-			if (triangles.size() <= 1 || Depth == 100)
+			for (int i = 0; i < 3; i++)
 			{
-				for (auto &t : triangles)
-					Triangles.push_back(t);
-				return;
+				const real * row = transform.Elements + i * 4;
+				real radius = std::abs(row[0]) * extent.X + std::abs(row[1]) * extent.Y + std::abs(row[2]) * extent.Z;
+
+				min.Elements[i] = center.Elements[i] - radius;
+				max.Elements[i] = center.Elements[i] + radius;
 			}
+		}
 
+		/// Slab test limited to the range [tMin, tMax]
+		inline bool IntersectBounds(const Vector3& min, const Vector3& max, const Ray& ray, const Vector3& invDirection, real tMin, real tMax)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				real t1 = (min.Elements[i] - ray.Origin.Elements[i]) * invDirection.Elements[i];
+				real t2 = (max.Elements[i] - ray.Origin.Elements[i]) * invDirection.Elements[i];
 
-			
-			// Select the split axis (round-robin)
-			unsigned int uAxis = depth % 3;
+				if (t1 > t2)
+					std::swap(t1, t2);
 
+				// NaN (ray parallel to the slab and starting on its border) skips the axis
+				if (t1 > tMin)
+					tMin = t1;
 
-			struct
-			{
-				BoundingBox LeftBounds, RightBounds;
-				std::vector<Triangle> LeftTris, RightTris;
-			} result;
+				if (t2 < tMax)
+					tMax = t2;
+			}
+
+			return tMin <= tMax;
+		}
 
-			// Take the median of all points as split point
-			real median = 0;
+		template<bool AnyHit, typename T>
+		inline bool IntersectShape(Shape * shape, const Ray& ray, Hit& hit)
+		{
+			// Qualified calls aren't virtual, and can be inlined
+			if constexpr (AnyHit)
+				return static_cast<T*>(shape)->T::Occluded(ray);
+			else
+				return static_cast<T*>(shape)->T::Intersect(ray, hit);
+		}
 
-			for (auto &t : triangles)
+		/// Hit query on the shape of an instance, the ray is in the local space of the instance
+		template<bool AnyHit>
+		inline bool IntersectInstance(const Scene::Instance& instance, const Ray& ray, Hit& hit)
+		{
+			switch (instance.Type)
 			{
-				median += t.Vertices[0].Elements[uAxis];
-				median += t.Vertices[1].Elements[uAxis];
-				median += t.Vertices[2].Elements[uAxis];
+			case Scene::ShapeTypes::Sphere: return IntersectShape<AnyHit, Sphere>(instance.Shape, ray, hit);
+			case Scene::ShapeTypes::Plane: return IntersectShape<AnyHit, Plane>(instance.Shape, ray, hit);
+			case Scene::ShapeTypes::Box: return IntersectShape<AnyHit, Box>(instance.Shape, ray, hit);
+			case Scene::ShapeTypes::Cylinder: return IntersectShape<AnyHit, Cylinder>(instance.Shape, ray, hit);
+			case Scene::ShapeTypes::Disk: return IntersectShape<AnyHit, Disk>(instance.Shape, ray, hit);
+			case Scene::ShapeTypes::Torus: return IntersectShape<AnyHit, Torus>(instance.Shape, ray, hit);
+			case Scene::ShapeTypes::Mesh: return IntersectShape<AnyHit, Mesh>(instance.Shape, ray, hit);
+			default: return AnyHit ? instance.Shape->Occluded(ray) : instance.Shape->Intersect(ray, hit);
 			}
+		}
+	}
+}
 
-			median /= 3 * triangles.size();
+void re::Scene::Compile()
+{
+	m_Root->Compile();
 
-			Bounds.Split(static_cast<Axis>(uAxis), median, result.LeftBounds, result.RightBounds);
+	// Flatten the scene graph
+	std::vector<Instance> instances;
+	CompileInstances(m_Root.get(), instances);
 
-			// Test every triangle in both left and right bounding boxes
-			for (auto& t : triangles)
-			{
+	// Unbounded instances are tested by every ray and are kept out of the tree
+	auto bounded = std::stable_partition(instances.begin(), instances.end(), [](const Instance& instance) { return !instance.Bounded; });
+	m_UnboundedCount = static_cast<size_t>(bounded - instances.begin());
 
-				if (t.Vertices[0].Elements[uAxis] <= median || t.Vertices[1].Elements[uAxis] <= median || t.Vertices[2].Elements[uAxis] <= median)
-				{
-					result.LeftTris.push_back(t);
-				}
+	std::vector<InstanceNode> nodes;
 
-				if (t.Vertices[0].Elements[uAxis] >= median || t.Vertices[1].Elements[uAxis] >= median || t.Vertices[2].Elements[uAxis] >= median)
-				{
-					result.RightTris.push_back(t);
-				}
-			}
+	if (m_UnboundedCount < instances.size())
+		BuildTree(instances, m_UnboundedCount, instances.size(), nodes);
 
+	// The arena keeps its memory between compilations
+	m_Arena.Reset();
+	CompileMaterials(instances);
+	m_Instances = m_Arena.Copy(instances.data(), instances.size());
+	m_Nodes = m_Arena.Copy(nodes.data(), nodes.size());
 
-			// Check that not too many triangles are in common (> 50%)
-			// between the subdivisions 
-			if (result.LeftTris.size() + result.RightTris.size() > 1.5 * triangles.size())
-			{
-				// If so, subdiving is not efficent anymore
-				for (auto &t : triangles)
-					Triangles.push_back(t);
+	CompileLights();
+	BakeNoises();
+	BakeBackground();
+}
 
-			}
-			else
-			{
-				// Subidivide
+void re::Scene::CompileLights()
+{
+	std::vector<uint32_t> unboundedLights;
+	std::vector<PointLight> pointLights;
 
-				if (result.LeftTris.size() > 0)
-					Left = new KDTreeTriangle(result.LeftTris, result.LeftBounds, depth + 1);
+	for (size_t i = 0; i < Lights.size(); i++)
+	{
+		const Light& light = *Lights[i];
 
-				if (result.RightTris.size() > 0)
-					Right = new KDTreeTriangle(result.RightTris, result.RightBounds, depth + 1);
-			}
+		if (!light.Enabled)
+			continue;
 
-			
+		if (light.Type != LightType::Point)
+		{
+			unboundedLights.push_back(static_cast<uint32_t>(i));
+			continue;
 		}
 
-		const unsigned int Depth;
-		const BoundingBox Bounds;
-		KDTreeTriangle *Left = nullptr, *Right = nullptr;
-		std::vector<Triangle> Triangles;
+		// Shading uses the square of the attenuation, so its sign doesn't matter. Past the radius
+		// the contribution is negative and clamped to 0, a radius of 0 lights nothing
+		real attenuation = std::abs(light.Attenuation);
 
-	};
+		if (attenuation == 0)
+			continue;
+
+		Vector3 radius(attenuation, attenuation, attenuation);
+
+		PointLight pointLight;
+		pointLight.Min = light.Position - radius;
+		pointLight.Max = light.Position + radius;
+		pointLight.Position = light.Position;
+		pointLight.SquaredRadius = light.Attenuation * light.Attenuation;
+		pointLight.Index = static_cast<uint32_t>(i);
+		pointLights.push_back(pointLight);
+	}
+
+	std::vector<InstanceNode> nodes;
+
+	if (!pointLights.empty())
+		BuildTree(pointLights, 0, pointLights.size(), nodes);
+
+	m_UnboundedLights = m_Arena.Copy(unboundedLights.data(), unboundedLights.size());
+	m_PointLights = m_Arena.Copy(pointLights.data(), pointLights.size());
+	m_LightNodes = m_Arena.Copy(nodes.data(), nodes.size());
 }
 
-re::SkyBox::SkyBox(Color color0, Color color1, const std::shared_ptr<Light>& sun)
-	: m_SkyColor0(color0), m_SkyColor1(color1), m_Sun(sun)
+void re::Scene::BakeNoises()
 {
-	m_Perlin = std::make_shared<Perlin>(1);
+	auto noises = GetNoises();
+
+	if (NoiseBake.Resolution == 0)
+	{
+		for (auto noise : noises)
+			noise->ClearBake();
+
+		return;
+	}
+
+	noises.erase(std::remove_if(noises.begin(), noises.end(), [](Noise * noise) { return !noise->IsBakeable(); }), noises.end());
+
+	unsigned int resolution = NoiseBake.Resolution;
+
+	while (resolution > Noise::BrickSize && noises.size() * Noise::GetBakeMemoryUsage(resolution) > NoiseBake.MemoryBudget)
+		resolution /= 2;
+
+	// Noises already baked at this resolution are kept
+	for (auto noise : noises)
+		noise->Bake(resolution);
 }
 
-re::Color re::SkyBox::GetColor(const Vector3 & direction) const
+void re::Scene::CompileMaterials(std::vector<Instance>& instances)
 {
-	
-	constexpr float thresold = 0.98f;
-	constexpr float border = (1.0f - thresold) / 2.0f;
-	constexpr float thresoldPlusBorder = thresold + border;
-
-	// Get the current sky color
-	//auto color = Lerp(m_SkyTop, m_SkyBottom, std::fmaxf(0, 1.0 - (direction ^ Vector3::Up)));
-	
-	real sample = m_Perlin->Sample((direction + Vector3::One) / 2);
-	auto color = Mix(m_SkyColor0, m_SkyColor1, sample);
+	std::unordered_map<Material*, const CompiledMaterial*> compiledMaterials;
+	MaterialCompiler compiler;
 
-	if (m_Sun != nullptr && m_Sun->Type == LightType::Directional)
+	for (auto& instance : instances)
 	{
-		float f = std::fmaxf(0, direction ^ m_Sun->Direction);
+		if (instance.Material == nullptr)
+			continue;
 
-		if (f < thresold)
-		{
-			return color;
-		}
-		else if (f < thresoldPlusBorder)
-		{
-			f = std::powf((f - thresold) / border, 2.0f);
-			return Mix(color, m_Sun->Color, f);
-		}
-		else
+		auto it = compiledMaterials.find(instance.Material);
+
+		if (it == compiledMaterials.end())
 		{
-			return m_Sun->Color;
+			CompiledMaterial * compiled = m_Arena.Allocate<CompiledMaterial>(1);
+
+			// Trees that are too large are evaluated with virtual calls
+			if (!compiler.Compile(*instance.Material, m_Arena, *compiled))
+				compiled = nullptr;
+
+			it = compiledMaterials.emplace(instance.Material, compiled).first;
 		}
 
+		instance.CompiledMaterial = it->second;
 	}
-	else
+}
+
+void re::Scene::BakeBackground()
+{
+	if (EnvironmentBake.Resolution == 0 || Background == nullptr || !Background->IsBakeable())
 	{
-		return color;
+		m_EnvironmentMap.Clear();
+		return;
 	}
-	
-
-
 
+	// A map baked from the same background at this resolution is kept
+	m_EnvironmentMap.Bake(Background, EnvironmentBake.Resolution);
 }
 
-re::Scene::Scene()
+re::Color re::Scene::GetBackgroundColor(const Vector3 & direction) const
 {
-	m_Root = std::make_shared<SceneNode>();
-}
+	if (Background == nullptr)
+		return Color::Black;
 
-void re::Scene::Compile()
-{
-	m_Root->Compile();
+	if (m_EnvironmentMap.IsBakedFrom(Background.get()))
+		return Background->AddAnalyticColor(direction, m_EnvironmentMap.Sample(direction));
+
+	return Background->GetColor(direction);
 }
 
-re::Scene::RaycastResult re::Scene::CastRay(const Ray & ray)
+std::vector<re::Noise*> re::Scene::GetNoises() const
 {
-	return CastRayRecursive(ray, m_Root.get());
+	std::vector<Noise*> noises;
+	std::unordered_set<const Material*> materials;
+
+	for (const auto& instance : m_Instances)
+	{
+		if (instance.Material != nullptr && materials.insert(instance.Material).second)
+			instance.Material->GetNoises(noises);
+	}
+
+	std::sort(noises.begin(), noises.end());
+	noises.erase(std::unique(noises.begin(), noises.end()), noises.end());
+
+	return noises;
 }
 
-re::Scene::RaycastResult re::Scene::CastRayRecursive(const Ray & ray, SceneNode * currentNode)
+template<typename T>
+uint32_t re::Scene::BuildTree(std::vector<T>& items, size_t begin, size_t end, std::vector<InstanceNode>& nodes)
 {
-	auto transform = currentNode->GetComponentOfType<Transform>();
-	auto shape = currentNode->GetComponentOfType<Shape>();
+	uint32_t index = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+
+	Vector3 min, max, centerMin, centerMax;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		min.Elements[axis] = centerMin.Elements[axis] = std::numeric_limits<real>::max();
+		max.Elements[axis] = centerMax.Elements[axis] = std::numeric_limits<real>::lowest();
+	}
 
-	assert(transform != nullptr);
+	for (size_t i = begin; i < end; i++)
+	{
+		const T& item = items[i];
 
-	RaycastResult raycastResult;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			real center = (item.Min.Elements[axis] + item.Max.Elements[axis]) / 2;
 
-	real hitDistance = std::numeric_limits<real>::max();
+			min.Elements[axis] = std::min(min.Elements[axis], item.Min.Elements[axis]);
+			max.Elements[axis] = std::max(max.Elements[axis], item.Max.Elements[axis]);
+			centerMin.Elements[axis] = std::min(centerMin.Elements[axis], center);
+			centerMax.Elements[axis] = std::max(centerMax.Elements[axis], center);
+		}
+	}
 
-	if (shape != nullptr) {
-		Ray transformedRay;
-		Matrix4 itmat;
+	nodes[index].Min = min;
+	nodes[index].Max = max;
 
-		transform->GetInverseTransform(itmat);
+	size_t count = end - begin;
 
-		transformedRay.Origin = itmat * Vector4(ray.Origin, 1);
-		transformedRay.Direction = Vector3(itmat * Vector4(ray.Direction, 0)).Normalized();
+	if (count <= MaxLeafInstances)
+	{
+		nodes[index].Index = static_cast<uint32_t>(begin);
+		nodes[index].Count = static_cast<uint16_t>(count);
+		return index;
+	}
 
-		RayHitResult result = shape->Intersect(transformedRay);
+	// Median split on the longest axis of the centers
+	Vector3 extent = centerMax - centerMin;
+	uint16_t axis = extent.X > extent.Y ? (extent.X > extent.Z ? 0 : 2) : (extent.Y > extent.Z ? 1 : 2);
+	size_t middle = begin + count / 2;
 
-		if (result.Hit)
-		{
-			Matrix4 tmat;
-			transform->GetTransform(tmat);
-			
-			// Calculate point in world coordinates
-			Vector3 worldPoint = tmat * Vector4(result.Point, 1);
+	std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end,
+		[axis](const T& a, const T& b) {
+			return a.Min.Elements[axis] + a.Max.Elements[axis] < b.Min.Elements[axis] + b.Max.Elements[axis];
+		});
 
-			real distance = (ray.Origin - worldPoint).SquaredLength();
+	BuildTree(items, begin, middle, nodes);
+	uint32_t right = BuildTree(items, middle, end, nodes);
 
-			if (distance >= std::numeric_limits<real>::epsilon())
-			{
-				Matrix4 tnorm;
-				transform->GetNormalTransform(tnorm);
-
-				raycastResult.Hit = true;
-				raycastResult.Point = worldPoint;
-				raycastResult.LocalPoint = result.Point;
-				raycastResult.Normal = Vector3(tnorm * Vector4(result.Normal, 0)).Normalized();
-				raycastResult.Node = currentNode;
-				hitDistance = distance;
-			}
-		}
+	nodes[index].Index = right;
+	nodes[index].Axis = axis;
+
+	return index;
+}
+
+void re::Scene::CompileInstances(SceneNode * currentNode, std::vector<Instance>& instances)
+{
+	Shape * shape = currentNode->GetComponentOfType<Shape>();
+
+	if (shape != nullptr)
+	{
+		Transform * transform = currentNode->GetTransform();
+
+		Matrix4 tmat, itmat;
+		transform->GetTransform(tmat);
+		transform->GetInverseTransform(itmat);
+
+		instances.emplace_back();
+
+		Instance& instance = instances.back();
+		instance.WorldFromObject = tmat;
+		instance.ObjectFromWorld = itmat;
+		instance.Shape = shape;
+		instance.Material = shape->Material;
+		instance.Node = currentNode;
+		instance.Type = GetShapeType(shape);
+
+		BoundingBox bounds;
+		instance.Bounded = shape->GetBounds(bounds);
 
+		if (instance.Bounded)
+			TransformBounds(instance.WorldFromObject, bounds, instance.Min, instance.Max);
 	}
 
+	for (auto& child : currentNode->GetChildren())
+	{
+		CompileInstances(child.get(), instances);
+	}
+}
+
+re::Scene::MemoryReport re::Scene::GetMemoryReport() const
+{
+	MemoryReport report;
+	std::unordered_set<const MeshAsset*> assets;
+
+	report.InstanceBytes += m_Nodes.GetSize() * sizeof(InstanceNode);
 
-	for (auto child : currentNode->GetChildren())
+	for (const auto& instance : m_Instances)
 	{
-		RaycastResult childResult = CastRayRecursive(ray, child.get());
+		report.InstanceCount++;
+		report.InstanceBytes += sizeof(Instance) + sizeof(SceneNode) + instance.Shape->GetMemoryUsage();
 
-		if (childResult.Hit)
+		auto mesh = dynamic_cast<const Mesh*>(instance.Shape);
+
+		if (mesh != nullptr && mesh->GetAsset() != nullptr && assets.insert(mesh->GetAsset().get()).second)
 		{
-			real distance = (ray.Origin - childResult.Point).SquaredLength();
+			report.SharedGeometryCount++;
+			report.SharedGeometryBytes += mesh->GetAsset()->GetMemoryUsage();
+		}
+	}
 
-			if (distance < hitDistance)
-			{
-				raycastResult = childResult;
-				hitDistance = distance;
-			}
+	std::unordered_set<const CompiledMaterial*> compiledMaterials;
 
+	for (const auto& instance : m_Instances)
+	{
+		if (instance.CompiledMaterial != nullptr && compiledMaterials.insert(instance.CompiledMaterial).second)
+		{
+			report.CompiledMaterialCount++;
+			report.CompiledMaterialBytes += instance.CompiledMaterial->GetMemoryUsage();
 		}
-		
 	}
 
-	return raycastResult;
+	for (auto noise : GetNoises())
+	{
+		if (!noise->IsBaked())
+			continue;
+
+		report.BakedNoiseCount++;
+		report.BakedNoiseBytes += noise->GetBakeReport().Bytes;
+		report.BakedNoiseMaxError = std::max(report.BakedNoiseMaxError, noise->GetBakeReport().MaxError);
+	}
+
+	report.EnvironmentMapBytes = m_EnvironmentMap.GetMemoryUsage();
+
+	return report;
+}
+
+re::Scene::RaycastResult re::Scene::CastRay(const Ray & ray) const
+{
+	Ray hitRay = ray;
+	hitRay.TMin = std::max(ray.TMin, MinHitDistance);
 
+	Hit hit;
+
+	if (!Intersect(hitRay, hit))
+		return RaycastResult();
+
+	return GetSurface(ray, hit);
+}
+
+re::Scene::RaycastResult re::Scene::GetSurface(const Ray & ray, const Hit & hit) const
+{
+	RaycastResult result;
+
+	if (!hit.IsHit())
+		return result;
+
+	const Instance& instance = m_Instances[hit.InstanceID];
+
+	Ray localRay;
+	localRay.Origin = instance.ObjectFromWorld.TransformPoint(ray.Origin);
+	localRay.Direction = instance.ObjectFromWorld.TransformVector(ray.Direction);
+
+	result.Hit = true;
+	result.Point = ray.Origin + ray.Direction * hit.T;
+	result.LocalPoint = localRay.Origin + localRay.Direction * hit.T;
+	result.Normal = instance.ObjectFromWorld.TransformNormal(instance.Shape->GetNormal(localRay, hit)).Normalized();
+	result.Node = instance.Node;
+	result.Material = instance.Material;
+	result.CompiledMaterial = instance.CompiledMaterial;
+	result.ObjectFromWorld = &instance.ObjectFromWorld;
+	result.HasTexCoord = instance.Shape->GetTexCoord(hit, result.TexCoord, result.TexCoordGradientU, result.TexCoordGradientV);
+
+	return result;
 }
 
 void re::Transform::Compile()
 {
-	SceneNode* parent = m_Owner->GetParent();
+	// Build the local transform (T * R * S) and its inverse (S^-1 * R^T * T^-1) directly,
+	// without going through full matrix products
+	Matrix4 r = Matrix4::GetRotation(Rotation);
+	Vector3 inverseScale = Vector3::One / Scale;
 
-	Matrix4 prev = Matrix4::Identity, prevInverse = Matrix4::Identity;
+	Matrix4 local = Matrix4::Identity, localInverse = Matrix4::Identity;
 
-	if (parent != nullptr)
+	for (int i = 0; i < 3; i++)
 	{
-		auto parentTransform = parent->GetComponentOfType<Transform>();
-		parentTransform->GetTransform(prev);
-		parentTransform->GetInverseTransform(prevInverse);
-	}
+		for (int j = 0; j < 3; j++)
+		{
+			local[i * 4 + j] = r[i * 4 + j] * Scale.Elements[j];
+			localInverse[i * 4 + j] = inverseScale.Elements[i] * r[j * 4 + i];
+		}
 
+		local[i * 4 + 3] = Position.Elements[i];
+		localInverse[i * 4 + 3] =
+			localInverse[i * 4 + 0] * -Position.X +
+			localInverse[i * 4 + 1] * -Position.Y +
+			localInverse[i * 4 + 2] * -Position.Z;
+	}
 
-	auto t = Matrix4::GetTranslation(Position);
-	auto r = Matrix4::GetRotation(Rotation);
-	auto s = Matrix4::GetScale(Scale);
+	SceneNode* parent = m_Owner->GetParent();
 
-	auto it = Matrix4::GetTranslation(Vector3::Zero - Position);
-	auto ir = r.Transpose();
-	auto is = Matrix4::GetScale(Vector3::One / Scale);
+	if (parent != nullptr)
+	{
+		Transform * parentTransform = parent->GetTransform();
+		m_Transform = parentTransform->m_Transform * local;
+		m_InverseTransform = localInverse * parentTransform->m_InverseTransform;
+	}
+	else
+	{
+		m_Transform = local;
+		m_InverseTransform = localInverse;
+	}
 
-	m_Transform = prev * t * r * s;
-	m_InverseTransform = is * ir * it * prevInverse;
 	m_NormalTransform = m_InverseTransform.Transpose();
 }
 
-re::SceneNode::SceneNode()
+re::SceneNode::SceneNode() :
+	m_Transform(this)
 {
-	AddComponent<re::Transform>();
 }
 
 std::shared_ptr<re::SceneNode>  re::SceneNode::AddChild()
@@ -279,18 +572,182 @@ std::shared_ptr<re::SceneNode>  re::SceneNode::AddChild()
 void re::SceneNode::Compile()
 {
 
-	for (auto component : m_Components)
+	m_Transform.Compile();
+
+	for (auto& component : m_Components)
 	{
-		component->Compile();
-	};
+		if (component)
+			component->Compile();
+	}
 
-	for (auto child : m_Children)
+	for (auto& child : m_Children)
 	{
 		child->Compile();
 	}
 
 }
 
+template<bool AnyHit>
+bool re::Scene::Traverse(const Ray & ray, Hit & hit) const
+{
+	Ray transformedRay;
+	transformedRay.TMin = ray.TMin;
+	transformedRay.TMax = ray.TMax;
+
+	// Returns true if the traversal can stop
+	auto intersectInstance = [&](size_t index) -> bool {
+
+		const auto& instance = m_Instances[index];
+
+		// The direction isn't normalized, so t is the same in local and world space
+		transformedRay.Origin = instance.ObjectFromWorld.TransformPoint(ray.Origin);
+		transformedRay.Direction = instance.ObjectFromWorld.TransformVector(ray.Direction);
+
+		if (!IntersectInstance<AnyHit>(instance, transformedRay, hit))
+			return false;
+
+		hit.InstanceID = static_cast<uint32_t>(index);
+		transformedRay.TMax = hit.T;
+
+		return AnyHit;
+	};
+
+	// Unbounded instances first: they are often floors and walls, which shorten the ray for the tree
+	for (size_t i = 0; i < m_UnboundedCount; i++)
+	{
+		if (intersectInstance(i))
+			return true;
+	}
+
+	if (m_Nodes.IsEmpty())
+		return hit.IsHit();
+
+	Vector3 invDirection = Vector3::One / ray.Direction;
+
+	uint32_t stack[TraversalStackSize];
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		uint32_t index = stack[--stackSize];
+		const InstanceNode& node = m_Nodes[index];
+
+		if (!IntersectBounds(node.Min, node.Max, ray, invDirection, ray.TMin, transformedRay.TMax))
+			continue;
+
+		if (node.Count > 0)
+		{
+			for (size_t i = node.Index; i < node.Index + node.Count; i++)
+			{
+				const auto& instance = m_Instances[i];
+
+				if (!IntersectBounds(instance.Min, instance.Max, ray, invDirection, ray.TMin, transformedRay.TMax))
+					continue;
+
+				if (intersectInstance(i))
+					return true;
+			}
+		}
+		else
+		{
+			// Visit the child on the side of the ray origin first
+			uint32_t nearChild = index + 1, farChild = node.Index;
+
+			if (ray.Direction.Elements[node.Axis] < 0)
+				std::swap(nearChild, farChild);
+
+			assert(stackSize + 2 <= TraversalStackSize);
+			stack[stackSize++] = farChild;
+			stack[stackSize++] = nearChild;
+		}
+	}
+
+	return hit.IsHit();
+}
+
+void re::Scene::GetLights(const Vector3 & point, std::vector<uint32_t>& lights) const
+{
+	lights.assign(m_UnboundedLights.begin(), m_UnboundedLights.end());
+
+	if (m_LightNodes.IsEmpty())
+		return;
+
+	auto contains = [&](const Vector3& min, const Vector3& max) -> bool {
+		return point.X >= min.X && point.Y >= min.Y && point.Z >= min.Z &&
+			point.X <= max.X && point.Y <= max.Y && point.Z <= max.Z;
+	};
+
+	uint32_t stack[TraversalStackSize];
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		uint32_t index = stack[--stackSize];
+		const InstanceNode& node = m_LightNodes[index];
+
+		if (!contains(node.Min, node.Max))
+			continue;
+
+		if (node.Count > 0)
+		{
+			for (size_t i = node.Index; i < node.Index + node.Count; i++)
+			{
+				const PointLight& light = m_PointLights[i];
+
+				if ((point - light.Position).SquaredLength() < light.SquaredRadius)
+					lights.push_back(light.Index);
+			}
+		}
+		else
+		{
+			assert(stackSize + 2 <= TraversalStackSize);
+			stack[stackSize++] = node.Index;
+			stack[stackSize++] = index + 1;
+		}
+	}
+
+	// The tree reorders the point lights
+	std::sort(lights.begin(), lights.end());
+}
+
+bool re::Scene::Intersect(const Ray & ray, Hit & hit) const
+{
+	hit = Hit();
+	return Traverse<false>(ray, hit);
+}
+
+bool re::Scene::Occluded(const Ray & ray) const
+{
+	Hit hit;
+	return Traverse<true>(ray, hit);
+}
+
+void re::Scene::Intersect(Span<const Ray> rays, Span<Hit> hits) const
+{
+	constexpr size_t GrainSize = 256;
+
+	assert(rays.GetSize() == hits.GetSize());
+
+	ThreadPool::GetDefault().ParallelFor(rays.GetSize(), GrainSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			Intersect(rays[i], hits[i]);
+	});
+}
+
+void re::Scene::Occluded(Span<const Ray> rays, Span<bool> occluded) const
+{
+	constexpr size_t GrainSize = 256;
+
+	assert(rays.GetSize() == occluded.GetSize());
+
+	ThreadPool::GetDefault().ParallelFor(rays.GetSize(), GrainSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			occluded[i] = Occluded(rays[i]);
+	});
+}
+
 re::RayHitResult re::Sphere::Intersect(const Ray & ray)
 {
 	RayHitResult result;
@@ -329,195 +786,210 @@ re::RayHitResult re::Sphere::Intersect(const Ray & ray)
 	return result;
 }
 
-re::RayHitResult re::Plane::Intersect(const Ray & ray)
+bool re::Sphere::Intersect(const Ray & ray, Hit & hit)
 {
-	RayHitResult result;
+	// Unit sphere: solve |o + t * d|^2 = 1
+	real a = Dot(ray.Direction, ray.Direction);
+	real b = Dot(ray.Origin, ray.Direction);
+	real c = Dot(ray.Origin, ray.Origin) - 1;
+	real discriminant = b * b - a * c;
 
-	real distance = ray.Origin ^ Normal;
+	if (discriminant < 0)
+		return false;
 
-	// We also check if we're facing the plane or not
-	// If not facing, we cull the plane
-	if (distance < 0)
-	{
-		// Negative distance means that the ray origin is
-		// "below" the plane, so we'are not facing it
-		return result;
-	}
+	real offset = std::sqrt(discriminant);
+	real t = (-b - offset) / a;
 
-	real cosine = Normal ^ ray.Direction;
+	// If the closest intersection is out of range, the ray might start inside the sphere
+	if (t < ray.TMin)
+		t = (-b + offset) / a;
 
-	if (cosine >= 0)
-	{
-		// a positive cosine means that the ray will never intersect
-		// the plane
-		return result;
-	}
+	if (t < ray.TMin || t > ray.TMax)
+		return false;
 
-	// The plane has been hit
-	result.Hit = true;
-	result.Point = ray.Origin + ray.Direction * (distance / -cosine);
-	result.Normal = Normal;
+	hit.T = t;
+	hit.PrimitiveID = 0;
+	hit.U = hit.V = 0;
 
-	return result;
+	return true;
 }
 
-
-re::Shape::Shape(SceneNode * owner) : Component(owner)
+bool re::Sphere::Occluded(const Ray & ray)
 {
-	static unsigned int nextID = 1;
-	m_ID = nextID;
-	nextID = std::max(1u, nextID + 1);
+	Hit hit;
+	return Sphere::Intersect(ray, hit);
 }
 
-re::RayHitResult re::Mesh::Intersect(const Ray & ray)
-{	
-	RayHitResult result;
-	real distance = std::numeric_limits<real>::max();
-	IntersectInternal(ray, m_KdTree, result, distance);
-	return result;	
+bool re::Sphere::GetBounds(BoundingBox & bounds)
+{
+	bounds = BoundingBox(-Vector3::One, Vector3::One);
+	return true;
 }
 
-re::Triangle& re::Mesh::AddTriangle()
+re::Vector3 re::Sphere::GetNormal(const Ray & ray, const Hit & hit)
 {
-	m_Triangles.push_back({});
-	return m_Triangles.back();
+	return ray.Origin + ray.Direction * hit.T;
 }
 
-void re::Mesh::Compile()
+void re::Plane::GetTangents(Vector3 & tangent, Vector3 & bitangent) const
 {
-	if (m_Invalidated)
-	{
+	Vector3 normal = Normal.Normalized();
 
-		auto& min = m_BoundingBox.Min;
-		auto& max = m_BoundingBox.Max;
+	// Projection of the X axis on the plane, or of the Z axis if the normal is close to X
+	Vector3 axis = std::abs(normal.X) < 0.9 ? Vector3::Right : Vector3::Forward;
 
-		for (auto &t : m_Triangles) {
-			t.Update();
+	tangent = (axis - normal * Dot(axis, normal)).Normalized();
+	bitangent = Cross(normal, tangent);
+}
 
-			for (auto &v : t.Vertices)
-			{
-				min.X = std::min(min.X, v.X);
-				min.Y = std::min(min.Y, v.Y);
-				min.Z = std::min(min.Z, v.Z);
+bool re::Plane::GetBounds(BoundingBox & bounds)
+{
+	if (IsInfinite())
+		return false;
 
-				max.X = std::max(max.X, v.X);
-				max.Y = std::max(max.Y, v.Y);
-				max.Z = std::max(max.Z, v.Z);
-			}
+	Vector3 tangent, bitangent;
+	GetTangents(tangent, bitangent);
 
-		}
+	Vector3 extent;
 
-		m_KdTree = new KDTreeTriangle(m_Triangles, m_BoundingBox, 0);
+	for (int i = 0; i < 3; i++)
+		extent.Elements[i] = std::abs(tangent.Elements[i]) * Extent.X + std::abs(bitangent.Elements[i]) * Extent.Y;
 
-		m_Invalidated = false;
-	}
+	bounds = BoundingBox(-extent, extent);
+	return true;
 }
 
-void re::Mesh::Invalidate()
+void re::Plane::Compile()
 {
-	m_Invalidated = true;
+	GetTangents(m_Tangent, m_Bitangent);
 }
 
-re::RayHitResult re::Mesh::IntersectTriangle(const Ray & ray, const Triangle & t) const
+bool re::Plane::InsideExtent(const Vector3 & point) const
+{
+	return IsInfinite() || (std::abs(Dot(point, m_Tangent)) <= Extent.X && std::abs(Dot(point, m_Bitangent)) <= Extent.Y);
+}
+
+re::RayHitResult re::Plane::Intersect(const Ray & ray)
 {
 	RayHitResult result;
-	//Vector3 t0 = (Vertices[1] - Vertices[0]).Normalized();
-	//Vector3 t1 = (Vertices[2] - Vertices[0]).Normalized();
 
-	Vector3 l = ray.Origin - t.Vertices[0];
-	real distance = l ^ t.FaceNormal;
+	real distance = ray.Origin ^ Normal;
 
+	// We also check if we're facing the plane or not
+	// If not facing, we cull the plane
 	if (distance < 0)
 	{
-		// Ray origin "behind" the triangle plane
+		// Negative distance means that the ray origin is
+		// "below" the plane, so we'are not facing it
 		return result;
 	}
 
-	real cosine = ray.Direction ^ t.FaceNormal;
+	real cosine = Normal ^ ray.Direction;
 
-	// Check if the ray is never intersecting the triangle plane
 	if (cosine >= 0)
 	{
+		// a positive cosine means that the ray will never intersect
+		// the plane
 		return result;
 	}
 
+	Vector3 point = ray.Origin + ray.Direction * (distance / -cosine);
 
-	// Project the ray on the triangle plane 
-	Vector3 projection = ray.Origin + ray.Direction * (distance / -cosine);
-
-	// Use baricentric coordinates to check if the ray projection
-	// is contained in the triangle
-	Vector3 bar = t.Baricentric(projection);
+	if (!InsideExtent(point))
+		return result;
 
-	if (bar.X >= 0 && bar.Y >= 0 && bar.Z >= 0)
-	{
-		result.Hit = true;
-		result.Point = projection;
-		if (NormalMode == NormalModes::Face)
-		{
-			result.Normal = t.FaceNormal;
-		}
-		else
-		{
-			result.Normal = (t.Normals[0] * bar.X + t.Normals[1] * bar.Y + t.Normals[2] * bar.Z).Normalized();
-		}
-	}
+	// The plane has been hit
+	result.Hit = true;
+	result.Point = point;
+	result.Normal = Normal;
 
 	return result;
 }
 
-void re::Mesh::IntersectInternal(const Ray& ray, KDTreeTriangle * node, RayHitResult & result, real & distance) const
+
+bool re::Plane::Intersect(const Ray & ray, Hit & hit)
 {
+	// Same culling as above
+	real distance = Dot(ray.Origin, Normal);
 
-	if (node->Bounds.Intersect(ray).Hit)
-	{
-		for (auto & t : node->Triangles)
-		{
-			auto r = IntersectTriangle(ray, t);
-			auto d = (ray.Origin - r.Point).SquaredLength();
+	if (distance < 0)
+		return false;
 
-			if (d < distance && r.Hit)
-			{
-				result = r;
-				distance = d;
-			}
-		}
+	real cosine = Dot(Normal, ray.Direction);
 
-		if (node->Left)
-			IntersectInternal(ray, node->Left, result, distance);
+	if (cosine >= 0)
+		return false;
 
-		if (node->Right)
-			IntersectInternal(ray, node->Right, result, distance);
+	real t = distance / -cosine;
 
-	}
+	if (t < ray.TMin || t > ray.TMax)
+		return false;
+
+	if (!InsideExtent({ ray.Origin.X + ray.Direction.X * t, ray.Origin.Y + ray.Direction.Y * t, ray.Origin.Z + ray.Direction.Z * t }))
+		return false;
+
+	hit.T = t;
+	hit.PrimitiveID = 0;
+	hit.U = hit.V = 0;
+
+	return true;
 }
 
-re::Vector3 re::Triangle::Baricentric(const Vector3 & point) const
+bool re::Plane::Occluded(const Ray & ray)
 {
-	// Fast baricentric coordinates:
-	// https://gamedev.stackexchange.com/questions/23743/whats-the-most-efficient-way-to-find-barycentric-coordinates
-	real v, w, u;
-	Vector3 v2 = point - Vertices[0];
-	real d20 = v2 ^ Edges[0];
-	real d21 = v2 ^ Edges[1];
-	v = (m_D11 * d20 - m_D01 * d21) * m_InvDen;
-	w = (m_D00 * d21 - m_D01 * d20) * m_InvDen;
-	u = 1.0f - v - w;
-	return { u, v, w };
+	Hit hit;
+	return Plane::Intersect(ray, hit);
 }
 
-void re::Triangle::Update()
+re::Vector3 re::Plane::GetNormal(const Ray & ray, const Hit & hit)
 {
-	const_cast<Vector3&>(FaceNormal) = Cross(Vertices[1] - Vertices[0], Vertices[2] - Vertices[1]).Normalized();
-	const_cast<std::array<Vector3, 3>&>(Edges) = {
-		Vertices[1] - Vertices[0],
-		Vertices[2] - Vertices[0],
-		Vertices[2] - Vertices[1]
-	};
+	return Normal;
+}
+
+bool re::Shape::Intersect(const Ray & ray, Hit & hit)
+{
+	// Fallback on the normalized ray query
+	real length = ray.Direction.Length();
+
+	Ray normalizedRay;
+	normalizedRay.Origin = ray.Origin;
+	normalizedRay.Direction = ray.Direction / length;
+
+	RayHitResult result = Intersect(normalizedRay);
 
-	m_D00 = Edges[0] ^ Edges[0];
-	m_D01 = Edges[0] ^ Edges[1];
-	m_D11 = Edges[1] ^ Edges[1];
+	if (!result.Hit)
+		return false;
 
-	m_InvDen = 1.0 / (m_D00 * m_D11 - m_D01 * m_D01);
+	real t = (result.Point - ray.Origin).Length() / length;
+
+	if (t < ray.TMin || t > ray.TMax)
+		return false;
+
+	hit.T = t;
+	hit.PrimitiveID = 0;
+	hit.U = hit.V = 0;
+
+	return true;
+}
+
+bool re::Shape::Occluded(const Ray & ray)
+{
+	Hit hit;
+	return Intersect(ray, hit);
+}
+
+re::Vector3 re::Shape::GetNormal(const Ray & ray, const Hit & hit)
+{
+	Ray normalizedRay;
+	normalizedRay.Origin = ray.Origin;
+	normalizedRay.Direction = ray.Direction.Normalized();
+
+	return Intersect(normalizedRay).Normal;
+}
+
+re::Shape::Shape(SceneNode * owner) : Component(owner)
+{
+	static unsigned int nextID = 1;
+	m_ID = nextID;
+	nextID = std::max(1u, nextID + 1);
 }
@@ -1,21 +1,23 @@
 #pragma once
 #include "Common.h"
+#include "Arena.h"
 #include "Material.h"
+#include "EnvironmentMap.h"
 #include "noise/Perlin.h"
 #include <vector>
 #include <future>
 #include <array>
+#include <memory>
+#include <type_traits>
 
 namespace re
 {
-	class KDTreeTriangle;
 	class Shape;
 	class Scene;
 	class SceneNode;
 
 	/// Light types
 	enum class LightType { Directional, Ambient, Point };
-	enum class NormalModes { Face, Vertex };
 
 	/// Class representing a light
 	class Light
@@ -37,7 +39,15 @@ namespace re
 	class Background
 	{
 	public:
+		virtual ~Background() {}
 		virtual Color GetColor(const Vector3& direction) const = 0;
+
+		/// Backgrounds that return true are baked in an environment map by Scene::Compile (see
+		/// Scene::EnvironmentBake). The map stores GetBakedColor, then AddAnalyticColor turns the
+		/// interpolated value into the final color, so that small details like a sun stay sharp
+		virtual bool IsBakeable() const { return false; }
+		virtual Color GetBakedColor(const Vector3& direction) const { return GetColor(direction); }
+		virtual Color AddAnalyticColor(const Vector3& direction, const Color& bakedColor) const { return bakedColor; }
 	};
 
 	class ColorBackground : public Background {
@@ -55,6 +65,11 @@ namespace re
 
 		virtual Color GetColor(const Vector3& direction) const override;
 
+		/// The sky is baked, the sun is added after
+		virtual bool IsBakeable() const override { return true; }
+		virtual Color GetBakedColor(const Vector3& direction) const override;
+		virtual Color AddAnalyticColor(const Vector3& direction, const Color& bakedColor) const override;
+
 		float SunFactor = 128.0f;
 
 	private:
@@ -68,6 +83,7 @@ namespace re
 	{
 	public:
 
+		/// Surface at the closest hit of a ray, see CastRay and GetSurface
 		struct RaycastResult
 		{
 			bool Hit = false;
@@ -75,6 +91,41 @@ namespace re
 			Vector3 LocalPoint = Vector3::Zero;
 			Vector3 Normal = Vector3::Zero;
 			SceneNode * Node = nullptr;
+			re::Material * Material = nullptr;
+
+			/// Material compiled by Scene::Compile, null if it couldn't be compiled
+			const re::CompiledMaterial * CompiledMaterial = nullptr;
+
+			/// Transform of the hit instance, valid as long as the scene isn't compiled again
+			const AffineTransform * ObjectFromWorld = nullptr;
+
+			/// Texture coordinates and their gradients in local coordinates, see Shape::GetTexCoord
+			bool HasTexCoord = false;
+			Vector2 TexCoord = Vector2::Zero;
+			Vector3 TexCoordGradientU = Vector3::Zero, TexCoordGradientV = Vector3::Zero;
+		};
+
+		/// Shape types whose intersection tests are called without virtual dispatch. Any other
+		/// shape, subclasses of these included, is Other
+		enum class ShapeTypes { Sphere, Plane, Box, Cylinder, Disk, Torus, Mesh, Other };
+		static constexpr size_t ShapeTypeCount = 8;
+
+		/// A shape instance of the compiled scene. Scene::Compile flattens the scene graph
+		/// into an array of instances, so that rays don't have to walk the graph. Unbounded
+		/// instances come first, then the bounded ones in the order of the instance tree
+		struct Instance
+		{
+			AffineTransform WorldFromObject, ObjectFromWorld;
+			re::Shape * Shape = nullptr;
+			re::Material * Material = nullptr;
+			const re::CompiledMaterial * CompiledMaterial = nullptr;
+			SceneNode * Node = nullptr;
+			ShapeTypes Type = ShapeTypes::Other;
+
+			// Bounds in world space, tested before transforming the ray. Unbounded shapes are always tested,
+			// the others are stored in the instance tree
+			Vector3 Min, Max;
+			bool Bounded = false;
 		};
 
 		struct
@@ -87,24 +138,148 @@ namespace re
 		std::vector<std::shared_ptr<Light>> Lights;
 		std::shared_ptr<Background> Background = nullptr;
 
+		/// Baking of the noises used by the materials, done by Compile when the resolution isn't 0
+		/// (see Noise::Bake). The resolution is halved until all the noises fit in the memory budget
+		struct
+		{
+			unsigned int Resolution = 0;
+			size_t MemoryBudget = 64 * 1024 * 1024;
+		} NoiseBake;
+
+		/// Baking of the background, done by Compile when the resolution isn't 0 and the background
+		/// is bakeable. The map has resolution^2 texels (see EnvironmentMap)
+		struct
+		{
+			unsigned int Resolution = 0;
+		} EnvironmentBake;
+
 		Scene();
 
 		void Compile();
 
 		std::shared_ptr<SceneNode>  GetRoot() { return m_Root; }
 
-		RaycastResult CastRay(const Ray &ray);
+		/// Color of the background in the direction, from the environment map when it is baked.
+		/// Black without a background
+		Color GetBackgroundColor(const Vector3& direction) const;
+
+		/// Minimum distance of the hits found by CastRay, so that secondary rays don't hit the
+		/// surface they start from
+		static constexpr real MinHitDistance = 1.5e-8;
+
+		/// Finds the closest hit of the ray in [max(TMin, MinHitDistance), TMax] and evaluates its surface.
+		/// The direction of the ray must be normalized
+		RaycastResult CastRay(const Ray &ray) const;
+
+		/// Evaluates the surface at a hit found by Intersect: world and local point, shading normal
+		/// and material. Traversal only tracks the hit record, so this is done once per ray
+		RaycastResult GetSurface(const Ray& ray, const Hit& hit) const;
+
+		/// Hit queries. Rays are in world space, their direction doesn't need to be normalized and
+		/// only hits with t in [TMin, TMax] are reported. InstanceID is the index in GetInstances().
+		/// The scene must be compiled
+		bool Intersect(const Ray& ray, Hit& hit) const;
+		bool Occluded(const Ray& ray) const;
+
+		/// Indices in Lights of the lights that can light the point, in increasing order: the enabled
+		/// directional and ambient lights, and the enabled point lights whose attenuation radius contains
+		/// the point. Point lights are found through a tree built by Compile. The scene must be compiled
+		void GetLights(const Vector3& point, std::vector<uint32_t>& lights) const;
+
+		/// Batch versions of the hit queries, run in parallel on the default thread pool.
+		/// The output must have the same size as the input
+		void Intersect(Span<const Ray> rays, Span<Hit> hits) const;
+		void Occluded(Span<const Ray> rays, Span<bool> occluded) const;
+
+		/// Memory used by the compiled scene. Geometry shared between instances is counted once
+		struct MemoryReport
+		{
+			size_t InstanceCount = 0;
+			size_t InstanceBytes = 0; /// Nodes, shapes and compiled instances
+			size_t SharedGeometryCount = 0;
+			size_t SharedGeometryBytes = 0;
+			size_t CompiledMaterialCount = 0;
+			size_t CompiledMaterialBytes = 0;
+			size_t BakedNoiseCount = 0;
+			size_t BakedNoiseBytes = 0;
+			real BakedNoiseMaxError = 0; /// Largest error of the baked noises, see Noise::BakeReport
+			size_t EnvironmentMapBytes = 0;
+		};
+
+		Span<const Instance> GetInstances() const { return { m_Instances.GetData(), m_Instances.GetSize() }; }
+
+		/// Number of instances without bounds, which are tested by every ray
+		size_t GetUnboundedInstanceCount() const { return m_UnboundedCount; }
+
+		MemoryReport GetMemoryReport() const;
 
 	private:
 
-		RaycastResult CastRayRecursive(const Ray& ray, SceneNode * currentNode);
+		/// Node of the BVH of the bounded instances, stored in depth-first order: the left child
+		/// of an interior node is the next node. The light tree uses the same nodes
+		struct InstanceNode
+		{
+			Vector3 Min, Max;
+
+			// Leaves: first instance and number of instances
+			// Interior nodes: right child, Count is 0 and Axis is the split axis
+			uint32_t Index;
+			uint16_t Count, Axis;
+		};
+
+		static constexpr size_t MaxLeafInstances = 4;
+
+		/// Point light of the light tree, bounded by its attenuation radius
+		struct PointLight
+		{
+			Vector3 Min, Max;
+			Vector3 Position;
+			real SquaredRadius;
+			uint32_t Index; /// In Lights
+		};
+
+		void CompileInstances(SceneNode * currentNode, std::vector<Instance>& instances);
+
+		/// Compiles every material of the instances once, in the arena
+		void CompileMaterials(std::vector<Instance>& instances);
+		void CompileLights();
+		void BakeNoises();
+		void BakeBackground();
+
+		/// Noises of the materials of the instances, without duplicates
+		std::vector<Noise*> GetNoises() const;
+
+		/// Builds the tree of the items in [begin, end), which are reordered. Items have Min and Max bounds
+		template<typename T>
+		static uint32_t BuildTree(std::vector<T>& items, size_t begin, size_t end, std::vector<InstanceNode>& nodes);
+
+		template<bool AnyHit>
+		bool Traverse(const Ray& ray, Hit& hit) const;
 
 		std::shared_ptr<SceneNode>  m_Root;
+
+		// Compiled data, released all at once when the scene is compiled again
+		Arena m_Arena;
+		Span<Instance> m_Instances;
+		Span<InstanceNode> m_Nodes;
+		size_t m_UnboundedCount = 0;
+
+		Span<uint32_t> m_UnboundedLights;
+		Span<PointLight> m_PointLights;
+		Span<InstanceNode> m_LightNodes;
+
+		EnvironmentMap m_EnvironmentMap;
 	};
 
+	/// Compile time identifier of a component family. Every family base class declares its
+	/// own TypeID and ComponentFamily, and a node holds at most one component per family
+	using ComponentTypeID = unsigned int;
+	constexpr ComponentTypeID MaxComponentTypes = 8;
+
 	class Component {
 	public:
 		Component(SceneNode* owner) { m_Owner = owner; }
+		virtual ~Component() {}
 		virtual void Compile() = 0;
 	protected:
 		SceneNode * m_Owner;
@@ -113,6 +288,8 @@ namespace re
 	class Transform : public Component
 	{
 	public:
+		static constexpr ComponentTypeID TypeID = 0;
+		using ComponentFamily = Transform;
 
 		Transform(SceneNode* owner) : Component(owner) {}
 
@@ -130,14 +307,42 @@ namespace re
 	class Shape : public Component
 	{
 	public:
+		static constexpr ComponentTypeID TypeID = 1;
+		using ComponentFamily = Shape;
+
 		Shape(SceneNode * owner);
 		
 		re::Material * Material = (re::Material*)&(UniformMaterial::OpaqueWhite);
 
 		unsigned int GetID() { return m_ID; }
 
+		/// Returns the number of bytes owned by this shape, excluding shared data
+		virtual size_t GetMemoryUsage() const { return sizeof(Shape); }
+
 		virtual void Compile() override {}
+
+		/// Returns the bounds of the shape in local coordinates, or false if the shape is unbounded.
+		/// The scene skips the shape for the rays that miss its bounds
+		virtual bool GetBounds(BoundingBox& bounds) { return false; }
+
 		virtual RayHitResult Intersect(const Ray& ray) = 0;
+
+		/// Hit query: finds the closest intersection with t in [ray.TMin, ray.TMax]. The ray is in local
+		/// coordinates and its direction isn't normalized, so t is the same as in world space. On hit
+		/// fills T, PrimitiveID, U and V and returns true. The default implementation uses Intersect(ray)
+		virtual bool Intersect(const Ray& ray, Hit& hit);
+
+		/// Returns true if the ray hits the shape with t in [ray.TMin, ray.TMax]
+		virtual bool Occluded(const Ray& ray);
+
+		/// Returns the normal in local coordinates at a hit found by Intersect(ray, hit), not necessarily
+		/// normalized. The default implementation uses Intersect(ray)
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit);
+
+		/// Texture coordinates at a hit found by Intersect(ray, hit), and their gradients in local
+		/// coordinates, from which the renderer computes the footprint of the textures. Returns false
+		/// if the shape has no texture coordinates, which is the default
+		virtual bool GetTexCoord(const Hit& hit, Vector2& texCoord, Vector3& gradientU, Vector3& gradientV) { return false; }
 	protected:
 		unsigned int m_ID;
 	};
@@ -149,69 +354,48 @@ namespace re
 
 		Sphere(SceneNode * owner) : Shape(owner) {}
 
+		virtual size_t GetMemoryUsage() const override { return sizeof(Sphere); }
+		virtual bool GetBounds(BoundingBox& bounds) override;
+
 		virtual RayHitResult Intersect(const Ray& ray) override; // Ray is in local coordinates
+		virtual bool Intersect(const Ray& ray, Hit& hit) override;
+		virtual bool Occluded(const Ray& ray) override;
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit) override;
 	};
 
 
+	/// Plane through the origin, only visible from the side of its normal. The plane is infinite
+	/// unless it has an extent, then it is a rectangle and it has bounds
 	class Plane : public Shape
 	{
 	public:
 		Vector3 Normal = Vector3::Up;
 
-		Plane(SceneNode * owner) : Shape(owner) {}
-
-		virtual RayHitResult Intersect(const Ray& ray) override;
-
-	};
-
-	struct Triangle
-	{
-	public:
-
-		Triangle() {}
-
-		std::array<Vector3, 3> Vertices, Normals;
-
-		Vector3 FaceNormal;
-		std::array<Vector3, 3> Edges;
-
+		/// Half size of the rectangle along the tangents of the plane, see GetTangents. Zero is infinite
+		Vector2 Extent = Vector2::Zero;
 
-		Vector3 Baricentric(const Vector3& point) const;
+		Plane(SceneNode * owner) : Shape(owner) {}
 
-		void Update();
-	private:
-		real m_D00, m_D01, m_D11;
-		real m_InvDen;
+		bool IsInfinite() const { return Extent.X <= 0 || Extent.Y <= 0; }
 
-	};
+		/// Orthonormal axes of the rectangle. For a plane facing up they are the X and the -Z axis,
+		/// for a plane facing Z they are the X and the Y axis
+		void GetTangents(Vector3& tangent, Vector3& bitangent) const;
 
-	class Mesh : public Shape
-	{
-	public:
+		virtual size_t GetMemoryUsage() const override { return sizeof(Plane); }
+		virtual bool GetBounds(BoundingBox& bounds) override;
 
-		NormalModes NormalMode = NormalModes::Face;
+		virtual void Compile() override;
 
-		Mesh(SceneNode * owner) : Shape(owner) { }
 		virtual RayHitResult Intersect(const Ray& ray) override;
-		
-		Triangle& AddTriangle();
-
-		void Compile() override;
-
-		void Invalidate();
+		virtual bool Intersect(const Ray& ray, Hit& hit) override;
+		virtual bool Occluded(const Ray& ray) override;
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit) override;
 
 	private:
+		bool InsideExtent(const Vector3& point) const;
 
-		bool m_Invalidated = true;
-
-		RayHitResult IntersectTriangle(const Ray& ray, const Triangle& triangle) const;
-		void IntersectInternal(const Ray& ray, KDTreeTriangle * node, RayHitResult & result, real & distance) const;
-
-
-		KDTreeTriangle* m_KdTree = nullptr;
-
-		std::vector<Triangle> m_Triangles;
-		re::BoundingBox m_BoundingBox;
+		Vector3 m_Tangent = { 1, 0, 0 }, m_Bitangent = { 0, 0, -1 };
 	};
 
 	class SceneNode
@@ -224,45 +408,47 @@ namespace re
 		std::shared_ptr<SceneNode>  AddChild();
 		SceneNode*  GetParent() const { return m_Parent; }
 
-		template<typename T> std::shared_ptr<T> AddComponent()
+		/// Adds a component to this node, replacing the existing component of the same family.
+		/// The returned pointer stays valid as long as the node owns the component
+		template<typename T> T* AddComponent()
 		{
-			auto c = std::shared_ptr<Component>(new T(this));
-			m_Components.push_back(c);
-			return std::dynamic_pointer_cast<T, Component>(c);
+			static_assert(T::TypeID != Transform::TypeID, "Every node already owns a transform");
+			static_assert(T::TypeID < MaxComponentTypes, "Invalid component type ID");
+
+			T* component = new T(this);
+			m_Components[T::TypeID].reset(component);
+			return component;
 		}
 
-		template<typename T> std::shared_ptr<T> GetComponentOfType() 
+		template<typename T> T* GetComponentOfType()
 		{
-			for (auto component : m_Components)
+			static_assert(T::TypeID < MaxComponentTypes, "Invalid component type ID");
+
+			if constexpr (std::is_same_v<T, Transform>)
 			{
-				std::shared_ptr<T> ccast = std::dynamic_pointer_cast<T, Component>(component);
-				if (ccast != nullptr)
-				{
-					return ccast;
-				}
+				return &m_Transform;
 			}
-			return nullptr;
-		}
-		template<typename T> std::vector<std::shared_ptr<T>> GetComponentsOfType() 
-		{
-			std::vector<std::shared_ptr<T>> result;
-			for (auto component : m_Components)
+			else if constexpr (std::is_same_v<T, typename T::ComponentFamily>)
+			{
+				return static_cast<T*>(m_Components[T::TypeID].get());
+			}
+			else
 			{
-				auto ccast = std::dynamic_pointer_cast<T, Component>(component);
-				if (ccast != nullptr)
-				{
-					result.push_back(ccast);
-				}
+				// Only a subclass of the family can be stored in the slot
+				return dynamic_cast<T*>(m_Components[T::TypeID].get());
 			}
-			return result;
 		}
 
+		Transform* GetTransform() { return &m_Transform; }
+
 		void Compile();
 
 	protected:
 		SceneNode * m_Parent = nullptr;
 		std::vector<std::shared_ptr<SceneNode>> m_Children;
-		std::vector<std::shared_ptr<Component>> m_Components;
+
+		Transform m_Transform;
+		std::array<std::unique_ptr<Component>, MaxComponentTypes> m_Components;
 	};
 
 }
\ No newline at end of file
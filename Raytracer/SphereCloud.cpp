@@ -0,0 +1,450 @@
+#include "SphereCloud.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace re
+{
+	namespace
+	{
+		constexpr size_t TraversalStackSize = 64;
+
+		// Conservative conversion of the bounds to single precision
+		float RoundDown(real value)
+		{
+			float result = static_cast<float>(value);
+			return result > value ? std::nextafter(result, -std::numeric_limits<float>::infinity()) : result;
+		}
+
+		float RoundUp(real value)
+		{
+			float result = static_cast<float>(value);
+			return result < value ? std::nextafter(result, std::numeric_limits<float>::infinity()) : result;
+		}
+
+		bool IntersectBounds(const float * min, const float * max, const Ray& ray, const Vector3& invDirection, real tMin, real tMax)
+		{
+			for (int i = 0; i < 3; i++)
+			{
+				real t1 = (min[i] - ray.Origin.Elements[i]) * invDirection.Elements[i];
+				real t2 = (max[i] - ray.Origin.Elements[i]) * invDirection.Elements[i];
+
+				if (t1 > t2)
+					std::swap(t1, t2);
+
+				// NaN (ray parallel to the slab and starting on its border) skips the axis
+				if (t1 > tMin)
+					tMin = t1;
+
+				if (t2 < tMax)
+					tMax = t2;
+			}
+
+			return tMin <= tMax;
+		}
+
+		/// Intersects the ray with a block of spheres. On hit returns the closest t in [tMin, tMax]
+		/// and the index of the sphere in the block. Same math as Sphere::Intersect, with a sphere
+		/// of any center and radius
+		bool IntersectBlock(const float * x, const float * y, const float * z, const float * r, uint32_t count,
+			const Ray& ray, real a, real tMin, real tMax, real& tHit, uint32_t& index)
+		{
+			bool result = false;
+
+#if defined(__AVX2__)
+			const __m256d ox = _mm256_set1_pd(ray.Origin.X);
+			const __m256d oy = _mm256_set1_pd(ray.Origin.Y);
+			const __m256d oz = _mm256_set1_pd(ray.Origin.Z);
+			const __m256d dx = _mm256_set1_pd(ray.Direction.X);
+			const __m256d dy = _mm256_set1_pd(ray.Direction.Y);
+			const __m256d dz = _mm256_set1_pd(ray.Direction.Z);
+			const __m256d va = _mm256_set1_pd(a);
+			const __m256d vtMin = _mm256_set1_pd(tMin);
+			const __m256d zero = _mm256_setzero_pd();
+			const __m256d lanes = _mm256_set_pd(3, 2, 1, 0);
+
+			// Spheres are stored as floats, 4 at a time are converted and intersected in double precision
+			for (uint32_t first = 0; first < count; first += 4)
+			{
+				__m256d ocx = _mm256_sub_pd(ox, _mm256_cvtps_pd(_mm_loadu_ps(x + first)));
+				__m256d ocy = _mm256_sub_pd(oy, _mm256_cvtps_pd(_mm_loadu_ps(y + first)));
+				__m256d ocz = _mm256_sub_pd(oz, _mm256_cvtps_pd(_mm_loadu_ps(z + first)));
+				__m256d radius = _mm256_cvtps_pd(_mm_loadu_ps(r + first));
+
+				__m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+				__m256d c = _mm256_sub_pd(
+					_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+					_mm256_mul_pd(radius, radius));
+				__m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(va, c));
+
+				__m256d valid = _mm256_and_pd(
+					_mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ),
+					_mm256_cmp_pd(lanes, _mm256_set1_pd(static_cast<double>(count - first)), _CMP_LT_OQ));
+
+				if (_mm256_movemask_pd(valid) == 0)
+					continue;
+
+				__m256d offset = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+				__m256d minusB = _mm256_sub_pd(zero, b);
+				__m256d t0 = _mm256_div_pd(_mm256_sub_pd(minusB, offset), va);
+				__m256d t1 = _mm256_div_pd(_mm256_add_pd(minusB, offset), va);
+
+				// If the closest intersection is out of range, the ray might start inside the sphere
+				__m256d t = _mm256_blendv_pd(t1, t0, _mm256_cmp_pd(t0, vtMin, _CMP_GE_OQ));
+
+				valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, vtMin, _CMP_GE_OQ));
+				valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, _mm256_set1_pd(tMax), _CMP_LE_OQ));
+
+				int mask = _mm256_movemask_pd(valid);
+
+				if (mask == 0)
+					continue;
+
+				alignas(32) double ts[4];
+				_mm256_store_pd(ts, t);
+
+				for (uint32_t i = 0; i < 4; i++)
+				{
+					if ((mask & (1 << i)) != 0 && ts[i] <= tMax)
+					{
+						tMax = ts[i];
+						tHit = ts[i];
+						index = first + i;
+						result = true;
+					}
+				}
+			}
+#else
+			for (uint32_t i = 0; i < count; i++)
+			{
+				real ocx = ray.Origin.X - x[i];
+				real ocy = ray.Origin.Y - y[i];
+				real ocz = ray.Origin.Z - z[i];
+				real radius = r[i];
+
+				real b = ocx * ray.Direction.X + ocy * ray.Direction.Y + ocz * ray.Direction.Z;
+				real c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius * radius;
+				real discriminant = b * b - a * c;
+
+				if (discriminant < 0)
+					continue;
+
+				real offset = std::sqrt(discriminant);
+				real t = (-b - offset) / a;
+
+				if (t < tMin)
+					t = (-b + offset) / a;
+
+				if (t < tMin || t > tMax)
+					continue;
+
+				tMax = t;
+				tHit = t;
+				index = i;
+				result = true;
+			}
+#endif
+
+			return result;
+		}
+
+		class SphereCloudBuilder
+		{
+		public:
+
+			struct Node
+			{
+				Vector3 Min, Max;
+				uint32_t Index = 0;
+				uint16_t Count = 0, Axis = 0;
+			};
+
+			SphereCloudBuilder(const float * x, const float * y, const float * z, const float * r, size_t count) :
+				m_X(x), m_Y(y), m_Z(z), m_R(r)
+			{
+				m_Order.resize(count);
+
+				for (size_t i = 0; i < count; i++)
+					m_Order[i] = static_cast<uint32_t>(i);
+
+				size_t blockCount = (count + SphereCloud::BlockSize - 1) / SphereCloud::BlockSize;
+				m_Nodes.reserve(blockCount * 2);
+
+				if (count > 0)
+					Build(0, count);
+			}
+
+			/// Sphere IDs in leaf order. Leaf i references the spheres [i * BlockSize, i * BlockSize + Count)
+			const std::vector<uint32_t>& GetOrder() const { return m_Order; }
+			const std::vector<Node>& GetNodes() const { return m_Nodes; }
+
+		private:
+
+			uint32_t Build(size_t begin, size_t end)
+			{
+				uint32_t index = static_cast<uint32_t>(m_Nodes.size());
+				m_Nodes.emplace_back();
+
+				Vector3 min, max, centerMin, centerMax;
+
+				for (int axis = 0; axis < 3; axis++)
+				{
+					min.Elements[axis] = centerMin.Elements[axis] = std::numeric_limits<real>::max();
+					max.Elements[axis] = centerMax.Elements[axis] = std::numeric_limits<real>::lowest();
+				}
+
+				for (size_t i = begin; i < end; i++)
+				{
+					uint32_t sphere = m_Order[i];
+					real center[3] = { m_X[sphere], m_Y[sphere], m_Z[sphere] };
+					real radius = m_R[sphere];
+
+					for (int axis = 0; axis < 3; axis++)
+					{
+						min.Elements[axis] = std::fmin(min.Elements[axis], center[axis] - radius);
+						max.Elements[axis] = std::fmax(max.Elements[axis], center[axis] + radius);
+						centerMin.Elements[axis] = std::fmin(centerMin.Elements[axis], center[axis]);
+						centerMax.Elements[axis] = std::fmax(centerMax.Elements[axis], center[axis]);
+					}
+				}
+
+				m_Nodes[index].Min = min;
+				m_Nodes[index].Max = max;
+
+				size_t count = end - begin;
+
+				if (count <= SphereCloud::BlockSize)
+				{
+					// Leaves start at a multiple of the block size, see below
+					m_Nodes[index].Index = static_cast<uint32_t>(begin / SphereCloud::BlockSize);
+					m_Nodes[index].Count = static_cast<uint16_t>(count);
+					return index;
+				}
+
+				// Median split on the longest axis of the centers. The left side is rounded up to
+				// a multiple of the block size, so that only the last block is partially filled
+				Vector3 extent = centerMax - centerMin;
+				uint16_t axis = extent.X > extent.Y ? (extent.X > extent.Z ? 0 : 2) : (extent.Y > extent.Z ? 1 : 2);
+				const float * coordinates = axis == 0 ? m_X : (axis == 1 ? m_Y : m_Z);
+
+				size_t half = (count / 2 + SphereCloud::BlockSize - 1) / SphereCloud::BlockSize * SphereCloud::BlockSize;
+				size_t middle = begin + half;
+
+				std::nth_element(m_Order.begin() + begin, m_Order.begin() + middle, m_Order.begin() + end,
+					[coordinates](uint32_t a, uint32_t b) { return coordinates[a] < coordinates[b]; });
+
+				Build(begin, middle);
+				uint32_t right = Build(middle, end);
+
+				m_Nodes[index].Index = right;
+				m_Nodes[index].Axis = axis;
+
+				return index;
+			}
+
+			const float * m_X, * m_Y, * m_Z, * m_R;
+			std::vector<uint32_t> m_Order;
+			std::vector<Node> m_Nodes;
+		};
+	}
+}
+
+void re::SphereCloud::SetSpheres(Span<const Vector3> centers, Span<const real> radii)
+{
+	assert(centers.GetSize() == radii.GetSize());
+
+	size_t count = centers.GetSize();
+
+	m_X.resize(count);
+	m_Y.resize(count);
+	m_Z.resize(count);
+	m_Radius.resize(count);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		m_X[i] = static_cast<float>(centers[i].X);
+		m_Y[i] = static_cast<float>(centers[i].Y);
+		m_Z[i] = static_cast<float>(centers[i].Z);
+		m_Radius[i] = static_cast<float>(radii[i]);
+	}
+
+	m_SphereCount = count;
+	m_Invalidated = true;
+}
+
+void re::SphereCloud::SetSpheres(Span<const Vector3> centers, real radius)
+{
+	std::vector<real> radii(centers.GetSize(), radius);
+	SetSpheres(centers, Span<const real>(radii.data(), radii.size()));
+}
+
+size_t re::SphereCloud::GetMemoryUsage() const
+{
+	return sizeof(SphereCloud) +
+		(m_X.capacity() + m_Y.capacity() + m_Z.capacity() + m_Radius.capacity()) * sizeof(float) +
+		(m_IDs.capacity() + m_Slots.capacity()) * sizeof(uint32_t) +
+		m_Nodes.capacity() * sizeof(Node);
+}
+
+bool re::SphereCloud::GetBounds(BoundingBox & bounds)
+{
+	bounds = m_BoundingBox;
+	return true;
+}
+
+void re::SphereCloud::Compile()
+{
+	if (!m_Invalidated)
+		return;
+
+	SphereCloudBuilder builder(m_X.data(), m_Y.data(), m_Z.data(), m_Radius.data(), m_SphereCount);
+	const auto& order = builder.GetOrder();
+
+	// Sort the spheres in blocks
+	size_t slotCount = (m_SphereCount + BlockSize - 1) / BlockSize * BlockSize;
+
+	std::vector<float> x(slotCount, 0.0f), y(slotCount, 0.0f), z(slotCount, 0.0f), radius(slotCount, 0.0f);
+	std::vector<uint32_t> ids(slotCount, Hit::InvalidID);
+	std::vector<uint32_t> slots(m_SphereCount);
+
+	for (size_t slot = 0; slot < m_SphereCount; slot++)
+	{
+		uint32_t id = order[slot];
+		x[slot] = m_X[id];
+		y[slot] = m_Y[id];
+		z[slot] = m_Z[id];
+		radius[slot] = m_Radius[id];
+		ids[slot] = id;
+		slots[id] = static_cast<uint32_t>(slot);
+	}
+
+	m_X = std::move(x);
+	m_Y = std::move(y);
+	m_Z = std::move(z);
+	m_Radius = std::move(radius);
+	m_IDs = std::move(ids);
+	m_Slots = std::move(slots);
+
+	m_Nodes.resize(builder.GetNodes().size());
+
+	for (size_t i = 0; i < m_Nodes.size(); i++)
+	{
+		const auto& source = builder.GetNodes()[i];
+		Node& node = m_Nodes[i];
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			node.Min[axis] = RoundDown(source.Min.Elements[axis]);
+			node.Max[axis] = RoundUp(source.Max.Elements[axis]);
+		}
+
+		node.Index = source.Index;
+		node.Count = source.Count;
+		node.Axis = source.Axis;
+	}
+
+	if (m_Nodes.size() > 0)
+		m_BoundingBox = BoundingBox(builder.GetNodes()[0].Min, builder.GetNodes()[0].Max);
+	else
+		m_BoundingBox = BoundingBox();
+
+	m_Invalidated = false;
+}
+
+template<bool AnyHit>
+bool re::SphereCloud::Traverse(const Ray & ray, Hit & hit) const
+{
+	if (m_Invalidated || m_Nodes.empty())
+		return false;
+
+	Vector3 invDirection = Vector3::One / ray.Direction;
+	real a = ray.Direction.X * ray.Direction.X + ray.Direction.Y * ray.Direction.Y + ray.Direction.Z * ray.Direction.Z;
+	real tMax = ray.TMax;
+	bool result = false;
+
+	uint32_t stack[TraversalStackSize];
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		uint32_t index = stack[--stackSize];
+		const Node& node = m_Nodes[index];
+
+		if (!IntersectBounds(node.Min, node.Max, ray, invDirection, ray.TMin, tMax))
+			continue;
+
+		if (node.Count > 0)
+		{
+			size_t first = static_cast<size_t>(node.Index) * BlockSize;
+			real t;
+			uint32_t sphere;
+
+			if (IntersectBlock(m_X.data() + first, m_Y.data() + first, m_Z.data() + first, m_Radius.data() + first,
+				node.Count, ray, a, ray.TMin, tMax, t, sphere))
+			{
+				tMax = t;
+				hit.T = t;
+				hit.PrimitiveID = m_IDs[first + sphere];
+				hit.U = hit.V = 0;
+				result = true;
+
+				if (AnyHit)
+					return true;
+			}
+		}
+		else
+		{
+			// Visit the child on the side of the ray origin first
+			uint32_t nearChild = index + 1, farChild = node.Index;
+
+			if (ray.Direction.Elements[node.Axis] < 0)
+				std::swap(nearChild, farChild);
+
+			assert(stackSize + 2 <= TraversalStackSize);
+			stack[stackSize++] = farChild;
+			stack[stackSize++] = nearChild;
+		}
+	}
+
+	return result;
+}
+
+re::RayHitResult re::SphereCloud::Intersect(const Ray & ray)
+{
+	RayHitResult result;
+	Hit hit;
+
+	if (Traverse<false>(ray, hit))
+	{
+		result.Hit = true;
+		result.Point = ray.Origin + ray.Direction * hit.T;
+		result.Normal = GetNormal(ray, hit).Normalized();
+	}
+
+	return result;
+}
+
+bool re::SphereCloud::Intersect(const Ray & ray, Hit & hit)
+{
+	return Traverse<false>(ray, hit);
+}
+
+bool re::SphereCloud::Occluded(const Ray & ray)
+{
+	Hit hit;
+	return Traverse<true>(ray, hit);
+}
+
+re::Vector3 re::SphereCloud::GetNormal(const Ray & ray, const Hit & hit)
+{
+	uint32_t slot = m_Slots[hit.PrimitiveID];
+	Vector3 center(m_X[slot], m_Y[slot], m_Z[slot]);
+
+	return ray.Origin + ray.Direction * hit.T - center;
+}
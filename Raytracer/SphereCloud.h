@@ -0,0 +1,73 @@
+#pragma once
+#include "Common.h"
+#include "Scene.h"
+#include <cstdint>
+#include <vector>
+
+namespace re
+{
+	/// A large set of spheres rendered as a single shape, for particle systems and simulations.
+	/// The spheres are stored in SoA blocks, which are the leaves of a BVH, and each block is
+	/// intersected at once (with AVX2 when the library is built with it). Centers and radii are
+	/// in the local space of the node, and are stored with single precision
+	class SphereCloud : public Shape
+	{
+	public:
+
+		/// Number of spheres in a leaf of the BVH
+		static constexpr uint32_t BlockSize = 8;
+
+		SphereCloud(SceneNode * owner) : Shape(owner) {}
+
+		/// Replaces the spheres, the BVH is built by Compile. The PrimitiveID of a hit
+		/// is the index of the sphere in these arrays
+		void SetSpheres(Span<const Vector3> centers, Span<const real> radii);
+
+		/// Same as above, all the spheres have the same radius
+		void SetSpheres(Span<const Vector3> centers, real radius);
+
+		size_t GetSphereCount() const { return m_SphereCount; }
+		const BoundingBox& GetBoundingBox() const { return m_BoundingBox; }
+
+		virtual size_t GetMemoryUsage() const override;
+		virtual bool GetBounds(BoundingBox& bounds) override;
+
+		virtual void Compile() override;
+
+		virtual RayHitResult Intersect(const Ray& ray) override;
+		virtual bool Intersect(const Ray& ray, Hit& hit) override;
+		virtual bool Occluded(const Ray& ray) override;
+		virtual Vector3 GetNormal(const Ray& ray, const Hit& hit) override;
+
+	private:
+
+		/// BVH node, stored in depth-first order: the left child of an interior node is the next node
+		struct Node
+		{
+			float Min[3], Max[3];
+
+			// Leaves: first block and number of spheres
+			// Interior nodes: right child, Count is 0 and Axis is the split axis
+			uint32_t Index;
+			uint16_t Count, Axis;
+		};
+
+		template<bool AnyHit>
+		bool Traverse(const Ray& ray, Hit& hit) const;
+
+		bool m_Invalidated = true;
+		size_t m_SphereCount = 0;
+
+		// Before Compile the spheres are in the order they were set, after Compile they are sorted
+		// in blocks of BlockSize. Unused slots at the end of a block have an InvalidID
+		std::vector<float> m_X, m_Y, m_Z, m_Radius;
+		std::vector<uint32_t> m_IDs;
+
+		// Slot of each sphere, by ID
+		std::vector<uint32_t> m_Slots;
+
+		std::vector<Node> m_Nodes;
+
+		re::BoundingBox m_BoundingBox;
+	};
+}
@@ -0,0 +1,312 @@
+#include "Texture.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace re
+{
+	namespace
+	{
+		constexpr uint32_t FileMagic = 0x58544552; // "RETX"
+
+		struct FileHeader
+		{
+			uint32_t Magic, Version;
+			uint32_t Width, Height;
+			uint64_t Key;
+		};
+
+		std::atomic<uint64_t> NextTextureID { 1 };
+
+		/// Next level of the pyramid, the mean of 2x2 texels. The last row or column of odd sizes
+		/// is repeated
+		std::vector<uint8_t> Downsample(const std::vector<uint8_t>& source, uint32_t width, uint32_t height)
+		{
+			uint32_t nextWidth = std::max(1u, width / 2), nextHeight = std::max(1u, height / 2);
+			std::vector<uint8_t> result(static_cast<size_t>(nextWidth) * nextHeight * 3);
+
+			for (uint32_t y = 0; y < nextHeight; y++)
+			{
+				uint32_t y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+
+				for (uint32_t x = 0; x < nextWidth; x++)
+				{
+					uint32_t x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+
+					for (uint32_t c = 0; c < 3; c++)
+					{
+						uint32_t sum =
+							source[(static_cast<size_t>(y0) * width + x0) * 3 + c] + source[(static_cast<size_t>(y0) * width + x1) * 3 + c] +
+							source[(static_cast<size_t>(y1) * width + x0) * 3 + c] + source[(static_cast<size_t>(y1) * width + x1) * 3 + c];
+
+						result[(static_cast<size_t>(y) * nextWidth + x) * 3 + c] = static_cast<uint8_t>((sum + 2) / 4);
+					}
+				}
+			}
+
+			return result;
+		}
+	}
+}
+
+size_t re::TextureCache::KeyHash::operator()(const Key & key) const
+{
+	uint64_t tile = (static_cast<uint64_t>(key.Level) << 48) ^ (static_cast<uint64_t>(key.Y) << 24) ^ key.X;
+	return std::hash<uint64_t>()(tile * 0x9e3779b97f4a7c15ull ^ key.TextureID);
+}
+
+void re::TextureCache::SetCapacity(size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Capacity = capacity;
+	Evict();
+}
+
+void re::TextureCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Entries.clear();
+	m_Index.clear();
+	m_Bytes = 0;
+}
+
+re::TextureCache::Statistics re::TextureCache::GetStatistics() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	Statistics statistics;
+	statistics.TileCount = m_Entries.size();
+	statistics.Bytes = m_Bytes;
+	statistics.Hits = m_Hits;
+	statistics.Misses = m_Misses;
+	return statistics;
+}
+
+re::TextureCache & re::TextureCache::GetDefault()
+{
+	static TextureCache cache;
+	return cache;
+}
+
+std::shared_ptr<const re::TextureCache::Tile> re::TextureCache::Get(const Texture & texture, uint32_t level, uint32_t x, uint32_t y)
+{
+	Key key = { texture.m_ID, level, x, y };
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		auto it = m_Index.find(key);
+
+		if (it != m_Index.end())
+		{
+			m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+			m_Hits++;
+			return it->second->Data;
+		}
+
+		m_Misses++;
+	}
+
+	auto tile = texture.ReadTile(level, x, y);
+
+	if (tile == nullptr)
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	// Another thread may have read the same tile in the meantime
+	auto it = m_Index.find(key);
+
+	if (it != m_Index.end())
+	{
+		m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+		return it->second->Data;
+	}
+
+	m_Entries.push_front({ key, tile });
+	m_Index[key] = m_Entries.begin();
+	m_Bytes += tile->size();
+
+	Evict();
+
+	return tile;
+}
+
+void re::TextureCache::Evict()
+{
+	while (m_Bytes > m_Capacity && !m_Entries.empty())
+	{
+		const Entry& entry = m_Entries.back();
+		m_Bytes -= entry.Data->size();
+		m_Index.erase(entry.TileKey);
+		m_Entries.pop_back();
+	}
+}
+
+std::vector<re::Texture::Level> re::Texture::GetLevels(uint32_t width, uint32_t height, uint64_t offset)
+{
+	std::vector<Level> levels;
+
+	for (;;)
+	{
+		Level level;
+		level.Width = width;
+		level.Height = height;
+		level.TilesX = (width + TileSize - 1) / TileSize;
+		level.TilesY = (height + TileSize - 1) / TileSize;
+		level.Offset = offset;
+		levels.push_back(level);
+
+		offset += static_cast<uint64_t>(level.TilesX) * level.TilesY * TileBytes;
+
+		if (width == 1 && height == 1)
+			return levels;
+
+		width = std::max(1u, width / 2);
+		height = std::max(1u, height / 2);
+	}
+}
+
+bool re::Texture::Save(std::ostream & os, uint32_t width, uint32_t height, const uint8_t * rgb, uint64_t key)
+{
+	if (width == 0 || height == 0)
+		return false;
+
+	FileHeader header = { FileMagic, FileVersion, width, height, key };
+	os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	std::vector<uint8_t> texels(rgb, rgb + static_cast<size_t>(width) * height * 3);
+	std::vector<uint8_t> tile(TileBytes);
+
+	for (const auto& level : GetLevels(width, height, sizeof(FileHeader)))
+	{
+		if (level.Width != width || level.Height != height)
+		{
+			texels = Downsample(texels, width, height);
+			width = level.Width;
+			height = level.Height;
+		}
+
+		for (uint32_t tileY = 0; tileY < level.TilesY; tileY++)
+		{
+			for (uint32_t tileX = 0; tileX < level.TilesX; tileX++)
+			{
+				// Texels past the border of the level wrap around, like the texture coordinates
+				for (uint32_t y = 0; y <= TileSize; y++)
+				{
+					uint32_t sourceY = (tileY * TileSize + y) % height;
+
+					for (uint32_t x = 0; x <= TileSize; x++)
+					{
+						uint32_t sourceX = (tileX * TileSize + x) % width;
+						const uint8_t * texel = &texels[(static_cast<size_t>(sourceY) * width + sourceX) * 3];
+						std::copy(texel, texel + 3, &tile[(y * (TileSize + 1) + x) * 3]);
+					}
+				}
+
+				os.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+			}
+		}
+	}
+
+	return os.good();
+}
+
+std::shared_ptr<re::Texture> re::Texture::Open(const std::string & fileName, uint64_t key, TextureCache & cache)
+{
+	std::shared_ptr<Texture> texture(new Texture(cache));
+	texture->m_File.open(fileName, std::ios::binary);
+
+	FileHeader header;
+
+	if (!texture->m_File.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		header.Magic != FileMagic || header.Version != FileVersion || header.Key != key || header.Width == 0 || header.Height == 0)
+		return nullptr;
+
+	texture->m_Levels = GetLevels(header.Width, header.Height, sizeof(FileHeader));
+
+	// The file must hold every tile, the last level is a single tile
+	const Level& last = texture->m_Levels.back();
+
+	if (!texture->m_File.seekg(0, std::ios::end) || static_cast<uint64_t>(texture->m_File.tellg()) < last.Offset + TileBytes)
+		return nullptr;
+
+	texture->m_ID = NextTextureID++;
+
+	auto tile = texture->ReadTile(texture->GetLevelCount() - 1, 0, 0);
+
+	if (tile == nullptr)
+		return nullptr;
+
+	texture->m_MeanColor = Color((*tile)[0] / 255.0, (*tile)[1] / 255.0, (*tile)[2] / 255.0);
+
+	return texture;
+}
+
+re::Color re::Texture::Sample(const Vector2 & texCoord, real footprint) const
+{
+	real texels = footprint * std::max(GetWidth(), GetHeight());
+
+	if (texels <= 1)
+		return SampleLevel(0, texCoord);
+
+	real lod = std::min<real>(std::log2(texels), GetLevelCount() - 1);
+	uint32_t level = static_cast<uint32_t>(lod);
+	real t = lod - level;
+
+	if (t <= 0 || level + 1 >= GetLevelCount())
+		return SampleLevel(level, texCoord);
+
+	return Mix(SampleLevel(level, texCoord), SampleLevel(level + 1, texCoord), t);
+}
+
+re::Color re::Texture::SampleLevel(uint32_t level, const Vector2 & texCoord) const
+{
+	const Level& info = m_Levels[level];
+
+	// Texel centers are at half integers. V goes up, as in Wavefront files, the rows go down
+	real x = (texCoord.U - std::floor(texCoord.U)) * info.Width - 0.5;
+	real y = (1 - (texCoord.V - std::floor(texCoord.V))) * info.Height - 0.5;
+
+	real floorX = std::floor(x), floorY = std::floor(y);
+	real tx = x - floorX, ty = y - floorY;
+
+	int x0 = static_cast<int>(floorX), y0 = static_cast<int>(floorY);
+	if (x0 < 0) x0 += info.Width;
+	if (y0 < 0) y0 += info.Height;
+
+	auto tile = m_Cache.Get(*this, level, x0 / TileSize, y0 / TileSize);
+
+	if (tile == nullptr)
+		return m_MeanColor;
+
+	const uint8_t * row0 = tile->data() + ((y0 % TileSize) * (TileSize + 1) + (x0 % TileSize)) * 3;
+	const uint8_t * row1 = row0 + (TileSize + 1) * 3;
+
+	real color[3];
+
+	for (int c = 0; c < 3; c++)
+	{
+		real top = row0[c] * (1 - tx) + row0[c + 3] * tx;
+		real bottom = row1[c] * (1 - tx) + row1[c + 3] * tx;
+		color[c] = (top * (1 - ty) + bottom * ty) * (1.0 / 255.0);
+	}
+
+	return Color(color[0], color[1], color[2]);
+}
+
+std::shared_ptr<const re::TextureCache::Tile> re::Texture::ReadTile(uint32_t level, uint32_t x, uint32_t y) const
+{
+	const Level& info = m_Levels[level];
+	auto tile = std::make_shared<TextureCache::Tile>(TileBytes);
+
+	std::lock_guard<std::mutex> lock(m_FileMutex);
+
+	m_File.clear();
+	m_File.seekg(info.Offset + (static_cast<uint64_t>(y) * info.TilesX + x) * TileBytes);
+
+	if (!m_File.read(reinterpret_cast<char*>(tile->data()), tile->size()))
+		return nullptr;
+
+	return tile;
+}
@@ -0,0 +1,159 @@
+#pragma once
+#include "Common.h"
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace re
+{
+	class Texture;
+
+	/// Tiles of the textures that have been sampled recently, shared by every texture that uses the
+	/// cache. When the tiles exceed the capacity, the least recently used ones are released. Safe to
+	/// use from the render threads: a tile stays valid as long as it is referenced, even if it is evicted
+	class TextureCache
+	{
+	public:
+
+		using Tile = std::vector<uint8_t>;
+
+		struct Statistics
+		{
+			size_t TileCount = 0;
+			size_t Bytes = 0;
+			size_t Hits = 0;
+			size_t Misses = 0;
+		};
+
+		/// The capacity is in bytes
+		explicit TextureCache(size_t capacity = 64 * 1024 * 1024) : m_Capacity(capacity) {}
+
+		TextureCache(const TextureCache&) = delete;
+		TextureCache& operator=(const TextureCache&) = delete;
+
+		/// Evicts tiles until the cache fits
+		void SetCapacity(size_t capacity);
+		size_t GetCapacity() const { return m_Capacity; }
+
+		/// Releases every tile, the textures read them again when sampled
+		void Clear();
+
+		Statistics GetStatistics() const;
+
+		/// Cache used by the textures that aren't given one, created on first use
+		static TextureCache& GetDefault();
+
+	private:
+		friend class Texture;
+
+		struct Key
+		{
+			uint64_t TextureID;
+			uint32_t Level, X, Y;
+
+			bool operator==(const Key& other) const
+			{
+				return TextureID == other.TextureID && Level == other.Level && X == other.X && Y == other.Y;
+			}
+		};
+
+		struct KeyHash
+		{
+			size_t operator()(const Key& key) const;
+		};
+
+		struct Entry
+		{
+			Key TileKey;
+			std::shared_ptr<const Tile> Data;
+		};
+
+		/// Returns the tile, reading it from the texture on a miss. The file is read without holding
+		/// the lock of the cache, so threads sampling tiles that are already loaded don't wait
+		std::shared_ptr<const Tile> Get(const Texture& texture, uint32_t level, uint32_t x, uint32_t y);
+
+		void Evict();
+
+		mutable std::mutex m_Mutex;
+		size_t m_Capacity;
+		size_t m_Bytes = 0;
+		size_t m_Hits = 0, m_Misses = 0;
+
+		// Most recently used first
+		std::list<Entry> m_Entries;
+		std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> m_Index;
+	};
+
+	/// Image with its mip pyramid, stored in a file in tiles of TileSize^2 texels. Only the header is
+	/// read when the texture is opened: the tiles are read through a TextureCache when they are
+	/// sampled, so textures much larger than the cache can be used
+	class Texture
+	{
+	public:
+
+		/// Version of the format written by Save
+		static constexpr uint32_t FileVersion = 1;
+
+		static constexpr uint32_t TileSize = 64;
+
+		/// Tiles have one more row and column, copied from the next tiles, so that a bilinear
+		/// lookup always reads a single tile. 3 bytes per texel
+		static constexpr size_t TileBytes = (TileSize + 1) * (TileSize + 1) * 3;
+
+		Texture(const Texture&) = delete;
+		Texture& operator=(const Texture&) = delete;
+
+		/// Builds the mip pyramid of an RGB image (3 bytes per texel, rows from the top) with a box
+		/// filter, and writes it in the format read by Open. The key identifies the source image
+		static bool Save(std::ostream& os, uint32_t width, uint32_t height, const uint8_t * rgb, uint64_t key);
+
+		/// Opens a file written by Save. Returns nullptr if the file can't be read, isn't valid or
+		/// has been saved with a different key or version
+		static std::shared_ptr<Texture> Open(const std::string& fileName, uint64_t key, TextureCache& cache = TextureCache::GetDefault());
+
+		/// Color at the texture coordinates, repeated outside [0, 1]. The footprint is the width of
+		/// the sample in texture coordinates: it selects the mip levels, which are interpolated
+		/// (trilinear filtering). A footprint of 0 samples the full resolution
+		Color Sample(const Vector2& texCoord, real footprint) const;
+
+		/// Mean color of the image, the single texel of the last level
+		const Color& GetMeanColor() const { return m_MeanColor; }
+
+		uint32_t GetWidth() const { return m_Levels[0].Width; }
+		uint32_t GetHeight() const { return m_Levels[0].Height; }
+		uint32_t GetLevelCount() const { return static_cast<uint32_t>(m_Levels.size()); }
+
+	private:
+		friend class TextureCache;
+
+		struct Level
+		{
+			uint32_t Width, Height;
+			uint32_t TilesX, TilesY;
+			uint64_t Offset; /// Position of the first tile in the file
+		};
+
+		Texture(TextureCache& cache) : m_Cache(cache) {}
+
+		static std::vector<Level> GetLevels(uint32_t width, uint32_t height, uint64_t offset);
+
+		/// Bilinear lookup in a level
+		Color SampleLevel(uint32_t level, const Vector2& texCoord) const;
+
+		std::shared_ptr<const TextureCache::Tile> ReadTile(uint32_t level, uint32_t x, uint32_t y) const;
+
+		TextureCache& m_Cache;
+		uint64_t m_ID = 0;
+		std::vector<Level> m_Levels;
+		Color m_MeanColor;
+
+		mutable std::mutex m_FileMutex;
+		mutable std::ifstream m_File;
+	};
+}
@@ -0,0 +1,106 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+re::ThreadPool::ThreadPool(unsigned int numThreads)
+{
+	if (numThreads == 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned int i = 1; i < numThreads; i++)
+		m_Workers.emplace_back(&ThreadPool::WorkerThread, this);
+}
+
+re::ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Stop = true;
+	}
+
+	m_WakeCondition.notify_all();
+
+	for (auto& worker : m_Workers)
+		worker.join();
+}
+
+void re::ThreadPool::ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& func)
+{
+	if (count == 0)
+		return;
+
+	grainSize = std::max<size_t>(grainSize, 1);
+
+	// Not worth waking up the workers
+	if (count <= grainSize || m_Workers.empty())
+	{
+		func(0, count);
+		return;
+	}
+
+	std::lock_guard<std::mutex> loopLock(m_LoopMutex);
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Function = &func;
+		m_Count = count;
+		m_GrainSize = grainSize;
+		m_Next = 0;
+		m_ActiveWorkers = static_cast<unsigned int>(m_Workers.size());
+		m_Generation++;
+	}
+
+	m_WakeCondition.notify_all();
+
+	RunJob();
+
+	// Wait for the workers, the function must outlive the loop
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_DoneCondition.wait(lock, [this]() { return m_ActiveWorkers == 0; });
+	m_Function = nullptr;
+}
+
+re::ThreadPool & re::ThreadPool::GetDefault()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+void re::ThreadPool::WorkerThread()
+{
+	uint64_t generation = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_WakeCondition.wait(lock, [&]() { return m_Stop || m_Generation != generation; });
+
+			if (m_Stop)
+				return;
+
+			generation = m_Generation;
+		}
+
+		RunJob();
+
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+
+			if (--m_ActiveWorkers == 0)
+				m_DoneCondition.notify_one();
+		}
+	}
+}
+
+void re::ThreadPool::RunJob()
+{
+	while (true)
+	{
+		size_t begin = m_Next.fetch_add(m_GrainSize);
+
+		if (begin >= m_Count)
+			return;
+
+		(*m_Function)(begin, std::min(begin + m_GrainSize, m_Count));
+	}
+}
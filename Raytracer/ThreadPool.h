@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace re
+{
+	/// A fixed set of worker threads running parallel loops
+	class ThreadPool
+	{
+	public:
+
+		/// If numThreads is 0, the number of hardware threads is used. The calling
+		/// thread takes part in the work, so the pool starts one thread less
+		explicit ThreadPool(unsigned int numThreads = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		unsigned int GetThreadCount() const { return static_cast<unsigned int>(m_Workers.size()) + 1; }
+
+		/// Calls func(begin, end) on consecutive ranges of at most grainSize items, in parallel,
+		/// and returns when every range has been processed. Loops from different threads are
+		/// run one at a time. Must not be called from inside a loop
+		void ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& func);
+
+		/// Pool shared by the library, created on first use
+		static ThreadPool& GetDefault();
+
+	private:
+
+		void WorkerThread();
+		void RunJob();
+
+		std::vector<std::thread> m_Workers;
+
+		std::mutex m_LoopMutex;
+
+		std::mutex m_Mutex;
+		std::condition_variable m_WakeCondition, m_DoneCondition;
+		uint64_t m_Generation = 0;
+		unsigned int m_ActiveWorkers = 0;
+		bool m_Stop = false;
+
+		// Current loop
+		const std::function<void(size_t, size_t)> * m_Function = nullptr;
+		size_t m_Count = 0, m_GrainSize = 1;
+		std::atomic<size_t> m_Next { 0 };
+	};
+}
@@ -1,5 +1,9 @@
 #include "CheckerBoard.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 re::real re::CheckerBoard::SampleNormalized(const Vector3 & point)
 {
 	bool thresold[3] =
@@ -14,3 +18,29 @@ re::real re::CheckerBoard::SampleNormalized(const Vector3 & point)
 	return thresold[2] ^ (thresold[0] ^ thresold[1]);
 
 }
+
+void re::CheckerBoard::SampleNormalizedBatch(Span<const Vector3> points, Span<real> out)
+{
+#if defined(__AVX2__)
+	const __m256d half = _mm256_set1_pd(0.5);
+	const __m256d one = _mm256_set1_pd(1.0);
+
+	size_t i = 0;
+
+	for (; i + 4 <= points.GetSize(); i += 4)
+	{
+		const Vector3* p = &points[i];
+
+		__m256d x = _mm256_set_pd(p[3].X, p[2].X, p[1].X, p[0].X);
+		__m256d z = _mm256_set_pd(p[3].Z, p[2].Z, p[1].Z, p[0].Z);
+
+		__m256d mask = _mm256_xor_pd(_mm256_cmp_pd(x, half, _CMP_LE_OQ), _mm256_cmp_pd(z, half, _CMP_LE_OQ));
+		_mm256_storeu_pd(&out[i], _mm256_and_pd(mask, one));
+	}
+
+	for (; i < points.GetSize(); i++)
+		out[i] = SampleNormalized(points[i]);
+#else
+	Noise::SampleNormalizedBatch(points, out);
+#endif
+}
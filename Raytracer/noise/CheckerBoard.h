@@ -9,5 +9,7 @@ namespace re
 	public:
 		CheckerBoard(real domainSize) : Noise::Noise(domainSize) {};
 		virtual real SampleNormalized(const Vector3& point) override;
+		virtual void SampleNormalizedBatch(Span<const Vector3> points, Span<real> out) override;
+		virtual bool IsBakeable() const override { return false; }
 	};
 }
\ No newline at end of file
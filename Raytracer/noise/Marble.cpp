@@ -13,3 +13,20 @@ re::real re::Marble::SampleNormalized(const Vector3 & point)
 	auto f = m_Perlin->SampleNormalized(point) * m_Turbolence;
 	return std::fabs(std::sin(f * m_Frequency * 3.141592f));
 }
+
+re::real re::Marble::SampleNormalizedFiltered(const Vector3 & point, real footprint)
+{
+	auto f = m_Perlin->SampleNormalizedFiltered(point, footprint) * m_Turbolence;
+	return std::fabs(std::sin(f * m_Frequency * 3.141592f));
+}
+
+void re::Marble::SampleNormalizedBatch(Span<const Vector3> points, Span<real> out)
+{
+	m_Perlin->SampleNormalizedBatch(points, out);
+
+	for (size_t i = 0; i < points.GetSize(); i++)
+	{
+		auto f = out[i] * m_Turbolence;
+		out[i] = std::fabs(std::sin(f * m_Frequency * 3.141592f));
+	}
+}
@@ -11,6 +11,10 @@ namespace re
 	public:
 		Marble(real domainSize, real frequency = 50, real turbolence = 4);
 		virtual real SampleNormalized(const Vector3& point) override;
+		virtual real SampleNormalizedFiltered(const Vector3& point, real footprint) override;
+
+		/// The perlin noise is evaluated in batch, the sine is applied after
+		virtual void SampleNormalizedBatch(Span<const Vector3> points, Span<real> out) override;
 	private:
 		std::shared_ptr<Perlin> m_Perlin;
 		real m_Frequency, m_Turbolence;
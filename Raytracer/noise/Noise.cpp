@@ -1,19 +1,196 @@
 #include "Noise.h"
+#include "../Random.h"
+#include "../ThreadPool.h"
+#include <cassert>
+#include <cmath>
 
-re::real re::Noise::Sample(const Vector3 & point)
+namespace re
 {
-	static auto normalize = [](real x, real domainSize) -> real
+	namespace
 	{
-		x = std::fmodf(x, domainSize) / domainSize;
-		return x < 0 ? 1.0 + x : x;
-	};
+		constexpr size_t BrickVolume = Noise::BrickSize * Noise::BrickSize * Noise::BrickSize;
+
+		// Points compared with the analytic noise by Bake
+		constexpr size_t ReportSampleCount = 4096;
+
+		// Points normalized at once by SampleBatch
+		constexpr size_t BatchSize = 64;
+
+		// Maps x to [0, 1], the noise repeats every domainSize
+		inline real Normalize(real x, real domainSize)
+		{
+			real t = x / domainSize;
+			return t - std::floor(t);
+		}
 
-	Vector3 normalizedPoint = Vector3(
-		normalize(point.X, m_DomainSize),
-		normalize(point.Y, m_DomainSize),
-		normalize(point.Z, m_DomainSize)
-		);
+		inline Vector3 Normalize(const Vector3& point, real domainSize)
+		{
+			return Vector3(Normalize(point.X, domainSize), Normalize(point.Y, domainSize), Normalize(point.Z, domainSize));
+		}
+
+		unsigned int GetBakeResolution(unsigned int resolution)
+		{
+			return (std::max(resolution, 1u) + Noise::BrickSize - 1) / Noise::BrickSize * Noise::BrickSize;
+		}
+
+		inline size_t GetBakedIndex(unsigned int x, unsigned int y, unsigned int z, size_t bricks)
+		{
+			constexpr unsigned int Size = Noise::BrickSize;
+
+			size_t brick = (z / Size * bricks + y / Size) * bricks + x / Size;
+			return brick * BrickVolume + ((z % Size) * Size + y % Size) * Size + x % Size;
+		}
+	}
+}
+
+re::real re::Noise::Sample(const Vector3 & point)
+{
+	Vector3 normalizedPoint = Normalize(point, m_DomainSize);
+
+	if (IsBaked())
+		return SampleBaked(normalizedPoint);
 
 	return SampleNormalized(normalizedPoint);
 
 }
+
+re::real re::Noise::SampleFiltered(const Vector3 & point, real footprint)
+{
+	if (footprint <= 0 || IsBaked())
+		return Sample(point);
+
+	return SampleNormalizedFiltered(Normalize(point, m_DomainSize), footprint / m_DomainSize);
+}
+
+void re::Noise::SampleBatch(Span<const Vector3> points, Span<real> out)
+{
+	assert(out.GetSize() >= points.GetSize());
+
+	Vector3 normalizedPoints[BatchSize];
+
+	for (size_t first = 0; first < points.GetSize(); first += BatchSize)
+	{
+		size_t count = std::min(BatchSize, points.GetSize() - first);
+
+		for (size_t i = 0; i < count; i++)
+			normalizedPoints[i] = Normalize(points[first + i], m_DomainSize);
+
+		if (IsBaked())
+		{
+			for (size_t i = 0; i < count; i++)
+				out[first + i] = SampleBaked(normalizedPoints[i]);
+		}
+		else
+		{
+			SampleNormalizedBatch(Span<const Vector3>(normalizedPoints, count), Span<real>(out.GetData() + first, count));
+		}
+	}
+}
+
+void re::Noise::SampleNormalizedBatch(Span<const Vector3> points, Span<real> out)
+{
+	for (size_t i = 0; i < points.GetSize(); i++)
+		out[i] = SampleNormalized(points[i]);
+}
+
+const re::Noise::BakeReport & re::Noise::Bake(unsigned int resolution)
+{
+	resolution = GetBakeResolution(resolution);
+
+	if (IsBaked() && m_BakeReport.Resolution == resolution)
+		return m_BakeReport;
+
+	size_t bricks = resolution / BrickSize;
+	std::vector<float> baked(bricks * bricks * bricks * BrickVolume);
+
+	// The grid is periodic like the noise: point i is at i / resolution
+	ThreadPool::GetDefault().ParallelFor(bricks * bricks * bricks, 1, [&](size_t begin, size_t end) {
+
+		for (size_t brick = begin; brick < end; brick++)
+		{
+			unsigned int bx = static_cast<unsigned int>(brick % bricks) * BrickSize;
+			unsigned int by = static_cast<unsigned int>(brick / bricks % bricks) * BrickSize;
+			unsigned int bz = static_cast<unsigned int>(brick / (bricks * bricks)) * BrickSize;
+
+			for (unsigned int z = bz; z < bz + BrickSize; z++)
+			{
+				for (unsigned int y = by; y < by + BrickSize; y++)
+				{
+					for (unsigned int x = bx; x < bx + BrickSize; x++)
+					{
+						Vector3 point(real(x) / resolution, real(y) / resolution, real(z) / resolution);
+						baked[GetBakedIndex(x, y, z, bricks)] = static_cast<float>(SampleNormalized(point));
+					}
+				}
+			}
+		}
+	});
+
+	m_Baked = std::move(baked);
+
+	m_BakeReport = BakeReport();
+	m_BakeReport.Resolution = resolution;
+	m_BakeReport.Bytes = m_Baked.size() * sizeof(float);
+
+	RandomGenerator random;
+
+	for (size_t i = 0; i < ReportSampleCount; i++)
+	{
+		Vector3 point(random.NextReal(), random.NextReal(), random.NextReal());
+		real error = std::abs(SampleBaked(point) - SampleNormalized(point));
+
+		m_BakeReport.MeanError += error / ReportSampleCount;
+		m_BakeReport.MaxError = std::max(m_BakeReport.MaxError, error);
+	}
+
+	return m_BakeReport;
+}
+
+void re::Noise::ClearBake()
+{
+	m_Baked = std::vector<float>();
+	m_BakeReport = BakeReport();
+}
+
+size_t re::Noise::GetBakeMemoryUsage(unsigned int resolution)
+{
+	size_t size = GetBakeResolution(resolution);
+	return size * size * size * sizeof(float);
+}
+
+re::real re::Noise::SampleBaked(const Vector3 & point) const
+{
+	unsigned int resolution = m_BakeReport.Resolution;
+	size_t bricks = resolution / BrickSize;
+
+	unsigned int i0[3], i1[3];
+	real t[3];
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		real x = point.Elements[axis] * resolution;
+		real cell = std::floor(x);
+
+		t[axis] = x - cell;
+
+		// The point can be 1 after the normalization
+		i0[axis] = static_cast<unsigned int>(cell);
+		i0[axis] = i0[axis] >= resolution ? 0 : i0[axis];
+		i1[axis] = i0[axis] + 1 == resolution ? 0 : i0[axis] + 1;
+	}
+
+	const float * data = m_Baked.data();
+
+	real a = data[GetBakedIndex(i0[0], i0[1], i0[2], bricks)];
+	real b = data[GetBakedIndex(i1[0], i0[1], i0[2], bricks)];
+	real c = data[GetBakedIndex(i0[0], i1[1], i0[2], bricks)];
+	real d = data[GetBakedIndex(i1[0], i1[1], i0[2], bricks)];
+
+	real e = data[GetBakedIndex(i0[0], i0[1], i1[2], bricks)];
+	real f = data[GetBakedIndex(i1[0], i0[1], i1[2], bricks)];
+	real g = data[GetBakedIndex(i0[0], i1[1], i1[2], bricks)];
+	real h = data[GetBakedIndex(i1[0], i1[1], i1[2], bricks)];
+
+	// Trilinear interpolation
+	return Lerp(Lerp(Lerp(a, b, t[0]), Lerp(c, d, t[0]), t[1]), Lerp(Lerp(e, f, t[0]), Lerp(g, h, t[0]), t[1]), t[2]);
+}
@@ -1,16 +1,70 @@
 #pragma once
 #include "../Common.h"
+#include <vector>
 
 namespace re
 {
 	class Noise
 	{
 	public:
+
+		/// Baked values are stored in bricks of BrickSize^3, so that the 8 values of a lookup
+		/// are close in memory
+		static constexpr unsigned int BrickSize = 4;
+
+		/// Baked noise compared with the analytic noise on random points
+		struct BakeReport
+		{
+			unsigned int Resolution = 0;
+			size_t Bytes = 0;
+			real MeanError = 0;
+			real MaxError = 0;
+		};
+
 		Noise(real domainSize) : m_DomainSize(domainSize) {}
+		virtual ~Noise() {}
+
 		real GetDomainSize() { return m_DomainSize; }
 		real Sample(const Vector3& point);
 		virtual real SampleNormalized(const Vector3& point) = 0;
+
+		/// Same as Sample, without the details smaller than the footprint (the size of the area seen
+		/// by the sample, in the units of the point). Baked noises and noises that don't override
+		/// SampleNormalizedFiltered ignore the footprint
+		real SampleFiltered(const Vector3& point, real footprint);
+
+		/// The footprint is normalized like the point. The default implementation calls SampleNormalized
+		virtual real SampleNormalizedFiltered(const Vector3& point, real footprint) { return SampleNormalized(point); }
+
+		/// Same as Sample for every point, out must be as large as points. The points are normalized
+		/// in groups and passed to SampleNormalizedBatch, so the virtual call is made once per group
+		void SampleBatch(Span<const Vector3> points, Span<real> out);
+
+		/// Same as SampleNormalized for every point. The default implementation loops over
+		/// SampleNormalized, noises override it to evaluate several points at once
+		virtual void SampleNormalizedBatch(Span<const Vector3> points, Span<real> out);
+
+		/// Noises that are cheap to evaluate or discontinuous return false, and are not baked by the scene
+		virtual bool IsBakeable() const { return true; }
+
+		/// Samples the noise once on a periodic grid of resolution^3 points (rounded up to a multiple
+		/// of BrickSize), then Sample interpolates the grid instead of evaluating the noise. Nothing is
+		/// done if the noise is already baked at this resolution
+		const BakeReport& Bake(unsigned int resolution);
+		void ClearBake();
+
+		bool IsBaked() const { return !m_Baked.empty(); }
+		const BakeReport& GetBakeReport() const { return m_BakeReport; }
+
+		/// Bytes used by a bake at the given resolution
+		static size_t GetBakeMemoryUsage(unsigned int resolution);
+
 	private:
+		real SampleBaked(const Vector3& point) const;
+
 		real m_DomainSize;
+
+		std::vector<float> m_Baked;
+		BakeReport m_BakeReport;
 	};
-}
\ No newline at end of file
+}
@@ -1,7 +1,30 @@
 #include "Perlin.h"
-#include <random>
 #include <cassert>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+namespace re
+{
+	namespace
+	{
+		inline __m256d Fade(__m256d t)
+		{
+			// t * t * t * (t * (t * 6 - 15) + 10)
+			__m256d p = _mm256_sub_pd(_mm256_mul_pd(t, _mm256_set1_pd(6)), _mm256_set1_pd(15));
+			p = _mm256_add_pd(_mm256_mul_pd(t, p), _mm256_set1_pd(10));
+			return _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(t, t), t), p);
+		}
+
+		inline __m256d Lerp(__m256d a, __m256d b, __m256d t)
+		{
+			// a * (1 - t) + b * t
+			return _mm256_add_pd(_mm256_mul_pd(a, _mm256_sub_pd(_mm256_set1_pd(1), t)), _mm256_mul_pd(b, t));
+		}
+	}
+}
+#endif
+
 re::Perlin::Perlin(real domainSize) : 
 	Noise::Noise(domainSize)
 {
@@ -15,10 +38,21 @@ re::Perlin::~Perlin()
 }
 
 void re::Perlin::NewSeed()
+{
+	FillSeed(GetThreadRandomGenerator());
+}
+
+void re::Perlin::SetSeed(uint64_t seed)
+{
+	RandomGenerator random(seed);
+	FillSeed(random);
+}
+
+void re::Perlin::FillSeed(RandomGenerator& random)
 {
 	for (int i = 0; i < SeedSize; i++)
 	{
-		m_Seed[i] = (rand() % SeedSize);
+		m_Seed[i] = random.NextUInt(SeedSize);
 	}
 }
 
@@ -46,6 +80,36 @@ re::real re::Perlin::SampleNormalized(const Vector3 & position)
 
 }
 
+re::real re::Perlin::SampleNormalizedFiltered(const Vector3 & position, real footprint)
+{
+	// Mean value of GetSeed, and of an octave
+	constexpr real MeanValue = (SeedSize - 1) / (2.0 * SeedSize);
+
+	real amplitude = 1.0f;
+	real amplitudeAcc = 0.0f;
+	real result = 0.0f;
+	unsigned int frequency = SeedSize;
+
+	// Remap the vector and the footprint to seed space
+	Vector3 rpos = position * (real)SeedSize;
+	real width = footprint * SeedSize;
+
+	for (unsigned int i = 0; i < m_Octaves; i++)
+	{
+		real weight = Clamp(2 - 2 * width / frequency, (real)0, (real)1);
+		real sample = weight > 0 ? SampleAtFrequency(rpos, frequency) : 0;
+
+		result += amplitude * (weight * sample + (1 - weight) * MeanValue);
+		frequency = frequency >> 1;
+		amplitudeAcc += amplitude;
+		amplitude *= m_Persistance;
+	}
+
+	result /= amplitudeAcc;
+
+	return result;
+}
+
 re::real re::Perlin::GetSeed(size_t x, size_t y, size_t z) const
 {
 	size_t ix = m_Seed[x % SeedSize];
@@ -81,3 +145,93 @@ re::real re::Perlin::SampleAtFrequency(const Vector3 & position, unsigned int fr
 	// Trilinear interpolation
 	return Lerp(Lerp(Lerp(a, b, u), Lerp(c, d, u), v), Lerp(Lerp(e, f, u), Lerp(g, h, u), v), w);
 }
+
+void re::Perlin::SampleNormalizedBatch(Span<const Vector3> points, Span<real> out)
+{
+#if defined(__AVX2__)
+	const __m128i mask = _mm_set1_epi32(SeedSize - 1);
+	const __m256d seedSize = _mm256_set1_pd(SeedSize);
+
+	// Seed values are integers, the permutation is followed with gathers on 4 lanes
+	auto permute = [&](__m128i index) -> __m128i {
+		return _mm256_cvttpd_epi32(_mm256_i32gather_pd(m_Seed, _mm_and_si128(index, mask), 8));
+	};
+
+	auto seed = [&](__m128i index) -> __m256d {
+		return _mm256_div_pd(_mm256_i32gather_pd(m_Seed, _mm_and_si128(index, mask), 8), seedSize);
+	};
+
+	for (size_t first = 0; first < points.GetSize(); first += 4)
+	{
+		size_t count = std::min<size_t>(4, points.GetSize() - first);
+
+		// The last group is padded with the first point
+		alignas(32) real xs[4], ys[4], zs[4], results[4];
+
+		for (size_t i = 0; i < 4; i++)
+		{
+			const Vector3& point = points[first + (i < count ? i : 0)];
+			xs[i] = point.X;
+			ys[i] = point.Y;
+			zs[i] = point.Z;
+		}
+
+		// Remap the vectors to seed space
+		__m256d x = _mm256_mul_pd(_mm256_load_pd(xs), seedSize);
+		__m256d y = _mm256_mul_pd(_mm256_load_pd(ys), seedSize);
+		__m256d z = _mm256_mul_pd(_mm256_load_pd(zs), seedSize);
+
+		real amplitude = 1.0f;
+		real amplitudeAcc = 0.0f;
+		__m256d result = _mm256_setzero_pd();
+		unsigned int frequency = SeedSize;
+
+		for (unsigned int octave = 0; octave < m_Octaves; octave++)
+		{
+			__m256d cellSize = _mm256_set1_pd(frequency);
+
+			__m256d minX = _mm256_mul_pd(_mm256_floor_pd(_mm256_div_pd(x, cellSize)), cellSize);
+			__m256d minY = _mm256_mul_pd(_mm256_floor_pd(_mm256_div_pd(y, cellSize)), cellSize);
+			__m256d minZ = _mm256_mul_pd(_mm256_floor_pd(_mm256_div_pd(z, cellSize)), cellSize);
+
+			__m128i x0 = _mm256_cvttpd_epi32(minX), x1 = _mm256_cvttpd_epi32(_mm256_add_pd(minX, cellSize));
+			__m128i y0 = _mm256_cvttpd_epi32(minY), y1 = _mm256_cvttpd_epi32(_mm256_add_pd(minY, cellSize));
+			__m128i z0 = _mm256_cvttpd_epi32(minZ), z1 = _mm256_cvttpd_epi32(_mm256_add_pd(minZ, cellSize));
+
+			__m128i ix0 = permute(x0), ix1 = permute(x1);
+
+			__m128i iy00 = permute(_mm_add_epi32(ix0, y0)), iy10 = permute(_mm_add_epi32(ix1, y0));
+			__m128i iy01 = permute(_mm_add_epi32(ix0, y1)), iy11 = permute(_mm_add_epi32(ix1, y1));
+
+			__m256d a = seed(_mm_add_epi32(iy00, z0));
+			__m256d b = seed(_mm_add_epi32(iy10, z0));
+			__m256d c = seed(_mm_add_epi32(iy01, z0));
+			__m256d d = seed(_mm_add_epi32(iy11, z0));
+
+			__m256d e = seed(_mm_add_epi32(iy00, z1));
+			__m256d f = seed(_mm_add_epi32(iy10, z1));
+			__m256d g = seed(_mm_add_epi32(iy01, z1));
+			__m256d h = seed(_mm_add_epi32(iy11, z1));
+
+			__m256d u = Fade(_mm256_div_pd(_mm256_sub_pd(x, minX), cellSize));
+			__m256d v = Fade(_mm256_div_pd(_mm256_sub_pd(y, minY), cellSize));
+			__m256d w = Fade(_mm256_div_pd(_mm256_sub_pd(z, minZ), cellSize));
+
+			// Trilinear interpolation, in the same order as SampleAtFrequency
+			__m256d sample = Lerp(Lerp(Lerp(a, b, u), Lerp(c, d, u), v), Lerp(Lerp(e, f, u), Lerp(g, h, u), v), w);
+
+			result = _mm256_add_pd(result, _mm256_mul_pd(_mm256_set1_pd(amplitude), sample));
+			frequency = frequency >> 1;
+			amplitudeAcc += amplitude;
+			amplitude *= m_Persistance;
+		}
+
+		_mm256_store_pd(results, _mm256_div_pd(result, _mm256_set1_pd(amplitudeAcc)));
+
+		for (size_t i = 0; i < count; i++)
+			out[first + i] = results[i];
+	}
+#else
+	Noise::SampleNormalizedBatch(points, out);
+#endif
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include "Noise.h"
+#include "../Random.h"
 
 namespace re
 {
@@ -9,12 +10,23 @@ namespace re
 	public:
 		Perlin(real domainSize);
 		~Perlin();
+		/// Draws a new permutation from the random generator of the calling thread
 		void NewSeed();
+
+		/// Sets the permutation of the given seed, the same seed always gives the same noise
+		void SetSeed(uint64_t seed);
 		void SetPersistance(real persistance) { m_Persistance = persistance; }
 		void SetOctaves(unsigned int octaves) { m_Octaves = octaves; }
 
 		virtual real SampleNormalized(const Vector3& position) override;
 
+		/// Octaves are faded out when the footprint grows from half of their cell size to the full size,
+		/// and replaced by their mean value. Octaves that are faded out aren't evaluated
+		virtual real SampleNormalizedFiltered(const Vector3& position, real footprint) override;
+
+		/// Evaluates 4 points at once with AVX2, when the library is built with it
+		virtual void SampleNormalizedBatch(Span<const Vector3> points, Span<real> out) override;
+
 	private:
 
 		static constexpr size_t SeedSize = 256;
@@ -26,6 +38,7 @@ namespace re
 		real * m_Seed;
 
 		real GetSeed(size_t x, size_t y, size_t z) const;
+		void FillSeed(RandomGenerator& random);
 		real SampleAtFrequency(const Vector3& position, unsigned int fequency);
 	};
 }
\ No newline at end of file
@@ -1,84 +1,193 @@
 #include "Worley.h"
 
-re::Worley::Worley(real domainSize, int divisions) :  
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+re::Worley::Worley(real domainSize, int divisions) :
+	Noise(domainSize),
+	m_Divisions(divisions)
+{
+	GeneratePoints(GetThreadRandomGenerator());
+}
+
+re::Worley::Worley(real domainSize, int divisions, uint64_t seed) :
 	Noise(domainSize),
 	m_Divisions(divisions)
 {
-	m_Step = 1.0 / divisions;
+	RandomGenerator random(seed);
+	GeneratePoints(random);
+}
+
+void re::Worley::SetFeature(Feature feature)
+{
+	if (feature != m_Feature)
+	{
+		m_Feature = feature;
+		ClearBake();
+	}
+}
+
+void re::Worley::GeneratePoints(RandomGenerator& random)
+{
+	m_Step = 1.0 / m_Divisions;
+	m_PaddedDivisions = m_Divisions + 2;
 
 	auto randomPoint = [&](real x, real y, real z) -> Vector3 {
 		return{
-			Random(x * m_Step, (x + 1) * m_Step),
-			Random(y * m_Step, (y + 1) * m_Step),
-			Random(z * m_Step, (z + 1) * m_Step)
+			random.NextReal(x * m_Step, (x + 1) * m_Step),
+			random.NextReal(y * m_Step, (y + 1) * m_Step),
+			random.NextReal(z * m_Step, (z + 1) * m_Step)
 		};
 	};
 
-	for (int z = 0; z < divisions; z++)
+	std::vector<Vector3> points;
+	points.reserve(m_Divisions * m_Divisions * m_Divisions);
+
+	for (int z = 0; z < m_Divisions; z++)
 	{
-		for (int y = 0; y < divisions; y++)
+		for (int y = 0; y < m_Divisions; y++)
 		{
-			for (int x = 0; x < divisions; x++)
+			for (int x = 0; x < m_Divisions; x++)
 			{
-				m_Points.push_back(randomPoint(x, y, z));
+				points.push_back(randomPoint(x, y, z));
 			}
 		}
 	}
-}
 
-re::real re::Worley::SampleNormalized(const Vector3 & point)
-{
-	real maxDistance = m_Step * std::sqrt(3.0f);
+	// One more value at the end, so that a load of 4 values from the start of a search row
+	// never reads past the arrays
+	size_t size = static_cast<size_t>(m_PaddedDivisions) * m_PaddedDivisions * m_PaddedDivisions + 1;
+	m_X.assign(size, 0);
+	m_Y.assign(size, 0);
+	m_Z.assign(size, 0);
 
-	int x = GetArrayIndex(point.X);
-	int y = GetArrayIndex(point.Y);
-	int z = GetArrayIndex(point.Z);
+	auto wrap = [&](int index, real& offset) -> int {
+		offset = index < 0 ? -1.0 : (index >= m_Divisions ? 1.0 : 0.0);
+		return (index + m_Divisions) % m_Divisions;
+	};
 
-	real distance = std::numeric_limits<float>::max();
-		
-	for (int dx = -1; dx <= 1; dx++)
+	for (int z = -1; z <= m_Divisions; z++)
 	{
-		for (int dy = -1; dy <= 1; dy++)
+		for (int y = -1; y <= m_Divisions; y++)
 		{
-			for (int dz = -1; dz <= 1; dz++)
+			for (int x = -1; x <= m_Divisions; x++)
 			{
-				auto p = GetPointAt(x + dx, y + dy, z + dz);
-				real d = (p - point).SquaredLength();
-				if (d < distance)
-				{
-					distance = d;
-				}
+				real offsetX, offsetY, offsetZ;
+				int wrappedX = wrap(x, offsetX), wrappedY = wrap(y, offsetY), wrappedZ = wrap(z, offsetZ);
+
+				const Vector3& point = points[(wrappedZ * m_Divisions + wrappedY) * m_Divisions + wrappedX];
+				size_t index = GetPaddedIndex(x, y, z);
+
+				m_X[index] = point.X + offsetX;
+				m_Y[index] = point.Y + offsetY;
+				m_Z[index] = point.Z + offsetZ;
 			}
 		}
 	}
+}
 
-	return distance / maxDistance * 10.0f;
-
+int re::Worley::GetCellIndex(real v) const
+{
+	// Normalized points can round up to 1
+	return std::min(std::max(static_cast<int>(v * m_Divisions), 0), m_Divisions - 1);
 }
 
-int re::Worley::GetArrayIndex(real v) const
+size_t re::Worley::GetPaddedIndex(int x, int y, int z) const
 {
-	return (int)(v * m_Divisions);
+	return (static_cast<size_t>(z + 1) * m_PaddedDivisions + (y + 1)) * m_PaddedDivisions + (x + 1);
 }
 
-int re::Worley::WrapIndex(int index) const
+void re::Worley::FindNearest(const Vector3& point, real& f1, real& f2) const
 {
-	while (index < 0) index += m_Divisions;
-	return index % m_Divisions;
+	int x = GetCellIndex(point.X);
+	int y = GetCellIndex(point.Y);
+	int z = GetCellIndex(point.Z);
+
+	f1 = f2 = std::numeric_limits<float>::max();
+
+#if defined(__AVX2__)
+	// The 3 cells of a row along x are contiguous: they are loaded at once, the 4th lane is ignored
+	const __m256d px = _mm256_set1_pd(point.X), py = _mm256_set1_pd(point.Y), pz = _mm256_set1_pd(point.Z);
+	const __m256d far = _mm256_set1_pd(std::numeric_limits<float>::max());
+
+	__m256d nearest = far, secondNearest = far;
+
+	for (int dz = -1; dz <= 1; dz++)
+	{
+		for (int dy = -1; dy <= 1; dy++)
+		{
+			size_t row = GetPaddedIndex(x - 1, y + dy, z + dz);
+
+			__m256d ex = _mm256_sub_pd(_mm256_loadu_pd(m_X.data() + row), px);
+			__m256d ey = _mm256_sub_pd(_mm256_loadu_pd(m_Y.data() + row), py);
+			__m256d ez = _mm256_sub_pd(_mm256_loadu_pd(m_Z.data() + row), pz);
+
+			__m256d d = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ex, ex), _mm256_mul_pd(ey, ey)), _mm256_mul_pd(ez, ez));
+			d = _mm256_blend_pd(d, far, 0x8);
+
+			secondNearest = _mm256_min_pd(secondNearest, _mm256_max_pd(nearest, d));
+			nearest = _mm256_min_pd(nearest, d);
+		}
+	}
+
+	alignas(32) real nearests[4], secondNearests[4];
+	_mm256_store_pd(nearests, nearest);
+	_mm256_store_pd(secondNearests, secondNearest);
+
+	for (size_t i = 0; i < 3; i++)
+	{
+		f2 = std::min(std::min(f2, secondNearests[i]), std::max(f1, nearests[i]));
+		f1 = std::min(f1, nearests[i]);
+	}
+#else
+	for (int dz = -1; dz <= 1; dz++)
+	{
+		for (int dy = -1; dy <= 1; dy++)
+		{
+			size_t row = GetPaddedIndex(x - 1, y + dy, z + dz);
+
+			for (size_t dx = 0; dx < 3; dx++)
+			{
+				real ex = m_X[row + dx] - point.X, ey = m_Y[row + dx] - point.Y, ez = m_Z[row + dx] - point.Z;
+				real d = ex * ex + ey * ey + ez * ez;
+
+				f2 = std::min(f2, std::max(f1, d));
+				f1 = std::min(f1, d);
+			}
+		}
+	}
+#endif
 }
 
-re::Vector3 re::Worley::GetPointAt(int x, int y, int z)
+re::real re::Worley::GetFeatureValue(real f1, real f2) const
 {
-	static auto offset = [&](int v, int divisions) -> int {
-		if (v < 0) return -1;
-		else if (v >= divisions) return 1;
-		else return 0;
-	};
+	real maxDistance = m_Step * std::sqrt(3.0f);
+
+	switch (m_Feature)
+	{
+	case Feature::F2: return f2 / maxDistance * 10.0f;
+	case Feature::F2MinusF1: return (f2 - f1) / maxDistance * 10.0f;
+	default: return f1 / maxDistance * 10.0f;
+	}
+}
 
-	int offsetX = offset(x, m_Divisions),
-		offsetY = offset(y, m_Divisions),
-		offsetZ = offset(z, m_Divisions);
+re::real re::Worley::SampleNormalized(const Vector3 & point)
+{
+	real f1, f2;
+	FindNearest(point, f1, f2);
+	return GetFeatureValue(f1, f2);
+}
 
-	return m_Points[WrapIndex(z) * m_Divisions * m_Divisions + WrapIndex(y) * m_Divisions + WrapIndex(x)] +
-		Vector3(offsetX, offsetY, offsetZ);
+void re::Worley::SampleNormalizedBatch(Span<const Vector3> points, Span<real> out)
+{
+	// Each search is already vectorized, the batch only saves the virtual calls
+	for (size_t i = 0; i < points.GetSize(); i++)
+	{
+		real f1, f2;
+		FindNearest(points[i], f1, f2);
+		out[i] = GetFeatureValue(f1, f2);
+	}
 }
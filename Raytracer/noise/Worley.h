@@ -2,22 +2,52 @@
 
 #include "Noise.h"
 #include "../Common.h"
+#include "../Random.h"
 #include <memory>
 namespace re
 {
 	class Worley : public Noise
 	{
 	public:
+		/// Distance returned by the noise: to the nearest point, to the second nearest point, or the
+		/// difference of the two (which is 0 on the edges between cells). The search is limited to the
+		/// 27 neighbouring cells, so F2 is rarely slightly larger than the exact distance
+		enum class Feature { F1, F2, F2MinusF1 };
+
+		/// The points are drawn from the random generator of the calling thread
 		Worley(real domainSize, int divisions);
+
+		/// The same seed always gives the same points
+		Worley(real domainSize, int divisions, uint64_t seed);
+
+		/// Clears the bake, since the baked values are of the previous feature
+		void SetFeature(Feature feature);
+		Feature GetFeature() const { return m_Feature; }
+
+		/// Searches the 27 neighbouring cells 4 points at a time with AVX2, when the library is built with it
 		virtual real SampleNormalized(const Vector3& point) override;
+
+		virtual void SampleNormalizedBatch(Span<const Vector3> points, Span<real> out) override;
 	private:
 
-		int GetArrayIndex(real v) const;
-		int WrapIndex(int index) const;
-		Vector3 GetPointAt(int x, int y, int z);
+		void GeneratePoints(RandomGenerator& random);
+
+		int GetCellIndex(real v) const;
+
+		/// Index in the padded grid, cells go from -1 to m_Divisions on each axis
+		size_t GetPaddedIndex(int x, int y, int z) const;
+
+		/// Squared distances to the nearest and second nearest points
+		void FindNearest(const Vector3& point, real& f1, real& f2) const;
+		real GetFeatureValue(real f1, real f2) const;
+
+		// The points of a grid with one more cell on every side, the border cells hold the points
+		// of the other side moved by one period, so the search never wraps. Stored by coordinate
+		std::vector<real> m_X, m_Y, m_Z;
 
-		std::vector<Vector3> m_Points;
 		int m_Divisions;
+		int m_PaddedDivisions;
 		real m_Step;
+		Feature m_Feature = Feature::F1;
 	};
-}
\ No newline at end of file
+}
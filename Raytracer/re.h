@@ -1,7 +1,14 @@
 #pragma once
 
 #include "Common.h"
+#include "Arena.h"
+#include "Random.h"
 #include "Scene.h"
+#include "EnvironmentMap.h"
+#include "Texture.h"
+#include "Mesh.h"
+#include "SphereCloud.h"
+#include "Primitives.h"
 #include "Raytracer.h"
 #include "Material.h"
 #include "noise/Noise.h"
@@ -0,0 +1,135 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sb
+{
+	MappedFile::~MappedFile()
+	{
+		Close();
+	}
+
+#ifdef _WIN32
+
+	bool MappedFile::Open(const std::string& fileName)
+	{
+		Close();
+
+		HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size))
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		m_File = file;
+		m_Size = static_cast<size_t>(size.QuadPart);
+		m_Open = true;
+
+		// Empty files can't be mapped
+		if (m_Size == 0)
+			return true;
+
+		m_Mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+		if (m_Mapping != nullptr)
+			m_Data = static_cast<const char*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+
+		if (m_Data == nullptr)
+		{
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void MappedFile::Close()
+	{
+		if (m_Data != nullptr)
+			UnmapViewOfFile(m_Data);
+
+		if (m_Mapping != nullptr)
+			CloseHandle(m_Mapping);
+
+		if (m_File != nullptr)
+			CloseHandle(m_File);
+
+		m_Data = nullptr;
+		m_Mapping = nullptr;
+		m_File = nullptr;
+		m_Size = 0;
+		m_Open = false;
+	}
+
+#else
+
+	bool MappedFile::Open(const std::string& fileName)
+	{
+		Close();
+
+		int file = open(fileName.c_str(), O_RDONLY);
+
+		if (file < 0)
+			return false;
+
+		struct stat info;
+		if (fstat(file, &info) != 0)
+		{
+			close(file);
+			return false;
+		}
+
+		m_File = file;
+		m_Size = static_cast<size_t>(info.st_size);
+		m_Open = true;
+
+		// Empty files can't be mapped
+		if (m_Size == 0)
+			return true;
+
+		void * data = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, file, 0);
+
+		if (data == MAP_FAILED)
+		{
+			Close();
+			return false;
+		}
+
+		madvise(data, m_Size, MADV_SEQUENTIAL);
+		m_Data = static_cast<const char*>(data);
+
+		return true;
+	}
+
+	void MappedFile::Close()
+	{
+		if (m_Data != nullptr)
+			munmap(const_cast<char*>(m_Data), m_Size);
+
+		if (m_File >= 0)
+			close(m_File);
+
+		m_Data = nullptr;
+		m_File = -1;
+		m_Size = 0;
+		m_Open = false;
+	}
+
+#endif
+}
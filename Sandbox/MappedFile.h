@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+namespace sb
+{
+	/// A read-only memory mapped file
+	class MappedFile
+	{
+	public:
+
+		MappedFile() {}
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		/// Maps the whole file in memory. Returns false if the file can't be opened
+		bool Open(const std::string& fileName);
+		void Close();
+
+		bool IsOpen() const { return m_Open; }
+
+		const char * GetData() const { return m_Data; }
+		size_t GetSize() const { return m_Size; }
+
+	private:
+		bool m_Open = false;
+		const char * m_Data = nullptr;
+		size_t m_Size = 0;
+
+#ifdef _WIN32
+		void * m_File = nullptr;
+		void * m_Mapping = nullptr;
+#else
+		int m_File = -1;
+#endif
+	};
+}
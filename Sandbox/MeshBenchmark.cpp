@@ -0,0 +1,76 @@
+#include "MeshBenchmark.h"
+
+#include <chrono>
+#include <random>
+
+namespace sb
+{
+	std::vector<MeshBenchmarkResult> BenchmarkMesh(re::MeshAsset& asset, size_t rayCount)
+	{
+		const re::NodeFormats formats[] = { re::NodeFormats::Full, re::NodeFormats::Quantized16, re::NodeFormats::Quantized8 };
+		const auto originalFormat = asset.GetNodeFormat();
+
+		std::vector<MeshBenchmarkResult> results;
+
+		asset.Compile();
+
+		// Rays start on a sphere around the mesh and aim at random points inside its bounds
+		const auto& bounds = asset.GetBoundingBox();
+		re::Vector3 center = (bounds.Min + bounds.Max) * 0.5;
+		re::real radius = (bounds.Max - bounds.Min).Length();
+
+		std::mt19937 generator(1234);
+		std::uniform_real_distribution<re::real> distribution(0, 1);
+		auto random = [&]() { return distribution(generator); };
+
+		std::vector<re::Ray> rays(rayCount);
+
+		for (auto& ray : rays)
+		{
+			re::Vector3 direction = re::Vector3(random() * 2 - 1, random() * 2 - 1, random() * 2 - 1).Normalized();
+			re::Vector3 target = bounds.Min + (bounds.Max - bounds.Min) * re::Vector3(random(), random(), random());
+
+			ray.Origin = center + direction * radius;
+			ray.Direction = (target - ray.Origin).Normalized();
+		}
+
+		for (auto format : formats)
+		{
+			asset.SetNodeFormat(format);
+			asset.Compile();
+
+			size_t hits = 0;
+			auto start = std::chrono::high_resolution_clock::now();
+
+			for (auto& ray : rays)
+				if (asset.Intersect(ray, re::NormalModes::Face).Hit)
+					hits++;
+
+			std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+			MeshBenchmarkResult result;
+			result.Format = format;
+			result.TriangleCount = asset.GetTriangleCount();
+			result.Bytes = asset.GetMemoryUsage();
+			result.AccelerationBytes = asset.GetAccelerationMemoryUsage();
+			result.RaysPerSecond = elapsed.count() > 0 ? rays.size() / elapsed.count() : 0;
+			result.Hits = hits;
+			results.push_back(result);
+		}
+
+		asset.SetNodeFormat(originalFormat);
+		asset.Compile();
+
+		return results;
+	}
+
+	const char * GetNodeFormatName(re::NodeFormats format)
+	{
+		switch (format)
+		{
+		case re::NodeFormats::Quantized16: return "Quantized 16 bit";
+		case re::NodeFormats::Quantized8: return "Quantized 8 bit";
+		default: return "Full";
+		}
+	}
+}
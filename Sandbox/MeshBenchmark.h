@@ -0,0 +1,23 @@
+#pragma once
+
+#include "re.h"
+#include <vector>
+
+namespace sb
+{
+	struct MeshBenchmarkResult
+	{
+		re::NodeFormats Format;
+		size_t TriangleCount;
+		size_t Bytes, AccelerationBytes;
+		double RaysPerSecond;
+		size_t Hits;
+	};
+
+	/// Compiles the asset with every node format and measures memory and intersection speed
+	/// with the same set of random rays. The original format is restored at the end. The asset
+	/// must not be in use by a renderer
+	std::vector<MeshBenchmarkResult> BenchmarkMesh(re::MeshAsset& asset, size_t rayCount);
+
+	const char * GetNodeFormatName(re::NodeFormats format);
+}
@@ -0,0 +1,271 @@
+#include "MeshCache.h"
+#include "MappedFile.h"
+#include "WavefrontLoader.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+namespace sb
+{
+	namespace
+	{
+		constexpr uint64_t HashOffset = 14695981039346656037ull;
+		constexpr uint64_t HashPrime = 1099511628211ull;
+
+		/// FNV-1a on 64 bit words, good enough to detect changes in the source file
+		uint64_t Hash(const char * data, size_t size, uint64_t hash = HashOffset)
+		{
+			size_t i = 0;
+
+			for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+			{
+				uint64_t word;
+				std::memcpy(&word, data + i, sizeof(word));
+				hash = (hash ^ word) * HashPrime;
+			}
+
+			for (; i < size; i++)
+				hash = (hash ^ static_cast<unsigned char>(data[i])) * HashPrime;
+
+			return hash;
+		}
+
+		/// Every node format has its own file, so switching formats doesn't overwrite the cache of
+		/// the others, or a file that is still mapped by another asset
+		std::string GetCacheFileName(const std::string& fileName, const std::string& group, re::NodeFormats nodeFormat)
+		{
+			std::string safeGroup = group;
+
+			for (auto& c : safeGroup)
+				if (!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-')
+					c = '_';
+
+			const char * format = "full";
+
+			switch (nodeFormat)
+			{
+			case re::NodeFormats::Quantized16: format = "q16"; break;
+			case re::NodeFormats::Quantized8: format = "q8"; break;
+			default: break;
+			}
+
+			return fileName + "." + safeGroup + "." + format + ".cache";
+		}
+
+		/// Writes to a temporary file first, so that a failed write never leaves a broken cache
+		template<typename Writer>
+		void SaveCacheFile(const std::string& cacheFileName, Writer&& write)
+		{
+			auto tempFileName = cacheFileName + ".tmp";
+			bool saved;
+
+			{
+				std::ofstream os(tempFileName, std::ios::binary | std::ios::trunc);
+				saved = os.is_open() && write(os);
+			}
+
+			std::remove(cacheFileName.c_str());
+
+			if (!saved || std::rename(tempFileName.c_str(), cacheFileName.c_str()) != 0)
+				std::remove(tempFileName.c_str());
+		}
+
+		/// Skips the whitespace and the comments of a PPM header, then reads a number
+		bool ReadPpmNumber(const char *& data, const char * end, uint32_t& value)
+		{
+			while (data < end && (isspace(static_cast<unsigned char>(*data)) || *data == '#'))
+			{
+				if (*data == '#')
+					while (data < end && *data != '\n') data++;
+				else
+					data++;
+			}
+
+			if (data == end || !isdigit(static_cast<unsigned char>(*data)))
+				return false;
+
+			value = 0;
+
+			while (data < end && isdigit(static_cast<unsigned char>(*data)) && value < 0x10000)
+				value = value * 10 + (*data++ - '0');
+
+			return true;
+		}
+
+		/// Reads a binary PPM (P6) with 8 bits per channel
+		bool LoadPpm(const MappedFile& file, uint32_t& width, uint32_t& height, const uint8_t *& rgb)
+		{
+			const char * data = file.GetData();
+			const char * end = data + file.GetSize();
+			uint32_t maxValue;
+
+			if (file.GetSize() < 2 || data[0] != 'P' || data[1] != '6')
+				return false;
+
+			data += 2;
+
+			if (!ReadPpmNumber(data, end, width) || !ReadPpmNumber(data, end, height) ||
+				!ReadPpmNumber(data, end, maxValue) || maxValue != 255 || width == 0 || height == 0)
+				return false;
+
+			// A single whitespace before the texels
+			data++;
+
+			if (end - data < static_cast<ptrdiff_t>(width) * height * 3)
+				return false;
+
+			rgb = reinterpret_cast<const uint8_t*>(data);
+			return true;
+		}
+
+		std::shared_ptr<re::MeshAsset> BuildMesh(const WfData& wfData, const std::string& group, re::NodeFormats nodeFormat)
+		{
+			auto wfGroup = wfData.Groups.find(group);
+
+			if (wfGroup == wfData.Groups.end())
+				return nullptr;
+
+			// Obj faces index positions, normals and texture coordinates separately: every
+			// distinct combination becomes a vertex of the mesh
+			struct IndexHash
+			{
+				size_t operator()(const WfIndex& index) const
+				{
+					return std::hash<uint64_t>()((uint64_t(uint32_t(index.Position)) << 32) ^
+						(uint64_t(uint32_t(index.Normal)) << 16) ^ uint64_t(uint32_t(index.TexCoord)));
+				}
+			};
+
+			struct IndexEqual
+			{
+				bool operator()(const WfIndex& a, const WfIndex& b) const
+				{
+					return a.Position == b.Position && a.Normal == b.Normal && a.TexCoord == b.TexCoord;
+				}
+			};
+
+			const auto& faceIndices = wfGroup->second;
+
+			std::unordered_map<WfIndex, uint32_t, IndexHash, IndexEqual> vertexMap;
+			vertexMap.reserve(faceIndices.size() / 2);
+
+			std::vector<WfIndex> vertices;
+			std::vector<uint32_t> indices;
+			indices.reserve(faceIndices.size());
+
+			bool hasNormals = false, hasTexCoords = false;
+
+			for (auto& index : faceIndices)
+			{
+				auto it = vertexMap.emplace(index, static_cast<uint32_t>(vertices.size()));
+
+				if (it.second)
+				{
+					vertices.push_back(index);
+					hasNormals |= index.Normal != -1;
+					hasTexCoords |= index.TexCoord != -1;
+				}
+
+				indices.push_back(it.first->second);
+			}
+
+			std::vector<re::Vector3> positions(vertices.size());
+			std::vector<re::Vector3> normals(hasNormals ? vertices.size() : 0);
+			std::vector<re::Vector2> texCoords(hasTexCoords ? vertices.size() : 0);
+
+			for (size_t i = 0; i < vertices.size(); i++)
+			{
+				positions[i] = wfData.Positions[vertices[i].Position];
+
+				if (hasNormals)
+					normals[i] = vertices[i].Normal != -1 ? wfData.Normals[vertices[i].Normal] : re::Vector3::Zero;
+
+				if (hasTexCoords)
+					texCoords[i] = vertices[i].TexCoord != -1 ? wfData.TexCoords[vertices[i].TexCoord] : re::Vector2::Zero;
+			}
+
+			auto asset = std::make_shared<re::MeshAsset>();
+			asset->SetPositions(std::move(positions));
+			asset->SetNormals(std::move(normals));
+			asset->SetTexCoords(std::move(texCoords));
+			asset->SetIndices(std::move(indices));
+			asset->SetNodeFormat(nodeFormat);
+			asset->Compile();
+
+			return asset;
+		}
+	}
+
+	std::shared_ptr<re::MeshAsset> LoadCachedMesh(const std::string& fileName, const std::string& group, re::NodeFormats nodeFormat)
+	{
+		uint64_t key;
+
+		{
+			MappedFile source;
+
+			if (!source.Open(fileName))
+				return BuildMesh(LoadWavefront(fileName), group, nodeFormat);
+
+			uint32_t settings[] = { re::MeshAsset::FileVersion, static_cast<uint32_t>(nodeFormat) };
+			key = Hash(source.GetData(), source.GetSize());
+			key = Hash(group.data(), group.size(), key);
+			key = Hash(reinterpret_cast<const char*>(settings), sizeof(settings), key);
+		}
+
+		auto cacheFileName = GetCacheFileName(fileName, group, nodeFormat);
+
+		// The mapped file is kept alive by the asset, which uses the data in place
+		{
+			auto cache = std::make_shared<MappedFile>();
+
+			if (cache->Open(cacheFileName))
+			{
+				auto asset = std::make_shared<re::MeshAsset>();
+				std::shared_ptr<const void> storage(cache, cache->GetData());
+
+				if (asset->Load(cache->GetData(), cache->GetSize(), key, storage))
+					return asset;
+			}
+		}
+
+		auto asset = BuildMesh(LoadWavefront(fileName), group, nodeFormat);
+
+		if (asset == nullptr)
+			return nullptr;
+
+		SaveCacheFile(cacheFileName, [&](std::ostream& os) { return asset->Save(os, key); });
+
+		return asset;
+	}
+
+	std::shared_ptr<re::Texture> LoadCachedTexture(const std::string& fileName)
+	{
+		MappedFile source;
+
+		if (!source.Open(fileName))
+			return nullptr;
+
+		uint32_t version = re::Texture::FileVersion;
+		uint64_t key = Hash(source.GetData(), source.GetSize());
+		key = Hash(reinterpret_cast<const char*>(&version), sizeof(version), key);
+
+		auto cacheFileName = fileName + ".texture";
+		auto texture = re::Texture::Open(cacheFileName, key);
+
+		if (texture != nullptr)
+			return texture;
+
+		uint32_t width, height;
+		const uint8_t * rgb;
+
+		if (!LoadPpm(source, width, height, rgb))
+			return nullptr;
+
+		SaveCacheFile(cacheFileName, [&](std::ostream& os) { return re::Texture::Save(os, width, height, rgb, key); });
+
+		return re::Texture::Open(cacheFileName, key);
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "re.h"
+#include <memory>
+#include <string>
+
+namespace sb
+{
+	/// Loads a group of a Wavefront .obj file as a compiled MeshAsset. The compiled asset is
+	/// cached in "<file>.<group>.<node format>.cache" and memory mapped on the next loads, so the
+	/// obj file isn't parsed and the KD-tree isn't rebuilt. The cache is regenerated when the obj
+	/// file or the mesh format changes. Returns nullptr if the group doesn't exist
+	std::shared_ptr<re::MeshAsset> LoadCachedMesh(const std::string& fileName, const std::string& group,
+		re::NodeFormats nodeFormat = re::NodeFormats::Full);
+
+	/// Loads a binary PPM image (P6, 8 bits per channel) as a texture. The mip pyramid is written in
+	/// tiles to "<file>.texture" the first time, then only the tiles that are sampled are read (see
+	/// re::Texture). The file is regenerated when the image changes. Returns nullptr if the image
+	/// can't be read
+	std::shared_ptr<re::Texture> LoadCachedTexture(const std::string& fileName);
+}
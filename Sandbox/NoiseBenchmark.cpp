@@ -0,0 +1,62 @@
+#include "NoiseBenchmark.h"
+
+#include <chrono>
+
+namespace sb
+{
+	std::vector<NoiseBenchmarkResult> BenchmarkNoises(size_t sampleCount)
+	{
+		const std::pair<const char *, std::shared_ptr<re::Noise>> noises[] = {
+			{ "Perlin", std::make_shared<re::Perlin>(2) },
+			{ "Marble", std::make_shared<re::Marble>(2, 2, 4) },
+			{ "Worley", std::make_shared<re::Worley>(2, 10) },
+			{ "Worley F2-F1", std::make_shared<re::Worley>(2, 10) },
+			{ "CheckerBoard", std::make_shared<re::CheckerBoard>(16) },
+		};
+
+		std::static_pointer_cast<re::Worley>(noises[3].second)->SetFeature(re::Worley::Feature::F2MinusF1);
+
+		re::RandomGenerator random(1234);
+
+		std::vector<re::Vector3> points(sampleCount);
+
+		for (auto& point : points)
+			point = { random.NextReal(-10, 10), random.NextReal(-10, 10), random.NextReal(-10, 10) };
+
+		std::vector<re::real> samples(sampleCount), batchSamples(sampleCount);
+
+		auto perSecond = [&](std::chrono::duration<double> elapsed) {
+			return elapsed.count() > 0 ? sampleCount / elapsed.count() : 0;
+		};
+
+		std::vector<NoiseBenchmarkResult> results;
+
+		for (auto& noise : noises)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+
+			for (size_t i = 0; i < sampleCount; i++)
+				samples[i] = noise.second->Sample(points[i]);
+
+			auto middle = std::chrono::high_resolution_clock::now();
+
+			noise.second->SampleBatch(re::Span<const re::Vector3>(points.data(), points.size()),
+				re::Span<re::real>(batchSamples.data(), batchSamples.size()));
+
+			auto end = std::chrono::high_resolution_clock::now();
+
+			NoiseBenchmarkResult result;
+			result.Name = noise.first;
+			result.SamplesPerSecond = perSecond(middle - start);
+			result.BatchSamplesPerSecond = perSecond(end - middle);
+			result.MaxDifference = 0;
+
+			for (size_t i = 0; i < sampleCount; i++)
+				result.MaxDifference = std::max(result.MaxDifference, std::abs(samples[i] - batchSamples[i]));
+
+			results.push_back(result);
+		}
+
+		return results;
+	}
+}
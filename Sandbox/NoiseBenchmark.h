@@ -0,0 +1,18 @@
+#pragma once
+
+#include "re.h"
+#include <vector>
+
+namespace sb
+{
+	struct NoiseBenchmarkResult
+	{
+		const char * Name;
+		double SamplesPerSecond, BatchSamplesPerSecond;
+		re::real MaxDifference;
+	};
+
+	/// Samples each noise type on the same random points, one point at a time and with
+	/// SampleBatch. The difference between the two must be 0
+	std::vector<NoiseBenchmarkResult> BenchmarkNoises(size_t sampleCount);
+}
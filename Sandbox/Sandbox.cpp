@@ -1,6 +1,6 @@
 #include "Sandbox.h"
 
-#include "WavefrontLoader.h"
+#include "MeshCache.h"
 
 #include <chrono>
 #include <fstream>
@@ -320,6 +320,11 @@ void sb::Sandbox::Update(float dt)
 
 		m_Raytracer->Antialiasing = Settings.Antialiasing;
 		m_Raytracer->MaxRecursion = Settings.MaxRecursion;
+		m_Raytracer->FilterNoises = Settings.FilterNoises;
+		m_Raytracer->LightSamples = Settings.LightSamples;
+		m_Raytracer->Passes = Settings.Passes;
+		m_Scene->NoiseBake.Resolution = Settings.NoiseBakeResolution;
+		m_Scene->EnvironmentBake.Resolution = Settings.EnvironmentBakeResolution;
 	}
 
 	auto right = re::Cross(m_Scene->Camera.Direction, re::Vector3::Up);
@@ -354,9 +359,13 @@ void sb::Sandbox::Update(float dt)
 	{
 		m_SceneDirty = false;
 		m_ValidRender = false;
-		m_Raytracer->Interrupt();
+
+		// Compiling the scene again frees the data the render threads are reading, they must be
+		// done before
+		StopRaytracer();
 
 		unsigned int * pixels = m_Raycaster->RenderSync(m_Scene.get());
+		m_MemoryReport = m_Scene->GetMemoryReport();
 		glBindTexture(GL_TEXTURE_2D, m_FastTexture);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_Raycaster->GetViewWidth(), m_Raycaster->GetViewHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
 	}
@@ -364,10 +373,12 @@ void sb::Sandbox::Update(float dt)
 	{
 		auto status = m_Raytracer->GetStatus();
 
-		if (!m_ValidRender && status.Finished && !status.Interruped)
+		// The image is shown after each pass, while the next ones are rendered
+		if (!status.Interruped && status.CompletedPasses > m_DisplayedPasses)
 		{
 			glBindTexture(GL_TEXTURE_2D, m_Texture);
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_Raytracer->GetViewWidth(), m_Raytracer->GetViewHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, status.Pixels);
+			m_DisplayedPasses = status.CompletedPasses;
 			m_ValidRender = true;
 		}
 	}
@@ -428,13 +439,64 @@ void sb::Sandbox::Render(float dt)
 
 						ImGui::InputFloat3("Camera position", cameraPos, 3, ImGuiInputTextFlags_ReadOnly);
 						ImGui::InputFloat3("Look direction", lookDir, 3, ImGuiInputTextFlags_ReadOnly);
+
+						auto& memory = m_MemoryReport;
+						ImGui::Text("Instances: %zu (%zu bytes each)", memory.InstanceCount,
+							memory.InstanceCount > 0 ? memory.InstanceBytes / memory.InstanceCount : 0);
+						ImGui::Text("Shared meshes: %zu (%.2f MB)", memory.SharedGeometryCount, memory.SharedGeometryBytes / (1024.0 * 1024.0));
+						ImGui::Text("Compiled materials: %zu (%zu bytes)", memory.CompiledMaterialCount, memory.CompiledMaterialBytes);
+						ImGui::Text("Baked noises: %zu (%.2f MB, max error %.4f)", memory.BakedNoiseCount,
+							memory.BakedNoiseBytes / (1024.0 * 1024.0), memory.BakedNoiseMaxError);
+						ImGui::Text("Environment map: %.2f MB", memory.EnvironmentMapBytes / (1024.0 * 1024.0));
+
+						auto textureCache = re::TextureCache::GetDefault().GetStatistics();
+						size_t textureLookups = textureCache.Hits + textureCache.Misses;
+						ImGui::Text("Texture cache: %zu tiles (%.2f MB), %.1f%% hits", textureCache.TileCount,
+							textureCache.Bytes / (1024.0 * 1024.0), textureLookups > 0 ? 100.0 * textureCache.Hits / textureLookups : 0.0);
 					}
 
 					if (ImGui::CollapsingHeader("Options", ImGuiTreeNodeFlags_DefaultOpen))
 					{
 						ImGui::Combo("Antialiasing", (int*)&Settings.Antialiasing, "None\0SSAA");
 						ImGui::SliderInt("Max Recursion", &Settings.MaxRecursion, 0, 3);
+
+						static constexpr unsigned int lightSamples[] = { 0, 1, 4, 16 };
+						int lightSample = static_cast<int>(std::find(std::begin(lightSamples), std::end(lightSamples),
+							Settings.LightSamples) - std::begin(lightSamples));
+
+						if (ImGui::Combo("Light Samples", &lightSample, "All\0" "1\0" "4\0" "16\0"))
+							Settings.LightSamples = lightSamples[lightSample];
+
+						ImGui::SliderInt("Passes", &Settings.Passes, 1, 64);
+
+						if (ImGui::Checkbox("Filter Noises", &Settings.FilterNoises))
+							m_SceneDirty = true;
+
 						ImGui::Combo("Fast Raycaster Mode", (int*)(&m_Raycaster->Mode), "Normal\0Color");
+
+						int nodeFormat = static_cast<int>(Settings.MeshNodeFormat);
+						if (ImGui::Combo("Mesh Node Format", &nodeFormat, "Full\0Quantized 16 bit\0Quantized 8 bit\0"))
+							SetMeshNodeFormat(static_cast<re::NodeFormats>(nodeFormat));
+
+						static constexpr unsigned int bakeResolutions[] = { 0, 64, 128, 256 };
+						int bakeResolution = static_cast<int>(std::find(std::begin(bakeResolutions), std::end(bakeResolutions),
+							Settings.NoiseBakeResolution) - std::begin(bakeResolutions));
+
+						if (ImGui::Combo("Noise Bake", &bakeResolution, "Off\0" "64\0" "128\0" "256\0"))
+						{
+							Settings.NoiseBakeResolution = bakeResolutions[bakeResolution];
+							m_SceneDirty = true;
+						}
+
+						static constexpr unsigned int environmentResolutions[] = { 0, 128, 256, 512 };
+						int environmentResolution = static_cast<int>(std::find(std::begin(environmentResolutions), std::end(environmentResolutions),
+							Settings.EnvironmentBakeResolution) - std::begin(environmentResolutions));
+
+						if (ImGui::Combo("Environment Bake", &environmentResolution, "Off\0" "128\0" "256\0" "512\0"))
+						{
+							Settings.EnvironmentBakeResolution = environmentResolutions[environmentResolution];
+							m_SceneDirty = true;
+						}
 					}
 
 					auto status = m_Raytracer->GetStatus();
@@ -447,7 +509,69 @@ void sb::Sandbox::Render(float dt)
 					}
 					else
 					{
-						ImGui::ProgressBar(status.Percent);
+						auto progress = TsPrintf("Pass %u of %d", status.CompletedPasses + 1, Settings.Passes);
+						ImGui::ProgressBar(status.Percent, { -1, 0 }, Settings.Passes > 1 ? progress.c_str() : nullptr);
+					}
+
+					ImGui::EndTabItem();
+				}
+				if (ImGui::BeginTabItem("Benchmark"))
+				{
+					ImGui::TextWrapped("Compares the mesh node formats on every mesh of the scene, with the same random rays");
+
+					if (ImGui::Button("Run Mesh Benchmark", { ImGui::GetContentRegionAvailWidth(), 0 }))
+						RunMeshBenchmark();
+
+					for (size_t i = 0; i < m_MeshBenchmarkResults.size(); i++)
+					{
+						auto& results = m_MeshBenchmarkResults[i];
+
+						if (results.empty())
+							continue;
+
+						ImGui::Separator();
+						ImGui::Text("Mesh %zu: %zu triangles", i, results.front().TriangleCount);
+						ImGui::Columns(4, nullptr, false);
+						ImGui::Text("Format"); ImGui::NextColumn();
+						ImGui::Text("Bytes/tri"); ImGui::NextColumn();
+						ImGui::Text("Nodes bytes/tri"); ImGui::NextColumn();
+						ImGui::Text("Rays/s"); ImGui::NextColumn();
+
+						for (auto& result : results)
+						{
+							auto triangles = std::max<size_t>(result.TriangleCount, 1);
+							ImGui::Text("%s", GetNodeFormatName(result.Format)); ImGui::NextColumn();
+							ImGui::Text("%.1f", double(result.Bytes) / triangles); ImGui::NextColumn();
+							ImGui::Text("%.1f", double(result.AccelerationBytes) / triangles); ImGui::NextColumn();
+							ImGui::Text("%.0f", result.RaysPerSecond); ImGui::NextColumn();
+						}
+
+						ImGui::Columns(1);
+					}
+
+					ImGui::Separator();
+					ImGui::TextWrapped("Samples every noise type one point at a time and in batch");
+
+					if (ImGui::Button("Run Noise Benchmark", { ImGui::GetContentRegionAvailWidth(), 0 }))
+						m_NoiseBenchmarkResults = BenchmarkNoises(1000000);
+
+					if (!m_NoiseBenchmarkResults.empty())
+					{
+						ImGui::Columns(4, nullptr, false);
+						ImGui::Text("Noise"); ImGui::NextColumn();
+						ImGui::Text("Samples/s"); ImGui::NextColumn();
+						ImGui::Text("Batch samples/s"); ImGui::NextColumn();
+						ImGui::Text("Max difference"); ImGui::NextColumn();
+
+						for (auto& result : m_NoiseBenchmarkResults)
+						{
+							ImGui::Text("%s", result.Name); ImGui::NextColumn();
+							ImGui::Text("%.0f", result.SamplesPerSecond); ImGui::NextColumn();
+							ImGui::Text("%.0f", result.BatchSamplesPerSecond); ImGui::NextColumn();
+							ImGui::Text("%g", result.MaxDifference); ImGui::NextColumn();
+						}
+
+						ImGui::Columns(1);
 					}
 
 					ImGui::EndTabItem();
@@ -559,6 +683,44 @@ void sb::Sandbox::StartRaytracer()
 	m_RaytracerFuture = p.get_future();
 	m_Raytracer->Render(m_Scene.get(), std::move(p));
 	m_ValidRender = false;
+	m_DisplayedPasses = 0;
+}
+
+void sb::Sandbox::StopRaytracer()
+{
+	m_Raytracer->Interrupt();
+
+	if (m_RaytracerFuture.valid())
+		m_RaytracerFuture.wait();
+}
+
+void sb::Sandbox::SetMeshNodeFormat(re::NodeFormats format)
+{
+	StopRaytracer();
+
+	Settings.MeshNodeFormat = format;
+
+	for (auto& asset : m_MeshAssets)
+	{
+		asset->SetNodeFormat(format);
+		asset->Compile();
+	}
+
+	m_SceneDirty = true;
+}
+
+void sb::Sandbox::RunMeshBenchmark()
+{
+	constexpr size_t RayCount = 10000;
+
+	StopRaytracer();
+
+	m_MeshBenchmarkResults.clear();
+
+	for (auto& asset : m_MeshAssets)
+		m_MeshBenchmarkResults.push_back(BenchmarkMesh(*asset, RayCount));
+
+	m_SceneDirty = true;
 }
 
 std::pair<re::real,re::real> sb::Sandbox::GetCursorPos()
@@ -586,9 +748,13 @@ void sb::Sandbox::UpdateScene()
 		m_CameraDir = CameraDir();
 
 		m_Noises.clear();
+		m_Textures.clear();
 		m_Materials.clear();
+		m_MeshAssets.clear();
+		m_MeshBenchmarkResults.clear();
+		m_MeshAssetNames.clear();
 
-		re::Vector3 position, scale = { 1,1,1 };
+		re::Vector3 position, rotation, scale = { 1,1,1 };
 		
 
 		// Materials
@@ -611,6 +777,24 @@ void sb::Sandbox::UpdateScene()
 			return m_Materials.size() - 1;
 		});
 
+		state.set("reTextureMaterial", [&](int texture, re::real absorptance) -> int {
+			CheckSize(m_Textures, texture, "Invalid texture: %d", texture);
+
+			m_Materials.push_back(std::make_shared<re::TextureMaterial>(m_Textures[texture], absorptance));
+			return m_Materials.size() - 1;
+		});
+
+		// Textures, see LoadCachedTexture
+		state.set("reTexture", [&](std::string file) -> int {
+			auto texture = LoadCachedTexture(file);
+
+			if (texture == nullptr)
+				throw std::exception(TsPrintf("Invalid texture: %s", file.c_str()).c_str());
+
+			m_Textures.push_back(texture);
+			return m_Textures.size() - 1;
+		});
+
 		// Noises
 
 		state.set("reCheckerBoard", [&](re::real domainSize) -> int {
@@ -628,6 +812,17 @@ void sb::Sandbox::UpdateScene()
 			return m_Noises.size() - 1;
 		});
 
+		// Feature: 0 is the distance to the nearest point, 1 to the second nearest, 2 the difference
+		state.set("reWorleyFeature", [&](re::real domainSize, int divisions, int feature) -> int {
+			if (feature < 0 || feature > 2)
+				throw std::exception(TsPrintf("Invalid Worley feature: %d", feature).c_str());
+
+			auto worley = std::make_shared<re::Worley>(domainSize, divisions);
+			worley->SetFeature(static_cast<re::Worley::Feature>(feature));
+			m_Noises.push_back(worley);
+			return m_Noises.size() - 1;
+		});
+
 		state.set("reMarble", [&](re::real domainSize, re::real frequency, re::real turbolence) -> int {
 			m_Noises.push_back(std::shared_ptr<re::Noise>(new re::Marble(domainSize, frequency, turbolence)));
 			return m_Noises.size() - 1;
@@ -639,18 +834,29 @@ void sb::Sandbox::UpdateScene()
 			position = { x,y,z };
 		});
 
+		state.set("reRotation", [&](re::real x, re::real y, re::real z) -> void {
+			rotation = { x,y,z };
+		});
+
 		state.set("reScale", [&](re::real x, re::real y, re::real z) -> void {
 			scale = { x,y,z };
 		});
 
+		// Adds a node with the current position, rotation and scale
+		auto addShapeNode = [&]() -> std::shared_ptr<re::SceneNode> {
+			auto node = m_Scene->GetRoot()->AddChild();
+			auto transform = node->GetComponentOfType<re::Transform>();
+			transform->Position = position;
+			transform->Rotation = rotation;
+			transform->Scale = scale;
+			return node;
+		};
+
 		state.set("reSphere", [&](size_t material) -> void {
 
 			CheckSize(m_Materials, material, "Invalid material: %d", material);
 
-			auto sphereNode = m_Scene->GetRoot()->AddChild();
-			sphereNode->GetComponentOfType<re::Transform>()->Position = position;
-			sphereNode->GetComponentOfType<re::Transform>()->Scale = scale;
-			auto sphere = sphereNode->AddComponent<re::Sphere>();
+			auto sphere = addShapeNode()->AddComponent<re::Sphere>();
 			sphere->Material = m_Materials[material].get();
 		});
 
@@ -658,40 +864,159 @@ void sb::Sandbox::UpdateScene()
 			
 			CheckSize(m_Materials, material, "Invalid material: %d", material);
 
-			auto planeNode = m_Scene->GetRoot()->AddChild();
-			planeNode->GetComponentOfType<re::Transform>()->Position = position;
-			planeNode->GetComponentOfType<re::Transform>()->Scale = scale;
-			auto plane = planeNode->AddComponent<re::Plane>();
+			auto plane = addShapeNode()->AddComponent<re::Plane>();
 			plane->Normal = { nx, ny, nz };
 			plane->Material = m_Materials[material].get();
 		});
 
-		state.set("reObjMesh", [&](int material, std::string file, std::string group) -> void {
+		// A plane with a finite extent, halfWidth and halfHeight are along the tangents of the plane
+		// (X and -Z for a floor, X and Y for a wall facing Z)
+		state.set("reQuad", [&](int material, re::real nx, re::real ny, re::real nz, re::real halfWidth, re::real halfHeight) -> void {
+
+			CheckSize(m_Materials, material, "Invalid material: %d", material);
+
+			auto plane = addShapeNode()->AddComponent<re::Plane>();
+			plane->Normal = { nx, ny, nz };
+			plane->Extent = { halfWidth, halfHeight };
+			plane->Material = m_Materials[material].get();
+		});
+
+		// Analytic shapes, sized with reScale: the box and the cylinder go from -1 to 1, the disk
+		// and the torus have a radius of 1
+		state.set("reBox", [&](size_t material) -> void {
+
+			CheckSize(m_Materials, material, "Invalid material: %d", material);
+
+			auto box = addShapeNode()->AddComponent<re::Box>();
+			box->Material = m_Materials[material].get();
+		});
+
+		state.set("reCylinder", [&](size_t material, bool capped) -> void {
 
 			CheckSize(m_Materials, material, "Invalid material: %d", material);
 
-			auto wfData = LoadWavefront(file);
+			auto cylinder = addShapeNode()->AddComponent<re::Cylinder>();
+			cylinder->Capped = capped;
+			cylinder->Material = m_Materials[material].get();
+		});
 
-			auto meshNode = m_Scene->GetRoot()->AddChild();
-			auto mesh = meshNode->AddComponent<re::Mesh>();
+		state.set("reDisk", [&](size_t material) -> void {
 
-			meshNode->GetComponentOfType<re::Transform>()->Position = position;
-			meshNode->GetComponentOfType<re::Transform>()->Scale = scale;
+			CheckSize(m_Materials, material, "Invalid material: %d", material);
 
-			if (wfData.find(group) == wfData.end())
+			auto disk = addShapeNode()->AddComponent<re::Disk>();
+			disk->Material = m_Materials[material].get();
+		});
+
+		state.set("reTorus", [&](size_t material, re::real minorRadius) -> void {
+
+			CheckSize(m_Materials, material, "Invalid material: %d", material);
+
+			auto torus = addShapeNode()->AddComponent<re::Torus>();
+			torus->MinorRadius = minorRadius;
+			torus->Material = m_Materials[material].get();
+		});
+
+		// Mesh assets are loaded once and shared by every mesh that uses them
+		auto loadMeshAsset = [&](const std::string& file, const std::string& group) -> int {
+
+			auto key = file + ":" + group;
+			auto it = m_MeshAssetNames.find(key);
+
+			if (it != m_MeshAssetNames.end())
+				return it->second;
+
+			auto asset = LoadCachedMesh(file, group, Settings.MeshNodeFormat);
+
+			if (asset == nullptr)
 				throw std::exception(TsPrintf("Invalid obj group: %s", group.c_str()).c_str());
 
-			for (auto f : wfData[group])
-			{
-				auto& t = mesh->AddTriangle();
-				t.Vertices = { f.Vertices[0], f.Vertices[1], f.Vertices[2] };
-				t.Normals = { f.Normals[0], f.Normals[1], f.Normals[2] };
-			}
+			m_MeshAssets.push_back(asset);
+			m_MeshAssetNames[key] = m_MeshAssets.size() - 1;
+			return m_MeshAssets.size() - 1;
+		};
+
+		auto addMeshInstance = [&](int meshAsset, int material) -> void {
+
+			CheckSize(m_MeshAssets, meshAsset, "Invalid mesh: %d", meshAsset);
+			CheckSize(m_Materials, material, "Invalid material: %d", material);
 
+			auto mesh = addShapeNode()->AddComponent<re::Mesh>();
+
+			mesh->SetAsset(m_MeshAssets[meshAsset]);
 			mesh->NormalMode = re::NormalModes::Vertex;
 			mesh->Material = m_Materials[material].get();
+		};
+
+		state.set("reObjMesh", [&](int material, std::string file, std::string group) -> void {
+			addMeshInstance(loadMeshAsset(file, group), material);
 		});
 
+		state.set("reMeshAsset", [&](std::string file, std::string group) -> int {
+			return loadMeshAsset(file, group);
+		});
+
+		state.set("reInstance", [&](int meshAsset, int material) -> void {
+			addMeshInstance(meshAsset, material);
+		});
+
+		// Sphere clouds take their spheres in bulk: reSphereCloud(material, centers, radii), where centers is
+		// a flat array (x0, y0, z0, x1, ...) and radii is an array or a single radius. The function is
+		// bound with the Lua API, so that the tables are read directly
+		std::function<int(lua_State*)> addSphereCloud = [&](lua_State* L) -> int {
+
+			size_t material = static_cast<size_t>(luaL_checkinteger(L, 1));
+			luaL_checktype(L, 2, LUA_TTABLE);
+
+			bool uniformRadius = !lua_istable(L, 3);
+			re::real radius = uniformRadius ? luaL_checknumber(L, 3) : 0;
+
+			CheckSize(m_Materials, material, "Invalid material: %d", material);
+
+			// Centers are flattened, 3 coordinates per sphere
+			if (lua_rawlen(L, 2) % 3 != 0)
+				throw std::exception(TsPrintf("Invalid sphere cloud: %zu center coordinates", lua_rawlen(L, 2)).c_str());
+
+			size_t count = lua_rawlen(L, 2) / 3;
+
+			if (!uniformRadius && lua_rawlen(L, 3) != count)
+				throw std::exception(TsPrintf("Invalid sphere cloud: %zu centers, %zu radii", count, lua_rawlen(L, 3)).c_str());
+
+			std::vector<re::Vector3> centers(count);
+			std::vector<re::real> radii(count, radius);
+
+			for (size_t i = 0; i < count; i++)
+			{
+				for (int axis = 0; axis < 3; axis++)
+				{
+					lua_rawgeti(L, 2, i * 3 + axis + 1);
+					centers[i].Elements[axis] = lua_tonumber(L, -1);
+					lua_pop(L, 1);
+				}
+
+				if (!uniformRadius)
+				{
+					lua_rawgeti(L, 3, i + 1);
+					radii[i] = lua_tonumber(L, -1);
+					lua_pop(L, 1);
+				}
+			}
+
+			auto cloud = addShapeNode()->AddComponent<re::SphereCloud>();
+			cloud->SetSpheres({ centers.data(), centers.size() }, { radii.data(), radii.size() });
+			cloud->Material = m_Materials[material].get();
+
+			return 0;
+		};
+
+		lua_State * luaState = state.getState();
+		lua_pushlightuserdata(luaState, &addSphereCloud);
+		lua_pushcclosure(luaState, [](lua_State* L) -> int {
+			auto function = static_cast<std::function<int(lua_State*)>*>(lua_touserdata(L, lua_upvalueindex(1)));
+			return (*function)(L);
+		}, 1);
+		lua_setglobal(luaState, "reSphereCloud");
+
 
 		// Lights
 		state.set("reAmbientLight", [&](int color) -> int {
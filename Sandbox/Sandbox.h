@@ -9,6 +9,9 @@
 #include <map>
 #include <re.h>
 
+#include "MeshBenchmark.h"
+#include "NoiseBenchmark.h"
+
 
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
@@ -49,6 +52,12 @@ namespace sb
 
 		void StartRaytracer();
 
+		/// Interrupts the raytracer and waits for it to stop
+		void StopRaytracer();
+
+		void SetMeshNodeFormat(re::NodeFormats format);
+		void RunMeshBenchmark();
+
 
 		std::pair<re::real, re::real> GetCursorPos();
 		std::pair<re::real, re::real> GetWindowSize();
@@ -60,21 +69,34 @@ namespace sb
 		unsigned int m_Width, m_Height;
 
 		bool m_SceneDirty = true, m_ValidRender = false, m_ShowImGui = true;
+		unsigned int m_DisplayedPasses = 0;
 
 		struct {
 			re::Raytracer::AAMode Antialiasing = re::Raytracer::AAMode::None;
 			int MaxRecursion = 3;
+			bool FilterNoises = true;
+			unsigned int LightSamples = 0;
+			int Passes = 1;
+			re::NodeFormats MeshNodeFormat = re::NodeFormats::Full;
+			unsigned int NoiseBakeResolution = 0;
+			unsigned int EnvironmentBakeResolution = 0;
 		} Settings;
 
 
 		std::future<re::Renderer::RenderStatus> m_RaytracerFuture;
 
 		std::shared_ptr<re::Scene> m_Scene;
+		re::Scene::MemoryReport m_MemoryReport;
 		std::shared_ptr<re::Raytracer> m_Raytracer;
 		std::shared_ptr<re::DebugRaycaster> m_Raycaster;
 		std::vector<std::shared_ptr<re::Material>> m_Materials;
 		std::vector<std::shared_ptr<re::Noise>> m_Noises;
+		std::vector<std::shared_ptr<re::Texture>> m_Textures;
 		std::vector<std::shared_ptr<re::Light>> m_Lights;
+		std::vector<std::shared_ptr<re::MeshAsset>> m_MeshAssets;
+		std::map<std::string, size_t> m_MeshAssetNames;
+		std::vector<std::vector<MeshBenchmarkResult>> m_MeshBenchmarkResults;
+		std::vector<NoiseBenchmarkResult> m_NoiseBenchmarkResults;
 
 
 		
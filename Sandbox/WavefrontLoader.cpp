@@ -1,103 +1,476 @@
 #include "WavefrontLoader.h"
+#include "MappedFile.h"
 
-#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <future>
 #include <string>
-#include <sstream>
+#include <string_view>
+#include <thread>
 
 namespace sb
 {
+	namespace
+	{
+		/// Files smaller than this are not split
+		constexpr size_t MinChunkSize = 1 << 20;
 
+		constexpr std::string_view DefaultGroup = "default";
 
-	WfData LoadWavefront(const std::string fileName)
-	{
-		static auto parseFaceVertex = [](const std::string& str) -> std::array<int, 3> 
+		/// Powers of 10 that are exactly representable as doubles
+		constexpr double ExactPowersOf10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+
+		inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+		inline bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+		inline const char * SkipSpaces(const char * p, const char * end)
 		{
-			std::array<int, 3> result;
+			while (p < end && IsSpace(*p)) p++;
+			return p;
+		}
 
-			size_t pos0 = std::string::npos;
-			size_t pos1 = std::string::npos;
+		inline const char * SkipToken(const char * p, const char * end)
+		{
+			while (p < end && !IsSpace(*p) && *p != '\n') p++;
+			return p;
+		}
 
-			pos0 = str.find("/", 0);
+		inline const char * NextLine(const char * p, const char * end)
+		{
+			auto newLine = static_cast<const char*>(std::memchr(p, '\n', end - p));
+			return newLine != nullptr ? newLine + 1 : end;
+		}
 
-			if (pos0 != std::string::npos)
-				pos1 = str.find("/", pos0 + 1);
+		/// Parses a real number. Numbers with up to 19 significant digits and small exponents
+		/// are computed exactly without any library call, the others fall back to strtod
+		const char * ParseReal(const char * p, const char * end, re::real& result)
+		{
+			const char * start = p;
+			bool negative = false;
 
-			if (pos0 == std::string::npos && pos1 == std::string::npos)
-				result = { std::atoi(str.c_str()), 0, 0 };
-			else if (pos1 == std::string::npos)
-				result = { std::atoi(str.substr(0, pos0).c_str()), std::atoi(str.substr(pos0 + 1).c_str()), 0 };
-			else if(pos0 + 1 == pos1)
-				result = { std::atoi(str.substr(0, pos0).c_str()), 0, std::atoi(str.substr(pos1 + 1).c_str()) };
-			else
-				result = { std::atoi(str.substr(0, pos0).c_str()), std::atoi(str.substr(pos0 + 1, pos1).c_str()), std::atoi(str.substr(pos1 + 1).c_str()) };
+			if (p < end && (*p == '-' || *p == '+'))
+			{
+				negative = *p == '-';
+				p++;
+			}
 
-			for (auto &i : result)
-				i--;
+			uint64_t mantissa = 0;
+			int significantDigits = 0, exponent = 0;
+			bool anyDigit = false, truncated = false;
 
-			return result;
+			auto digit = [&](char c, bool fraction) {
+				anyDigit = true;
+				if (mantissa == 0 && c == '0')
+				{
+					if (fraction) exponent--;
+				}
+				else if (significantDigits < 19)
+				{
+					mantissa = mantissa * 10 + (c - '0');
+					significantDigits++;
+					if (fraction) exponent--;
+				}
+				else
+				{
+					truncated = true;
+					if (!fraction) exponent++;
+				}
+			};
 
-		};
+			while (p < end && IsDigit(*p)) digit(*p++, false);
 
-		WfData result;
-		std::string currentGroup = "default";
+			if (p < end && *p == '.')
+			{
+				p++;
+				while (p < end && IsDigit(*p)) digit(*p++, true);
+			}
 
-		std::vector<re::Vector3> vertices, normals;
-		std::vector<re::Vector2> texCoords;
+			if (!anyDigit)
+			{
+				result = 0;
+				return SkipToken(start, end);
+			}
 
-		std::ifstream is;
-		is.open(fileName);
+			if (p < end && (*p == 'e' || *p == 'E'))
+			{
+				const char * e = p + 1;
+				bool negativeExponent = false;
 
-		std::string line;
+				if (e < end && (*e == '-' || *e == '+'))
+				{
+					negativeExponent = *e == '-';
+					e++;
+				}
 
-		while (is.good())
-		{
-			re::real a, b, c;
-			std::getline(is, line);
-			std::stringstream ss(line);
-			std::string token;
-
-			ss >> token;
-			
-			if (token == "v")
+				if (e < end && IsDigit(*e))
+				{
+					int value = 0;
+					while (e < end && IsDigit(*e))
+					{
+						value = std::min(value * 10 + (*e - '0'), 100000);
+						e++;
+					}
+					exponent += negativeExponent ? -value : value;
+					p = e;
+				}
+			}
+
+			if (!truncated && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
 			{
-				ss >> a >> b >> c;
-				vertices.push_back({ a, b, c });
+				double value = static_cast<double>(mantissa);
+				value = exponent < 0 ? value / ExactPowersOf10[-exponent] : value * ExactPowersOf10[exponent];
+				result = static_cast<re::real>(negative ? -value : value);
 			}
-			else if (token == "vt")
+			else
 			{
-				ss >> a >> b;
-				texCoords.push_back({ a, b });
+				char buffer[128];
+				size_t length = std::min(static_cast<size_t>(p - start), sizeof(buffer) - 1);
+				std::memcpy(buffer, start, length);
+				buffer[length] = '\0';
+				result = static_cast<re::real>(std::strtod(buffer, nullptr));
 			}
-			else if (token == "vn")
+
+			return p;
+		}
+
+		/// Parses a signed integer. Returns false if there are no digits
+		inline bool ParseInt(const char *& p, const char * end, int& result)
+		{
+			bool negative = false;
+
+			if (p < end && (*p == '-' || *p == '+'))
 			{
-				ss >> a >> b >> c;
-				normals.push_back({ a, b, c });
+				negative = *p == '-';
+				p++;
 			}
-			else if (token == "g")
+
+			if (p == end || !IsDigit(*p))
+				return false;
+
+			int64_t value = 0;
+			while (p < end && IsDigit(*p))
 			{
-				ss >> currentGroup;
+				value = std::min<int64_t>(value * 10 + (*p - '0'), INT32_MAX);
+				p++;
 			}
-			else if (token == "f")
+
+			result = static_cast<int>(negative ? -value : value);
+			return true;
+		}
+
+		/// Converts a 1-based (or negative, relative) obj index to a 0-based index.
+		/// Returns -1 for invalid indices
+		inline int ResolveIndex(int index, size_t count)
+		{
+			int64_t result = index > 0 ? int64_t(index) - 1 : int64_t(count) + index;
+			return index != 0 && result >= 0 && result < int64_t(count) ? static_cast<int>(result) : -1;
+		}
+
+		enum class LineType { Other, Position, TexCoord, Normal, Face, Group };
+
+		inline LineType GetLineType(const char *& p, const char * end)
+		{
+			p = SkipSpaces(p, end);
+
+			if (p + 1 >= end)
+				return LineType::Other;
+
+			auto separator = [](char c) { return c == ' ' || c == '\t'; };
+
+			switch (p[0])
+			{
+			case 'v':
+				if (separator(p[1])) { p += 2; return LineType::Position; }
+				if (p + 2 < end && separator(p[2]))
+				{
+					if (p[1] == 't') { p += 3; return LineType::TexCoord; }
+					if (p[1] == 'n') { p += 3; return LineType::Normal; }
+				}
+				break;
+			case 'f':
+				if (separator(p[1])) { p += 2; return LineType::Face; }
+				break;
+			case 'g':
+				if (separator(p[1])) { p += 2; return LineType::Group; }
+				break;
+			}
+
+			return LineType::Other;
+		}
+
+		inline std::string_view ParseGroupName(const char * p, const char * end)
+		{
+			p = SkipSpaces(p, end);
+			return std::string_view(p, SkipToken(p, end) - p);
+		}
+
+		struct Chunk
+		{
+			const char * Begin = nullptr;
+			const char * End = nullptr;
+
+			// First pass
+			size_t PositionCount = 0, TexCoordCount = 0, NormalCount = 0;
+			std::string_view LastGroup;
+
+			// Second pass
+			size_t PositionBase = 0, TexCoordBase = 0, NormalBase = 0;
+			std::string_view StartGroup;
+			std::vector<std::pair<std::string_view, WfGroup>> Groups;
+		};
+
+		void CountChunk(Chunk& chunk)
+		{
+			for (const char * line = chunk.Begin; line < chunk.End; line = NextLine(line, chunk.End))
 			{
-				WfFace face;
-				while (ss.good())
+				const char * p = line;
+
+				switch (GetLineType(p, chunk.End))
+				{
+				case LineType::Position: chunk.PositionCount++; break;
+				case LineType::TexCoord: chunk.TexCoordCount++; break;
+				case LineType::Normal: chunk.NormalCount++; break;
+				case LineType::Group:
 				{
-					std::string faceStr;
-					ss >> faceStr;
+					auto name = ParseGroupName(p, chunk.End);
+					if (!name.empty())
+						chunk.LastGroup = name;
+					break;
+				}
+				default:
+					break;
+				}
+			}
+		}
+
+		void ParseChunk(Chunk& chunk, WfData& data)
+		{
+			const char * end = chunk.End;
+
+			re::Vector3 * positions = data.Positions.data() + chunk.PositionBase;
+			re::Vector3 * normals = data.Normals.data() + chunk.NormalBase;
+			re::Vector2 * texCoords = data.TexCoords.data() + chunk.TexCoordBase;
 
-					auto [v, vt, vn] = parseFaceVertex(faceStr);
+			size_t positionCount = chunk.PositionBase;
+			size_t normalCount = chunk.NormalBase;
+			size_t texCoordCount = chunk.TexCoordBase;
 
-					face.Vertices.push_back(vertices[v]);
-					face.TexCoords.push_back(vt != -1 ? texCoords[vt] : re::Vector2::Zero);
-					face.Normals.push_back(vn != -1 ? normals[vn] : re::Vector3::Zero);
+			WfGroup * currentGroup = nullptr;
+
+			auto selectGroup = [&](std::string_view name) {
+				for (auto& g : chunk.Groups)
+				{
+					if (g.first == name)
+					{
+						currentGroup = &g.second;
+						return;
+					}
 				}
+				chunk.Groups.push_back({ name, {} });
+				currentGroup = &chunk.Groups.back().second;
+			};
+
+			selectGroup(chunk.StartGroup);
 
-				result[currentGroup].push_back(face);
+			// Reused for every face, so that parsing doesn't allocate
+			std::vector<WfIndex> polygon;
+
+			for (const char * line = chunk.Begin; line < end; line = NextLine(line, end))
+			{
+				const char * p = line;
 
+				switch (GetLineType(p, end))
+				{
+				case LineType::Position:
+				{
+					auto& v = *positions++;
+					p = ParseReal(SkipSpaces(p, end), end, v.X);
+					p = ParseReal(SkipSpaces(p, end), end, v.Y);
+					p = ParseReal(SkipSpaces(p, end), end, v.Z);
+					positionCount++;
+					break;
+				}
+				case LineType::TexCoord:
+				{
+					auto& v = *texCoords++;
+					p = ParseReal(SkipSpaces(p, end), end, v.X);
+					p = SkipSpaces(p, end);
+					if (p < end && *p != '\n')
+						p = ParseReal(p, end, v.Y);
+					texCoordCount++;
+					break;
+				}
+				case LineType::Normal:
+				{
+					auto& v = *normals++;
+					p = ParseReal(SkipSpaces(p, end), end, v.X);
+					p = ParseReal(SkipSpaces(p, end), end, v.Y);
+					p = ParseReal(SkipSpaces(p, end), end, v.Z);
+					normalCount++;
+					break;
+				}
+				case LineType::Group:
+				{
+					auto name = ParseGroupName(p, end);
+					if (!name.empty())
+						selectGroup(name);
+					break;
+				}
+				case LineType::Face:
+				{
+					polygon.clear();
+					bool valid = true;
+
+					while (true)
+					{
+						p = SkipSpaces(p, end);
+
+						if (p == end || *p == '\n')
+							break;
+
+						WfIndex index;
+						int value;
+
+						if (!ParseInt(p, end, value))
+						{
+							valid = false;
+							break;
+						}
+
+						index.Position = ResolveIndex(value, positionCount);
+
+						if (p < end && *p == '/')
+						{
+							p++;
+							if (ParseInt(p, end, value))
+								index.TexCoord = ResolveIndex(value, texCoordCount);
+
+							if (p < end && *p == '/')
+							{
+								p++;
+								if (ParseInt(p, end, value))
+									index.Normal = ResolveIndex(value, normalCount);
+							}
+						}
+
+						valid = valid && index.Position != -1;
+						polygon.push_back(index);
+						p = SkipToken(p, end);
+					}
+
+					if (valid && polygon.size() >= 3)
+					{
+						// Triangulate as a fan
+						for (size_t i = 1; i + 1 < polygon.size(); i++)
+						{
+							currentGroup->push_back(polygon[0]);
+							currentGroup->push_back(polygon[i]);
+							currentGroup->push_back(polygon[i + 1]);
+						}
+					}
+					break;
+				}
+				default:
+					break;
+				}
 			}
+		}
+	}
+
+	WfData LoadWavefront(const std::string& fileName, unsigned int numThreads)
+	{
+		WfData result;
+
+		MappedFile file;
+		if (!file.Open(fileName) || file.GetSize() == 0)
+			return result;
+
+		const char * begin = file.GetData();
+		const char * end = begin + file.GetSize();
+
+		if (numThreads == 0)
+			numThreads = std::max(1u, std::thread::hardware_concurrency());
 
+		// Split the file in chunks at line boundaries
+		size_t chunkCount = std::max<size_t>(1, std::min<size_t>(numThreads, file.GetSize() / MinChunkSize));
+		std::vector<Chunk> chunks(chunkCount);
+
+		const char * chunkBegin = begin;
+		for (size_t i = 0; i < chunkCount; i++)
+		{
+			const char * chunkEnd = i + 1 == chunkCount ? end : begin + file.GetSize() * (i + 1) / chunkCount;
+			chunkEnd = std::max(chunkBegin, chunkEnd);
+
+			if (chunkEnd < end && chunkEnd > begin && chunkEnd[-1] != '\n')
+				chunkEnd = NextLine(chunkEnd, end);
+
+			chunks[i].Begin = chunkBegin;
+			chunks[i].End = chunkEnd;
+			chunkBegin = chunkEnd;
 		}
-	
+
+		auto forEachChunk = [&](auto func) {
+			std::vector<std::future<void>> futures;
+
+			for (size_t i = 1; i < chunks.size(); i++)
+				futures.push_back(std::async(std::launch::async, func, std::ref(chunks[i])));
+
+			func(chunks[0]);
+
+			for (auto& f : futures)
+				f.wait();
+		};
+
+		// First pass: count the vertex attributes of every chunk, so that each chunk knows
+		// where its data starts and relative indices can be resolved during the second pass
+		forEachChunk([](Chunk& chunk) { CountChunk(chunk); });
+
+		std::string_view group = DefaultGroup;
+		size_t positions = 0, texCoords = 0, normals = 0;
+
+		for (auto& chunk : chunks)
+		{
+			chunk.PositionBase = positions;
+			chunk.TexCoordBase = texCoords;
+			chunk.NormalBase = normals;
+			chunk.StartGroup = group;
+
+			positions += chunk.PositionCount;
+			texCoords += chunk.TexCoordCount;
+			normals += chunk.NormalCount;
+
+			if (!chunk.LastGroup.empty())
+				group = chunk.LastGroup;
+		}
+
+		result.Positions.resize(positions);
+		result.TexCoords.resize(texCoords);
+		result.Normals.resize(normals);
+
+		// Second pass: every chunk writes its vertex attributes in place
+		forEachChunk([&result](Chunk& chunk) { ParseChunk(chunk, result); });
+
+		for (auto& chunk : chunks)
+		{
+			for (auto& g : chunk.Groups)
+			{
+				if (g.second.empty())
+					continue;
+
+				auto& target = result.Groups[std::string(g.first)];
+
+				if (target.empty())
+					target = std::move(g.second);
+				else
+					target.insert(target.end(), g.second.begin(), g.second.end());
+			}
+		}
+
 		return result;
 	}
-}
\ No newline at end of file
+}
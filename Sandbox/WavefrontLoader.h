@@ -8,18 +8,27 @@
 namespace sb
 {
 
-	struct WfFace
+	/// Indices of a face vertex. Missing attributes are set to -1
+	struct WfIndex
 	{
-		std::vector<re::Vector3> Vertices;
-		std::vector<re::Vector3> Normals;
-		std::vector<re::Vector2> TexCoords;
+		int Position = -1;
+		int TexCoord = -1;
+		int Normal = -1;
 	};
 
+	/// Triangle list of a group, 3 indices per triangle. Polygons are triangulated as fans
+	using WfGroup = std::vector<WfIndex>;
 
-	using WfGroup = std::vector<WfFace>;
-	using WfData = std::map<std::string, WfGroup>;
+	struct WfData
+	{
+		std::vector<re::Vector3> Positions;
+		std::vector<re::Vector3> Normals;
+		std::vector<re::Vector2> TexCoords;
+		std::map<std::string, WfGroup> Groups;
+	};
 
-	WfData LoadWavefront(const std::string fileName);
+	/// Loads a Wavefront .obj file. The file is memory mapped and parsed in parallel chunks.
+	/// If numThreads is 0, the number of hardware threads is used
+	WfData LoadWavefront(const std::string& fileName, unsigned int numThreads = 0);
 
 }
-
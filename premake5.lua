@@ -64,6 +64,7 @@ project "Raytracer"
     language "C++"
     location "Raytracer"
     cppdialect "C++17"
+    vectorextensions "AVX2"
 
     targetdir "bin/%{cfg.buildcfg}/%{prj.name}"
     objdir "bin-int/%{cfg.buildcfg}/%{prj.name}"